@@ -53,6 +53,9 @@ void loop() {
   EthernetClient client = server.available();
   if (client) {
     Serial.println("new client");
+    // collect the many small prints below in the shield, up to 2 KB
+    // at a time, instead of sending a packet for each
+    client.setWriteCoalescing(2048);
     // an http request ends with a blank line
     boolean currentLineIsBlank = true;
     while (client.connected()) {
@@ -81,6 +84,7 @@ void loop() {
             client.println("<br />");
           }
           client.println("</html>");
+          client.flush();
           break;
         }
         if (c == '\n') {
@@ -0,0 +1,284 @@
+/*
+ * The client and UDP classes at their edges: calls on objects with no socket,
+ * and reads that cross what the driver has already buffered.
+ */
+
+#include "test.h"
+
+// An unconnected client or an unbegun EthernetUDP holds socket MAX_SOCK_NUM;
+// every call on it fails without touching the chip or per-socket state
+static void noSocket()
+{
+  static TestNet net(55);
+  uint8_t buf[16];
+
+  net.mock.resetStats();
+  EthernetClient client(net.eth);
+  CHECK_EQ(client.read(), -1);
+  CHECK_EQ(client.read(buf, sizeof(buf)), -1);
+  CHECK_EQ(client.peek(), -1);
+  CHECK_EQ(client.available(), 0);
+  CHECK_EQ(client.write(buf, sizeof(buf)), 0);
+  CHECK_EQ(client.readBytes(buf, sizeof(buf)), 0);
+
+  EthernetUDP udp(net.eth);
+  CHECK_EQ(udp.available(), 0);
+  CHECK_EQ(udp.parsePacket(), 0);
+  CHECK_EQ(udp.beginPacket(IPAddress(10, 0, 0, 9), 7), 0);
+  CHECK_EQ(udp.write(buf, sizeof(buf)), 0);
+  CHECK_EQ(udp.endPacket(), 0);
+  CHECK_EQ(udp.read(), -1);
+  CHECK_EQ(net.mock.frames, 0);
+
+  // The socket layer ignores socket numbers past its state
+  CHECK_EQ(recv(net.chip, MAX_SOCK_NUM, buf, sizeof(buf)), 0);
+  CHECK_EQ(recvAvailable(net.chip, MAX_SOCK_NUM), 0);
+  CHECK_EQ(recvSkip(net.chip, MAX_SOCK_NUM, 1), 0);
+  CHECK_EQ(bufferData(net.chip, MAX_SOCK_NUM, 0, buf, sizeof(buf)), 0);
+  CHECK_EQ(startUDP(net.chip, MAX_SOCK_NUM, buf, 7), 0);
+  CHECK_EQ(socketStatus(net.chip, MAX_SOCK_NUM), SnSR::CLOSED);
+  CHECK_EQ(net.mock.frames, 0);
+}
+
+// A W5100 has four sockets: the ones past them have no buffers and are
+// refused like an unconnected client's, with no bus traffic
+static void missingSocket()
+{
+  static TestNet net(51);
+  uint8_t buf[16] = { 10, 0, 0, 9 };
+  CHECK_EQ(net.chip.getSocketCount(), 4);
+  CHECK_EQ(net.chip.SSIZE[4], 0);
+
+  net.mock.resetStats();
+  for (SOCKET s = 4; s < MAX_SOCK_NUM; s++) {
+    CHECK_EQ(socket(net.chip, s, SnMR::TCP, 0, 0), 0);
+    CHECK_EQ(connect(net.chip, s, buf, 80), 0);
+    CHECK_EQ(send(net.chip, s, buf, sizeof(buf)), 0);
+    CHECK_EQ(recv(net.chip, s, buf, sizeof(buf)), 0);
+    CHECK_EQ(sendto(net.chip, s, buf, sizeof(buf), buf, 7), 0);
+    CHECK_EQ(bufferData(net.chip, s, 0, buf, sizeof(buf)), 0);
+    CHECK_EQ(socketStatus(net.chip, s), SnSR::CLOSED);
+  }
+  CHECK_EQ(net.mock.frames, 0);
+  CHECK_EQ(net.chip.socketsOwned, 0);
+}
+
+// A socket given up while the chip still has it connected is not handed
+// out again until the chip has closed it
+static void acquireOpen()
+{
+  static TestNet net(55);
+  EthernetClient a(net.eth);
+  CHECK(a.connect(IPAddress(10, 0, 0, 9), 80));
+  SOCKET s = a.getSocketNumber();
+  socketRelease(net.chip, s);
+
+  EthernetClient b(net.eth);
+  CHECK(b.connect(IPAddress(10, 0, 0, 9), 80));
+  CHECK(b.getSocketNumber() != s);
+  CHECK_EQ(a.status(), SnSR::ESTABLISHED);
+  b.stop();
+
+  net.mock.setStatus(s, SnSR::CLOSED);
+  CHECK_EQ(socketAcquire(net.chip), s);
+  close(net.chip, s);
+}
+
+// Data a coalescing delay held back goes out from maintain() once the delay
+// is up, with no further call on the client
+static void pending()
+{
+  static TestNet net(55);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  client.setWriteCoalescing(2048, 5);
+
+  net.mock.resetStats();
+  client.write("line of text\r\n");
+  net.eth.maintain();
+  CHECK_EQ(net.mock.commands, 0);
+  delay(10);
+  net.eth.maintain();
+  CHECK_EQ(net.mock.commands, 1);
+  client.stop();
+}
+
+// A write to a connection the peer has closed comes back short and leaves
+// the socket with its client until stop()
+static void writeClosed()
+{
+  static TestNet net(55);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  SOCKET s = client.getSocketNumber();
+
+  net.mock.setStatus(s, SnSR::CLOSED);
+  CHECK_EQ(client.write("lost"), 0);
+  CHECK(client.getWriteError());
+  CHECK(net.chip.socketsOwned & (1 << s));
+  client.stop();
+  CHECK(!(net.chip.socketsOwned & (1 << s)));
+}
+
+// availableForWrite() sees the space the chip has freed since the last
+// write, not just what the local count has left
+static void writeSpace()
+{
+  static TestNet net(55);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  CHECK_EQ(client.availableForWrite(), 2048);
+  client.write("line of text\r\n");
+  client.write("line of text\r\n");
+  client.flush();
+  CHECK_EQ(client.availableForWrite(), 2048);
+  client.stop();
+}
+
+// Background copies leave buf alone until asyncDone(), then count the
+// data as read or queue it for a SEND; the second read wraps around the
+// end of the Rx buffer
+static void asyncCopy(uint8_t model)
+{
+  TestNet *net = new TestNet(model);
+  EthernetClient client(net->eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  uint8_t in[2000], out[100];
+  for (uint8_t i = 0; i < sizeof(out); i++)
+    out[i] = 'a' + i % 26;
+  memset(in, 0, sizeof(in));
+  net->mock.inject(client.getSocketNumber(), in, sizeof(in));
+  CHECK_EQ(client.read(in, sizeof(in)), (int)sizeof(in));
+
+  net->mock.inject(client.getSocketNumber(), out, sizeof(out));
+  memset(in, 0, sizeof(in));
+  net->mock.resetStats();
+  CHECK_EQ(client.readAsync(in, sizeof(in)), (int)sizeof(out));
+  // The mock only runs a background frame when polled: one for the whole
+  // copy on the W5500, which wraps by itself, one per part on the W5200
+  uint32_t frames = net->mock.readFrames;
+  if (model != 51) {
+    CHECK_EQ(in[0], 0);
+    while (net->chip.asyncBusy())
+      ;
+    CHECK_EQ(net->mock.readFrames - frames, model == 52 ? 2u : 1u);
+  }
+  while (!client.asyncDone())
+    ;
+  CHECK(memcmp(in, out, sizeof(out)) == 0);
+  CHECK_EQ(client.available(), 0);
+  CHECK(client.asyncDone());
+
+  uint32_t commands = net->mock.commands;
+  CHECK_EQ(client.writeAsync(out, sizeof(out)), sizeof(out));
+  CHECK_EQ(net->mock.commands, commands);
+  while (!client.asyncDone())
+    ;
+  CHECK_EQ(net->mock.commands, commands + 1);
+  client.flush();
+  CHECK_EQ(client.availableForWrite(), 2048);
+  client.stop();
+  delete net;
+}
+
+// A W5500 mock on which the peer sends its last segment and resets the
+// connection just as the driver next reads socket s's status
+struct LastSegmentMock : EthernetMockTransport {
+  int8_t s;
+  const char *data;
+
+  LastSegmentMock() : EthernetMockTransport(55), s(-1), data(NULL) { }
+
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+  {
+    if (s >= 0 && hdr[0] == 0 && hdr[1] == 0x03 && hdr[2] == ((s << 5) | 0x08)) {
+      inject(s, (const uint8_t *)data, strlen(data));
+      setStatus(s, SnSR::CLOSED);
+      s = -1;
+    }
+    EthernetMockTransport::read(hdr, hdrlen, buf, len);
+  }
+};
+
+// find() still searches data that arrived together with the close
+static void findAtClose()
+{
+  static uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x01 };
+  static LastSegmentMock mock;
+  static W5100Class chip(mock);
+  static EthernetClass eth(chip);
+  eth.begin(mac, IPAddress(10, 0, 0, 2));
+  EthernetClient client(eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  client.setTimeout(100);
+
+  mock.data = "HTTP/1.1 200 OK\r\n\r\nbody";
+  mock.s = client.getSocketNumber();
+  CHECK(client.find("\r\n\r\n"));
+  CHECK_EQ(client.read(), 'b');
+  client.stop();
+}
+
+// EthernetUDP::skip() drops part of a packet without bus traffic, the size
+// being known since parsePacket(), and stops at the end of the packet
+static void udpSkip()
+{
+  static TestNet net(55);
+  static uint8_t packet[8 + 600] = { 10, 0, 0, 9, 0x13, 0x88, 600 >> 8, 600 & 0xFF };
+  for (int i = 0; i < 600; i++)
+    packet[8 + i] = i;
+  EthernetUDP udp(net.eth);
+  CHECK(udp.begin(5000));
+  net.mock.inject(0, packet, sizeof(packet));
+  CHECK_EQ(udp.parsePacket(), 600);
+
+  net.mock.resetStats();
+  CHECK_EQ(udp.skip(500), 500);
+  CHECK_EQ(net.mock.frames, 0);
+  CHECK_EQ(udp.available(), 100);
+  CHECK_EQ(udp.read(), 500 & 0xFF);
+  CHECK_EQ(udp.skip(1000), 99);
+  CHECK_EQ(udp.available(), 0);
+  CHECK_EQ(udp.skip(1), 0);
+  udp.stop();
+}
+
+// A line longer than what the read-ahead buffer holds comes back whole,
+// without losing the byte after the buffered part
+static void longLine()
+{
+  static TestNet net(55);
+  static uint8_t ahead[32];
+  static char data[128];
+  char line[128];
+  data[0] = 'x';
+  for (int i = 1; i <= 100; i++)
+    data[i] = 'a' + i % 26;
+  memcpy(data + 101, "\nrest", 5);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  client.setReadBuffer(ahead, sizeof(ahead));
+  net.mock.inject(client.getSocketNumber(), (const uint8_t *)data, 106);
+
+  CHECK_EQ(client.read(), 'x');
+  CHECK_EQ(client.readBytesUntil('\n', line, sizeof(line)), 100);
+  CHECK(memcmp(line, data + 1, 100) == 0);
+  CHECK_EQ(client.read(), 'r');
+  client.stop();
+}
+
+int main()
+{
+  noSocket();
+  missingSocket();
+  acquireOpen();
+  pending();
+  writeClosed();
+  writeSpace();
+  for (uint8_t i = 0; i < sizeof(test_chips); i++)
+    asyncCopy(test_chips[i]);
+  findAtClose();
+  udpSkip();
+  longLine();
+  return test_report("api");
+}
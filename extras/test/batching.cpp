@@ -0,0 +1,419 @@
+/*
+ * Bus traffic of the common operations, counted by EthernetMockTransport.
+ * The counts are what the driver does today; a change that moves one has
+ * changed how transfers are batched and should say so.
+ */
+
+#include "test.h"
+
+// A fixed socket's register offsets are known at compile time
+static_assert(W5100Class::snOffset(3, 0x0020) == 0x0320, "socket register offset");
+
+// A 16-bit register is one burst on the W5200/W5500, two frames on a W5100
+static void registers()
+{
+  static TestNet w5100(51), w5500(55);
+
+  w5100.mock.resetStats();
+  w5100.chip.beginTransaction();
+  w5100.chip.readSnTX_FSR(0);
+  w5100.chip.endTransaction();
+  CHECK_EQ(w5100.mock.frames, 2);
+
+  w5500.mock.resetStats();
+  w5500.chip.beginTransaction();
+  w5500.chip.readSnTX_FSR(0);
+  w5500.chip.endTransaction();
+  CHECK_EQ(w5500.mock.frames, 1);
+  CHECK_EQ(w5500.mock.transactions, 1);
+}
+
+// server.available() sweeps the server's sockets in one transaction, the
+// other one re-arms the backlog on a socket the chip has closed
+static void serverAvailable()
+{
+  static TestNet net(55);
+  EthernetServer server(80, net.eth);
+  server.begin();
+
+  net.mock.resetStats();
+  EthernetClient idle = server.available();
+  CHECK(!idle);
+  CHECK_EQ(net.mock.transactions, 2);
+  CHECK_EQ(net.mock.frames, 1);
+
+  net.mock.setStatus(0, SnSR::ESTABLISHED);
+  net.mock.inject(0, (const uint8_t *)"hello", 5);
+  net.mock.resetStats();
+  EthernetClient client = server.available();
+  CHECK(client);
+  CHECK_EQ(client.getSocketNumber(), 0);
+  CHECK_EQ(net.mock.transactions, 2);
+  CHECK_EQ(net.mock.frames, 14);
+}
+
+// Streaming 10 KB through one write() on the W5500: a SEND per 2 KB ring,
+// each chunk one frame
+static void stream10k()
+{
+  static TestNet net(55);
+  static uint8_t data[10240];
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+
+  net.mock.resetStats();
+  CHECK_EQ(client.write(data, sizeof(data)), sizeof(data));
+  client.flush();
+  CHECK_EQ(net.mock.commands, 5);
+  CHECK_EQ(net.mock.frames, 49);
+  client.stop();
+}
+
+// 40 printed lines: a SEND each without coalescing, one with it
+static void coalescing()
+{
+  static TestNet net(55);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+
+  net.mock.resetStats();
+  for (int i = 0; i < 40; i++)
+    client.write("line of text\r\n");
+  client.flush();
+  CHECK_EQ(net.mock.commands, 40);
+
+  client.setWriteCoalescing(2048);
+  net.mock.resetStats();
+  for (int i = 0; i < 40; i++)
+    client.write("line of text\r\n");
+  CHECK_EQ(net.mock.commands, 0);
+  client.flush();
+  CHECK_EQ(net.mock.commands, 1);
+  client.stop();
+}
+
+// A write the local count of free space covers reads neither the free size
+// nor the status: SnCR for the last command, the Tx pointer, the data, the
+// pointer again, SnIR read and cleared for the SEND in flight, the next SEND
+static void smallWrite()
+{
+  static TestNet net(55);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  client.write("line of text\r\n");
+
+  net.mock.resetStats();
+  client.write("line of text\r\n");
+  CHECK_EQ(net.mock.frames, 7);
+  client.stop();
+}
+
+// skip() moves RX_RD without clocking the data out, and leaves the RECV
+// for later since half the buffer has not been used up yet
+static void skip()
+{
+  static TestNet net(55);
+  static uint8_t data[1500];
+  for (int i = 0; i < 1500; i++)
+    data[i] = i;
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  net.mock.inject(client.getSocketNumber(), data, sizeof(data));
+
+  net.mock.resetStats();
+  CHECK_EQ(client.skip(1000), 1000);
+  CHECK_EQ(net.mock.frames, 2);
+  CHECK_EQ(net.mock.commands, 0);
+  CHECK_EQ(client.available(), 500);
+  CHECK_EQ(client.read(), 1000 & 0xFF);
+  client.stop();
+}
+
+// One socket given 8K each way: the layout reaches TMSR/RMSR on the W5100
+// and Sn_TX_SIZE/Sn_RX_SIZE on the W5500, 8 KB arrive in one go and go out
+// with one SEND.  A layout that does not fit falls back to 2K per socket.
+static void socketMemory()
+{
+  static uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x01 };
+  static const uint8_t w5100kb[MAX_SOCK_NUM] = { 4, 2, 1, 1, 2, 2, 2, 2 };
+  static const uint8_t w5500kb[MAX_SOCK_NUM] = { 8, 2, 1, 1, 1, 1, 1, 1 };
+  static const uint8_t toobig[MAX_SOCK_NUM] = { 8, 8, 8, 8, 8, 8, 8, 8 };
+  static const uint8_t invalid[MAX_SOCK_NUM] = { 3, 2, 2, 2, 2, 2, 2, 2 };
+  static uint8_t data[8192];
+  static TestNet w5100(51), w5500(55);
+
+  CHECK(w5100.chip.setSocketMemory(w5100kb, w5100kb));
+  w5100.eth.begin(mac, IPAddress(10, 0, 0, 2));
+  CHECK_EQ(w5100.chip.SSIZE[0], 4096);
+  CHECK_EQ(w5100.chip.RSIZE[3], 1024);
+  CHECK_EQ(w5100.mock.peek(0x001B), 0x06);
+  CHECK_EQ(w5100.mock.peek(0x001A), 0x06);
+  CHECK(!w5100.chip.setSocketMemory(invalid, invalid));
+  CHECK(w5100.chip.setSocketMemory(toobig, toobig));
+  w5100.eth.begin(mac, IPAddress(10, 0, 0, 2));
+  CHECK_EQ(w5100.chip.SSIZE[0], 2048);
+  CHECK_EQ(w5100.mock.peek(0x001B), 0x55);
+
+  CHECK(w5500.chip.setSocketMemory(w5500kb, w5500kb));
+  w5500.eth.begin(mac, IPAddress(10, 0, 0, 2));
+  CHECK_EQ(w5500.mock.peek(0x101E), 8);
+  CHECK_EQ(w5500.mock.peek(0x101F), 8);
+  CHECK_EQ(w5500.mock.peek(0x111F), 2);
+  CHECK_EQ(w5500.mock.peek(0x171F), 1);
+  EthernetClient client(w5500.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  CHECK_EQ(client.getSocketNumber(), 0);
+  CHECK_EQ(w5500.mock.inject(0, data, sizeof(data)), sizeof(data));
+  CHECK_EQ(client.available(), (int)sizeof(data));
+
+  w5500.mock.resetStats();
+  CHECK_EQ(client.write(data, sizeof(data)), sizeof(data));
+  client.flush();
+  CHECK_EQ(w5500.mock.commands, 1);
+  client.stop();
+}
+
+// Registers only the library writes are read back from RAM: the address
+// configuration and a connected socket's mode, port and destination cost
+// no frames.  LISTEN forgets the destination, which the peer fills in.
+static void shadow()
+{
+  static TestNet net(55);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  SOCKET s = client.getSocketNumber();
+  uint8_t ip[4];
+
+  net.mock.resetStats();
+  CHECK(net.eth.localIP() == IPAddress(10, 0, 0, 2));
+  CHECK(net.eth.subnetMask() == IPAddress(255, 255, 255, 0));
+  CHECK(net.eth.gatewayIP() == IPAddress(10, 0, 0, 1));
+  net.chip.beginTransaction();
+  CHECK_EQ(net.chip.readSnMR(s) & 0x0F, SnMR::TCP);
+  net.chip.readSnDIPR(s, ip);
+  CHECK(IPAddress(ip) == IPAddress(10, 0, 0, 9));
+  CHECK_EQ(net.chip.readSnDPORT(s), 80);
+  net.chip.endTransaction();
+  CHECK_EQ(net.mock.frames, 0);
+  client.stop();
+
+  CHECK(socket(net.chip, s, SnMR::TCP, 8080, 0));
+  CHECK(listen(net.chip, s));
+  net.mock.resetStats();
+  net.chip.beginTransaction();
+  CHECK_EQ(net.chip.readSnPORT(s), 8080);
+  CHECK_EQ(net.mock.frames, 0);
+  net.chip.readSnDIPR(s, ip);
+  CHECK_EQ(net.mock.frames, 1);
+  net.chip.endTransaction();
+  close(net.chip, s);
+}
+
+// A command costs one frame to issue and none to wait for until the next
+// one on the same socket, so commands on two sockets go out back to back.
+// A command the chip never takes times out instead of hanging.
+static void commands()
+{
+  static TestNet net(55);
+  net.mock.resetStats();
+  net.chip.beginTransaction();
+  net.chip.issueCmdSn(0, Sock_CLOSE);
+  net.chip.issueCmdSn(1, Sock_CLOSE);
+  CHECK_EQ(net.mock.frames, 2);
+  CHECK(net.chip.cmdDoneSn(0));
+  CHECK_EQ(net.mock.frames, 3);
+  CHECK(net.chip.cmdDoneSn(0));
+  CHECK_EQ(net.mock.frames, 3);
+  net.chip.issueCmdSn(1, Sock_CLOSE);
+  CHECK_EQ(net.mock.frames, 5);
+
+  // SnCR stuck at the command, as on a wedged chip
+  net.chip.issueCmdSn(2, Sock_CLOSE);
+  net.mock.poke(0x1201, Sock_CLOSE);
+  CHECK(!net.chip.cmdDoneSn(2));
+  unsigned long start = millis();
+  CHECK(!net.chip.waitCmdSn(2, 20));
+  CHECK(millis() - start >= 20);
+  // Given up on, so the next command goes out without waiting
+  net.mock.resetStats();
+  net.mock.poke(0x1201, 0);
+  net.chip.issueCmdSn(2, Sock_CLOSE);
+  CHECK_EQ(net.mock.frames, 1);
+  net.chip.endTransaction();
+}
+
+// A W5500 mock that knows whether the driver holds the bus
+struct HeldMock : EthernetMockTransport {
+  bool held;
+
+  HeldMock() : EthernetMockTransport(55), held(false) { }
+
+  virtual void beginTransaction() { EthernetMockTransport::beginTransaction(); held = true; }
+  virtual void endTransaction() { held = false; }
+};
+
+// A source on the same bus as the chip, such as an SD card: it must only be
+// read while the driver has let go of the bus
+struct BusSource : Stream {
+  HeldMock &mock;
+  uint32_t left, reads, clashes;
+
+  BusSource(HeldMock &_mock, uint32_t len) : mock(_mock), left(len), reads(0), clashes(0) { }
+
+  virtual int available() { return left; }
+  virtual int peek() { return left ? 'x' : -1; }
+  virtual int read()
+  {
+    if (!left)
+      return -1;
+    if (mock.held)
+      clashes++;
+    reads++;
+    left--;
+    return 'x';
+  }
+  virtual size_t write(uint8_t) { return 0; }
+};
+
+// writeFrom() takes its source a chunk at a time with the bus released and
+// queues each chunk in one transaction: 5000 bytes are 10 chunks, each
+// sent as soon as the SEND before it is done (at once on the mock), and
+// flush() has nothing left to send.  It stops once the source runs dry.
+static void streamFrom()
+{
+  static uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x01 };
+  static HeldMock mock;
+  static W5100Class chip(mock);
+  static EthernetClass eth(chip);
+  eth.begin(mac, IPAddress(10, 0, 0, 2));
+  EthernetClient client(eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+
+  BusSource src(mock, 5000);
+  mock.resetStats();
+  CHECK_EQ(client.writeFrom(src, 5000), 5000);
+  client.flush();
+  CHECK_EQ(src.reads, 5000);
+  CHECK_EQ(src.clashes, 0);
+  CHECK_EQ(mock.transactions, 11);
+  CHECK_EQ(mock.commands, 10);
+  CHECK_EQ(mock.frames, 75);
+
+  BusSource shortSrc(mock, 100);
+  CHECK_EQ(client.writeFrom(shortSrc, 1000), 100);
+  CHECK(!client.getWriteError());
+  client.stop();
+}
+
+// A header, body and trailer written as one: on the W5200 they land side
+// by side at the start of socket 0's Tx buffer, a frame each between one
+// Tx pointer read and one write, and go out with one SEND on TCP and UDP
+// alike, where three write() calls would have cost three SENDs
+static void gather()
+{
+  static TestNet tcp(52), udp(52);
+  static const char expect[] = "GET /index.html HTTP/1.0\r\n";
+  EthernetIovec iov[3] = {
+    { (const uint8_t *)"GET ", 4 },
+    { (const uint8_t *)"/index.html", 11 },
+    { (const uint8_t *)" HTTP/1.0\r\n", 11 }
+  };
+  char buf[sizeof(expect)];
+
+  EthernetClient client(tcp.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  CHECK_EQ(client.getSocketNumber(), 0);
+  tcp.mock.resetStats();
+  CHECK_EQ(client.write(iov, 3), 26);
+  CHECK_EQ(tcp.mock.commands, 1);
+  CHECK_EQ(tcp.mock.frames, 9);
+  for (uint8_t i = 0; i < 26; i++)
+    buf[i] = tcp.mock.peek(0x8000 + i);
+  buf[26] = 0;
+  CHECK(strcmp(buf, expect) == 0);
+  client.flush();
+  tcp.mock.resetStats();
+  for (uint8_t i = 0; i < 3; i++)
+    client.write(iov[i].data, iov[i].len);
+  CHECK_EQ(tcp.mock.commands, 3);
+  client.stop();
+
+  EthernetUDP packet(udp.eth);
+  CHECK(packet.begin(5000));
+  CHECK(packet.beginPacket(IPAddress(10, 0, 0, 9), 7));
+  udp.mock.resetStats();
+  CHECK_EQ(packet.write(iov, 3), 26);
+  CHECK_EQ(udp.mock.frames, 8);
+  CHECK(packet.endPacket());
+  CHECK_EQ(udp.mock.commands, 1);
+  for (uint8_t i = 0; i < 26; i++)
+    buf[i] = udp.mock.peek(0x8000 + i);
+  buf[26] = 0;
+  CHECK(strcmp(buf, expect) == 0);
+  packet.stop();
+}
+
+// A mock whose reads come back with a bit flipped above a clock limit
+struct ClockLimitMock : EthernetMockTransport {
+  uint32_t clock, limit;
+
+  ClockLimitMock(uint8_t model, uint32_t _limit) : EthernetMockTransport(model), clock(0), limit(_limit) { }
+
+  virtual void setClock(uint32_t _clock) { clock = _clock; }
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+  {
+    EthernetMockTransport::read(hdr, hdrlen, buf, len);
+    if (clock > limit && len)
+      buf[len - 1] ^= 0x01;
+  }
+};
+
+// Calibration stops at the first rate whose readback fails and keeps one
+// step below the last that passed: 4 patterns written and read back per
+// rate, a frame each way (a frame per byte on a W5100 without
+// auto-increment), and a single pattern at the failing rate
+struct ClockLimitNet {
+  ClockLimitMock mock;
+  W5100Class chip;
+  EthernetClass eth;
+
+  ClockLimitNet(uint8_t model, uint32_t limit) : mock(model, limit), chip(mock), eth(chip) { }
+};
+
+static void calibration(uint8_t model)
+{
+  static uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x01 };
+  ClockLimitNet *net = new ClockLimitNet(model, 24000000);
+  net->chip.setSPICalibration(80000000);
+  net->eth.begin(mac, IPAddress(10, 0, 0, 2));
+  CHECK_EQ(net->chip.getSPIClock(), 20000000);
+  CHECK_EQ(net->mock.clock, 20000000);
+
+  // 4..24 MHz pass, 28 MHz fails
+  uint32_t perPattern = (model == 51) ? 128 : 2;
+  net->mock.resetStats();
+  CHECK_EQ(net->chip.calibrateSPIClock(80000000), 20000000);
+  CHECK_EQ(net->mock.frames, (7 * 4 + 1) * perPattern);
+
+  // A limit the first step already misses falls back to the default
+  CHECK_EQ(net->chip.calibrateSPIClock(2000000), ETHERNET_SPI_CLOCK);
+  delete net;
+}
+
+int main()
+{
+  registers();
+  serverAvailable();
+  stream10k();
+  coalescing();
+  smallWrite();
+  skip();
+  socketMemory();
+  shadow();
+  commands();
+  streamFrom();
+  gather();
+  for (uint8_t i = 0; i < sizeof(test_chips); i++)
+    calibration(test_chips[i]);
+  return test_report("batching");
+}
@@ -0,0 +1,33 @@
+/*
+ * Host stand-in for the parts of the Arduino core the library uses, so the
+ * tests in extras/test can build it against EthernetMockTransport.
+ * delay(), millis() and yield() come from src/utility/host.cpp.
+ */
+
+#ifndef ARDUINO_H_HOST
+#define ARDUINO_H_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utility/host.h"
+
+typedef uint8_t byte;
+
+#define HEX 16
+
+inline long random(long howbig) { return howbig ? rand() % howbig : 0; }
+inline long random(long howsmall, long howbig) { return howsmall + random(howbig - howsmall); }
+inline uint16_t word(uint8_t h, uint8_t l) { return (h << 8) | l; }
+
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+#include "Client.h"
+#include "Server.h"
+#include "Udp.h"
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Host stand-in for the Arduino core's IPAddress.
+ */
+
+#ifndef IPADDRESS_H_HOST
+#define IPADDRESS_H_HOST
+
+#include <stdint.h>
+#include <string.h>
+
+class IPAddress {
+public:
+  IPAddress() { memset(bytes, 0, sizeof(bytes)); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+  {
+    bytes[0] = a;
+    bytes[1] = b;
+    bytes[2] = c;
+    bytes[3] = d;
+  }
+  IPAddress(uint32_t address) { memcpy(bytes, &address, sizeof(bytes)); }
+  IPAddress(const uint8_t *address) { memcpy(bytes, address, sizeof(bytes)); }
+
+  operator uint32_t() const
+  {
+    uint32_t address;
+    memcpy(&address, bytes, sizeof(address));
+    return address;
+  }
+  bool operator==(const IPAddress &addr) const { return memcmp(bytes, addr.bytes, sizeof(bytes)) == 0; }
+  bool operator==(const uint8_t *addr) const { return memcmp(bytes, addr, sizeof(bytes)) == 0; }
+  uint8_t operator[](int index) const { return bytes[index]; }
+  uint8_t &operator[](int index) { return bytes[index]; }
+  IPAddress &operator=(const uint8_t *address) { memcpy(bytes, address, sizeof(bytes)); return *this; }
+  IPAddress &operator=(uint32_t address) { memcpy(bytes, &address, sizeof(bytes)); return *this; }
+
+  bool fromString(const char *address);
+
+  uint8_t *raw_address() { return bytes; }
+
+private:
+  uint8_t bytes[4];
+};
+
+inline bool IPAddress::fromString(const char *address)
+{
+  uint16_t acc = 0;
+  uint8_t dots = 0;
+  for (; *address; address++) {
+    char c = *address;
+    if (c >= '0' && c <= '9') {
+      acc = acc * 10 + (c - '0');
+      if (acc > 255)
+        return false;
+    } else if (c == '.' && dots < 3) {
+      bytes[dots++] = acc;
+      acc = 0;
+    } else {
+      return false;
+    }
+  }
+  if (dots != 3)
+    return false;
+  bytes[3] = acc;
+  return true;
+}
+
+static const IPAddress INADDR_NONE(0, 0, 0, 0);
+
+#endif
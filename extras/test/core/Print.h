@@ -0,0 +1,42 @@
+/*
+ * Host stand-in for the Arduino core's Print.
+ */
+
+#ifndef PRINT_H_HOST
+#define PRINT_H_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+class Print {
+public:
+  Print() : write_error(0) { }
+  virtual ~Print() { }
+
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size-- && write(*buffer++))
+      n++;
+    return n;
+  }
+  size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+  size_t print(const char *str) { return write(str); }
+
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() { }
+
+  int getWriteError() { return write_error; }
+  void clearWriteError() { setWriteError(0); }
+
+protected:
+  void setWriteError(int err = 1) { write_error = err; }
+
+private:
+  int write_error;
+};
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the Arduino core's Server.
+ */
+
+#ifndef SERVER_H_HOST
+#define SERVER_H_HOST
+
+#include "Print.h"
+
+class Server : public Print {
+public:
+  virtual void begin() = 0;
+};
+
+#endif
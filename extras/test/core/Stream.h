@@ -0,0 +1,199 @@
+/*
+ * Host stand-in for the Arduino core's Stream, with the same timeout and
+ * parsing behaviour as the AVR core.
+ */
+
+#ifndef STREAM_H_HOST
+#define STREAM_H_HOST
+
+#include "Print.h"
+#include "WString.h"
+#include "utility/host.h"
+
+enum LookaheadMode {
+  SKIP_ALL,
+  SKIP_NONE,
+  SKIP_WHITESPACE
+};
+
+#define NO_IGNORE_CHAR '\x01'
+
+class Stream : public Print {
+protected:
+  unsigned long _timeout;
+  unsigned long _startMillis;
+
+  int timedRead()
+  {
+    _startMillis = millis();
+    do {
+      int c = read();
+      if (c >= 0)
+        return c;
+    } while (millis() - _startMillis < _timeout);
+    return -1;
+  }
+
+  int timedPeek()
+  {
+    _startMillis = millis();
+    do {
+      int c = peek();
+      if (c >= 0)
+        return c;
+    } while (millis() - _startMillis < _timeout);
+    return -1;
+  }
+
+  int peekNextDigit(LookaheadMode lookahead, bool detectDecimal)
+  {
+    for (;;) {
+      int c = timedPeek();
+      if (c < 0 || c == '-' || (c >= '0' && c <= '9') || (detectDecimal && c == '.'))
+        return c;
+      switch (lookahead) {
+      case SKIP_NONE:
+        return -1;
+      case SKIP_WHITESPACE:
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+          return -1;
+        // fall through
+      case SKIP_ALL:
+        break;
+      }
+      read();
+    }
+  }
+
+public:
+  Stream() : _timeout(1000), _startMillis(0) { }
+
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+  unsigned long getTimeout() { return _timeout; }
+
+  bool find(char *target) { return find(target, strlen(target)); }
+  bool find(uint8_t *target) { return find((char *)target); }
+  bool find(char *target, size_t length)
+  {
+    if (length == 0)
+      return true;
+    size_t index = 0;
+    int c;
+    while ((c = timedRead()) >= 0) {
+      if (c == target[index]) {
+        if (++index >= length)
+          return true;
+      } else {
+        index = (c == target[0]) ? 1 : 0;
+      }
+    }
+    return false;
+  }
+  bool find(uint8_t *target, size_t length) { return find((char *)target, length); }
+  bool find(char target) { return find(&target, 1); }
+
+  long parseInt(LookaheadMode lookahead = SKIP_ALL, char ignore = NO_IGNORE_CHAR)
+  {
+    bool negative = false;
+    long value = 0;
+    int c = peekNextDigit(lookahead, false);
+    if (c < 0)
+      return 0;
+    do {
+      if (c == ignore)
+        ;
+      else if (c == '-')
+        negative = true;
+      else if (c >= '0' && c <= '9')
+        value = value * 10 + c - '0';
+      read();
+      c = timedPeek();
+    } while ((c >= '0' && c <= '9') || c == ignore);
+    return negative ? -value : value;
+  }
+
+  float parseFloat(LookaheadMode lookahead = SKIP_ALL, char ignore = NO_IGNORE_CHAR)
+  {
+    bool negative = false;
+    bool fraction = false;
+    long value = 0;
+    float scale = 1.0f;
+    int c = peekNextDigit(lookahead, true);
+    if (c < 0)
+      return 0;
+    do {
+      if (c == ignore)
+        ;
+      else if (c == '-')
+        negative = true;
+      else if (c == '.')
+        fraction = true;
+      else if (c >= '0' && c <= '9') {
+        value = value * 10 + c - '0';
+        if (fraction)
+          scale *= 0.1f;
+      }
+      read();
+      c = timedPeek();
+    } while ((c >= '0' && c <= '9') || (c == '.' && !fraction) || c == ignore);
+    if (negative)
+      value = -value;
+    return fraction ? value * scale : value;
+  }
+
+  size_t readBytes(char *buffer, size_t length)
+  {
+    size_t count = 0;
+    while (count < length) {
+      int c = timedRead();
+      if (c < 0)
+        break;
+      *buffer++ = (char)c;
+      count++;
+    }
+    return count;
+  }
+  size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+
+  size_t readBytesUntil(char terminator, char *buffer, size_t length)
+  {
+    size_t index = 0;
+    while (index < length) {
+      int c = timedRead();
+      if (c < 0 || c == terminator)
+        break;
+      *buffer++ = (char)c;
+      index++;
+    }
+    return index;
+  }
+  size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length) { return readBytesUntil(terminator, (char *)buffer, length); }
+
+  String readString()
+  {
+    String ret;
+    int c = timedRead();
+    while (c >= 0) {
+      ret += (char)c;
+      c = timedRead();
+    }
+    return ret;
+  }
+
+  String readStringUntil(char terminator)
+  {
+    String ret;
+    int c = timedRead();
+    while (c >= 0 && c != terminator) {
+      ret += (char)c;
+      c = timedRead();
+    }
+    return ret;
+  }
+};
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Host stand-in for the Arduino core's String, enough for the library's
+ * readString() and readStringUntil().
+ */
+
+#ifndef WSTRING_H_HOST
+#define WSTRING_H_HOST
+
+#include <string>
+
+class String {
+public:
+  String() { }
+  String(const char *s) : str(s) { }
+
+  String &operator+=(char c) { str += c; return *this; }
+  bool operator==(const char *s) const { return str == s; }
+  unsigned int length() const { return str.length(); }
+  const char *c_str() const { return str.c_str(); }
+
+private:
+  std::string str;
+};
+
+#endif
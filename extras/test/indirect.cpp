@@ -0,0 +1,119 @@
+/*
+ * EthernetIndirectTransport against the simulated W5100 behind
+ * EthernetIndirectMockTransport: the mode register probe, the
+ * auto-increment address and data path, and a socket round trip.
+ */
+
+#include "test.h"
+
+static const uint8_t W5100_WRITE = 0xF0;
+static const uint8_t W5100_READ = 0x0F;
+
+// init() finds the W5100 and leaves it in indirect mode with
+// auto-increment, while MR reads back as the driver wrote it
+static void probe()
+{
+  static EthernetIndirectMockTransport bus;
+  W5100Class chip(bus);
+
+  CHECK_EQ(chip.init(), 1);
+  CHECK_EQ(chip.getChip(), 51);
+  CHECK_EQ(chip.getSocketCount(), 4);
+  CHECK_EQ(bus.chip.peek(0) & (IDM_MR_IND | IDM_MR_AI), IDM_MR_IND | IDM_MR_AI);
+
+  uint8_t hdr[3] = { W5100_READ, 0x00, 0x00 };
+  uint8_t mr = 0xFF;
+  bus.read(hdr, sizeof(hdr), &mr, 1);
+  CHECK_EQ(mr & (IDM_MR_IND | IDM_MR_AI), 0);
+}
+
+// A block costs two address writes and a cycle per byte; a block that
+// starts where the last ended needs no address
+static void blocks()
+{
+  static EthernetIndirectMockTransport bus;
+  W5100Class chip(bus);
+  CHECK_EQ(chip.init(), 1);
+
+  // Gateway, subnet mask and MAC address are contiguous, 0x0001 to 0x000E
+  const uint8_t gateway[4] = { 10, 0, 0, 1 };
+  const uint8_t subnet[4] = { 255, 255, 255, 0 };
+  uint8_t hdr[3] = { W5100_WRITE, 0x00, 0x01 };
+  bus.cycles = 0;
+  bus.write(hdr, sizeof(hdr), gateway, sizeof(gateway));
+  CHECK_EQ(bus.cycles, 2 + 4);
+  hdr[2] = 0x05;
+  bus.cycles = 0;
+  bus.write(hdr, sizeof(hdr), subnet, sizeof(subnet));
+  CHECK_EQ(bus.cycles, 4);
+  for (int i = 0; i < 4; i++) {
+    CHECK_EQ(bus.chip.peek(0x0001 + i), gateway[i]);
+    CHECK_EQ(bus.chip.peek(0x0005 + i), subnet[i]);
+  }
+
+  uint8_t back[8];
+  hdr[0] = W5100_READ;
+  hdr[2] = 0x01;
+  bus.cycles = 0;
+  bus.read(hdr, sizeof(hdr), back, sizeof(back));
+  CHECK_EQ(bus.cycles, 2 + 8);
+  CHECK(memcmp(back, gateway, 4) == 0);
+  CHECK(memcmp(back + 4, subnet, 4) == 0);
+
+  // A software reset drops the chip back to direct mode; the next access
+  // turns indirect mode on again
+  uint8_t rst = IDM_MR_RST;
+  hdr[0] = W5100_WRITE;
+  hdr[2] = 0x00;
+  bus.write(hdr, sizeof(hdr), &rst, 1);
+  CHECK_EQ(bus.chip.peek(0) & IDM_MR_IND, 0);
+  uint8_t ip[4] = { 10, 0, 0, 2 };
+  chip.beginTransaction();
+  chip.setIPAddress(ip);
+  chip.endTransaction();
+  CHECK_EQ(bus.chip.peek(0) & (IDM_MR_IND | IDM_MR_AI), IDM_MR_IND | IDM_MR_AI);
+  CHECK_EQ(bus.chip.peek(0x000F), 10);
+  CHECK_EQ(bus.chip.peek(0x0012), 2);
+}
+
+// Socket data goes through the Rx and Tx rings a block at a time
+static void roundTrip()
+{
+  static EthernetIndirectMockTransport bus;
+  static W5100Class chip(bus);
+  static EthernetClass eth(chip);
+  static uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x02 };
+  eth.begin(mac, IPAddress(10, 0, 0, 2));
+
+  EthernetClient client(eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  static uint8_t data[1000];
+  for (int i = 0; i < (int)sizeof(data); i++)
+    data[i] = i * 7;
+  bus.chip.inject(client.getSocketNumber(), data, sizeof(data));
+
+  static uint8_t got[1000];
+  bus.cycles = 0;
+  CHECK_EQ(client.read(got, sizeof(got)), sizeof(got));
+  CHECK(memcmp(got, data, sizeof(data)) == 0);
+  // Far from the cycle per byte and four-byte frame of SPI
+  CHECK(bus.cycles < sizeof(data) + 64);
+
+  bus.chip.resetStats();
+  CHECK_EQ(client.write(data, sizeof(data)), sizeof(data));
+  client.flush();
+  CHECK_EQ(bus.chip.commands, 1);
+  // Socket 0's Tx ring starts at 0x4000, its write pointer at 0
+  CHECK_EQ(client.getSocketNumber(), 0);
+  for (int i = 0; i < (int)sizeof(data); i++)
+    CHECK_EQ(bus.chip.peek(0x4000 + i), data[i]);
+  client.stop();
+}
+
+int main()
+{
+  probe();
+  blocks();
+  roundTrip();
+  return test_report("indirect");
+}
@@ -0,0 +1,140 @@
+/*
+ * EthernetServer's backlog: how it is kept listening as connections arrive,
+ * and what EthernetServerStats counts along the way.  Also the sweep
+ * Ethernet.poll() makes, and how servers and clients share it.
+ */
+
+#include "test.h"
+
+static uint8_t countBits(uint8_t mask)
+{
+  uint8_t n = 0;
+  for (; mask; mask >>= 1)
+    n += mask & 1;
+  return n;
+}
+
+// Each socket taken off the backlog is replaced by the next available()
+static void refill()
+{
+  static TestNet net(55);
+  EthernetServer server(80, net.eth);
+  server.setBacklog(3);
+  server.begin();
+  CHECK_EQ(net.chip.socketsOwned, 0x07);
+
+  net.mock.setStatus(0, SnSR::ESTABLISHED);
+  server.available();
+  CHECK_EQ(net.chip.socketsOwned, 0x0F);
+  CHECK_EQ(server.stats().accepted, 1);
+  CHECK_EQ(server.stats().drained, 0);
+
+  // All three taken between two sweeps: the port went unheard
+  for (SOCKET s = 1; s < 4; s++)
+    net.mock.setStatus(s, SnSR::ESTABLISHED);
+  server.available();
+  CHECK_EQ(countBits(net.chip.socketsOwned), 7);
+  CHECK_EQ(server.stats().accepted, 4);
+  CHECK_EQ(server.stats().drained, 1);
+
+  server.resetStats();
+  server.available();
+  CHECK_EQ(server.stats().accepted, 0);
+  CHECK_EQ(server.stats().drained, 0);
+}
+
+// A socket whose LISTEN the chip has not taken yet still counts as
+// listening: no extra socket is opened for it and nothing was accepted
+static void pendingListen()
+{
+  static TestNet net(55);
+  EthernetServer server(80, net.eth);
+  server.setBacklog(2);
+  server.begin();
+  CHECK_EQ(net.chip.socketsOwned, 0x03);
+
+  net.mock.setStatus(1, SnSR::INIT);
+  server.available();
+  CHECK_EQ(net.chip.socketsOwned, 0x03);
+  CHECK_EQ(server.stats().accepted, 0);
+  CHECK_EQ(server.stats().drained, 0);
+
+  server.begin();
+  CHECK_EQ(net.chip.socketsOwned, 0x03);
+}
+
+// A backlog larger than the chip stops at its sockets
+static void clamp()
+{
+  static TestNet net(51);
+  EthernetServer server(80, net.eth);
+  server.setBacklog(255);
+  server.begin();
+  CHECK_EQ(net.chip.socketsOwned, 0x0F);
+  server.available();
+  CHECK_EQ(server.stats().drained, 0);
+}
+
+// The server's next sweep and each client's next status check come from
+// the last poll() instead of the chip, once
+static void sharedPoll()
+{
+  static TestNet net(55);
+  EthernetServer server(80, net.eth);
+  server.begin();
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  net.eth.poll();
+
+  net.mock.resetStats();
+  CHECK(!server.available());
+  CHECK(client.connected());
+  CHECK_EQ(net.mock.frames, 0);
+
+  // Then each asks the chip again: the server reads its listening
+  // socket's status in one frame
+  CHECK(!server.available());
+  CHECK_EQ(net.mock.frames, 1);
+  CHECK(client.connected());
+  CHECK(net.mock.frames > 1);
+  client.stop();
+}
+
+// closed reports the peer's FIN, the end of the connection after it, and a
+// connection that came and went between two polls
+static void pollClosed()
+{
+  static TestNet net(55);
+  EthernetClient client(net.eth);
+  CHECK(client.connect(IPAddress(10, 0, 0, 9), 80));
+  SOCKET s = client.getSocketNumber();
+  uint8_t bit = 1 << s;
+
+  CHECK(net.eth.poll().connected & bit);
+  CHECK(!(net.eth.poll().closed & bit));
+  net.mock.setStatus(s, SnSR::CLOSE_WAIT);
+  CHECK(net.eth.poll().closed & bit);
+  CHECK(!(net.eth.poll().closed & bit));
+  net.mock.setStatus(s, SnSR::CLOSED);
+  CHECK(net.eth.poll().closed & bit);
+  CHECK(!(net.eth.poll().closed & bit));
+  client.stop();
+
+  EthernetServer server(80, net.eth);
+  server.begin();
+  CHECK(!(net.eth.poll().closed & 1));
+  net.mock.setStatus(0, SnSR::CLOSED);
+  const EthernetPoll &poll = net.eth.poll();
+  CHECK(poll.closed & 1);
+  CHECK(!(poll.connected & 1));
+}
+
+int main()
+{
+  refill();
+  pendingListen();
+  clamp();
+  sharedPoll();
+  pollClosed();
+  return test_report("server");
+}
@@ -0,0 +1,58 @@
+/*
+ * Checks shared by the host tests.  Each test is a program of its own: it
+ * brings up the library on one or more EthernetMockTransport chips, runs
+ * its cases and exits non-zero if any CHECK failed.
+ */
+
+#ifndef ETHERNET_TEST_H
+#define ETHERNET_TEST_H
+
+#include <stdio.h>
+
+#include "Ethernet.h"
+#include "EthernetUdp.h"
+#include "utility/socket.h"
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long _a = (long long)(a), _b = (long long)(b); \
+    if (_a != _b) { \
+      printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+      test_failures++; \
+    } \
+  } while (0)
+
+// One controller on a simulated chip, with an interface brought up on it.
+// Keep them static: an interrupt-mode controller stays in one of the
+// driver's four interrupt slots for good.
+struct TestNet {
+  EthernetMockTransport mock;
+  W5100Class chip;
+  EthernetClass eth;
+
+  TestNet(uint8_t model, int8_t irqPin = -1) : mock(model), chip(mock), eth(chip)
+  {
+    static uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x01 };
+    if (irqPin >= 0)
+      chip.setInterruptPin(irqPin);
+    eth.begin(mac, IPAddress(10, 0, 0, 2));
+  }
+};
+
+static const uint8_t test_chips[] = { 51, 52, 55 };
+
+static int test_report(const char *name)
+{
+  printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+  return test_failures ? 1 : 0;
+}
+
+#endif
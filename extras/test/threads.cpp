@@ -0,0 +1,133 @@
+/*
+ * Stress test for ETHERNET_THREADS: several std::threads share one
+ * controller, four cycling TCP clients and two cycling UDP sockets, then
+ * clients reading while another thread polls every socket.  Run under
+ * ThreadSanitizer with `make tsan`; the regular build runs it too.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "test.h"
+
+static const int ROUNDS = 200;
+
+static void stress(TestNet &net)
+{
+  std::atomic<int> tcpOk(0), tcpFailed(0), udpOk(0), udpFailed(0);
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&net, &tcpOk, &tcpFailed, t] {
+      uint8_t buf[100];
+      memset(buf, t, sizeof(buf));
+      for (int i = 0; i < ROUNDS; i++) {
+        EthernetClient client(net.eth);
+        if (client.connect(IPAddress(10, 0, 0, 9), 80) && client.write(buf, sizeof(buf)) == sizeof(buf))
+          tcpOk++;
+        else
+          tcpFailed++;
+        client.stop();
+      }
+    }));
+  }
+  for (int t = 0; t < 2; t++) {
+    threads.push_back(std::thread([&net, &udpOk, &udpFailed, t] {
+      for (int i = 0; i < ROUNDS; i++) {
+        EthernetUDP udp(net.eth);
+        if (udp.begin(2000 + t) && udp.beginPacket(IPAddress(10, 0, 0, 9), 99) &&
+            udp.write((const uint8_t *)"x", 1) == 1 && udp.endPacket())
+          udpOk++;
+        else
+          udpFailed++;
+        udp.stop();
+      }
+    }));
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  CHECK_EQ(tcpOk.load(), 4 * ROUNDS);
+  CHECK_EQ(tcpFailed.load(), 0);
+  CHECK_EQ(udpOk.load(), 2 * ROUNDS);
+  CHECK_EQ(udpFailed.load(), 0);
+
+  // Every socket handed back and closed
+  CHECK_EQ(net.chip.socketsOwned, 0);
+  for (uint8_t s = 0; s < net.chip.getSocketCount(); s++)
+    CHECK_EQ(socketStatus(net.chip, s), SnSR::CLOSED);
+}
+
+// One thread sweeps every socket with Ethernet.poll() and maintain(),
+// moving the counts of sockets it does not own, while their owners read
+// and write them
+static void pollWhileReading(TestNet &net)
+{
+  static const uint8_t data[64] = { '1', '2', '3', ' ' };
+  std::atomic<bool> done(false);
+  std::atomic<int> ok(0), failed(0);
+  std::thread poller([&net, &done] {
+    while (!done) {
+      net.eth.poll();
+      net.eth.maintain();
+    }
+  });
+  std::vector<std::thread> owners;
+  for (int t = 0; t < 2; t++) {
+    owners.push_back(std::thread([&net, &ok, &failed] {
+      uint8_t buf[16];
+      for (int i = 0; i < ROUNDS; i++) {
+        EthernetClient client(net.eth);
+        if (!client.connect(IPAddress(10, 0, 0, 9), 80)) {
+          failed++;
+          continue;
+        }
+        {
+          // The peer's data lands while nothing else is on the bus
+          EthernetSession session(net.chip);
+          net.mock.inject(client.getSocketNumber(), data, sizeof(data));
+        }
+        client.setTimeout(0);
+        int got = 0;
+        if (client.peek() == '1' && client.parseInt() == 123)
+          got = 3;
+        for (int n = 0; n < 1000 && got < (int)sizeof(data); n++) {
+          if (client.available() > 0) {
+            int r = client.read(buf, sizeof(buf));
+            if (r > 0)
+              got += r;
+          }
+          client.write(buf, 1);
+        }
+        if (got == sizeof(data))
+          ok++;
+        else
+          failed++;
+        client.stop();
+      }
+    }));
+  }
+  for (size_t i = 0; i < owners.size(); i++)
+    owners[i].join();
+  done = true;
+  poller.join();
+
+  CHECK_EQ(ok.load(), 2 * ROUNDS);
+  CHECK_EQ(failed.load(), 0);
+  CHECK_EQ(net.chip.socketsOwned, 0);
+}
+
+int main()
+{
+  static TestNet polled(55);
+  static TestNet interrupts(55, 2);
+  CHECK(!polled.chip.interruptMode());
+  CHECK(interrupts.chip.interruptMode());
+
+  stress(polled);
+  stress(interrupts);
+  pollWhileReading(polled);
+  pollWhileReading(interrupts);
+  return test_report("threads");
+}
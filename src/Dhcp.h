@@ -164,6 +164,9 @@ private:
   
   uint8_t parseDHCPResponse(unsigned long responseTimeout, uint32_t& transactionId);
 public:
+  DhcpClass() { }
+  DhcpClass(EthernetClass &eth) : _dhcpUdpSocket(eth) { }
+
   IPAddress getLocalIp();
   IPAddress getSubnetMask();
   IPAddress getGatewayIp();
@@ -300,22 +300,14 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
         do
         {
             iUdp.read(&len, sizeof(len));
+            // Don't need to actually read the data out for the string, just
+            // advance ptr to beyond it
             if (len > 0)
-            {
-                // Don't need to actually read the data out for the string, just
-                // advance ptr to beyond it
-                while(len--)
-                {
-                    iUdp.read(); // we don't care about the returned byte
-                }
-            }
+                iUdp.skip(len);
         } while (len != 0);
 
         // Now jump over the type and class
-        for (int i =0; i < 4; i++)
-        {
-            iUdp.read(); // we don't care about the returned byte
-        }
+        iUdp.skip(4);
     }
 
     // Now we're up to the bit we're interested in, the answer
@@ -338,10 +330,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
                     // And it's got a length
                     // Don't need to actually read the data out for the string,
                     // just advance ptr to beyond it
-                    while(len--)
-                    {
-                        iUdp.read(); // we don't care about the returned byte
-                    }
+                    iUdp.skip(len);
                 }
             }
             else
@@ -366,10 +355,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
         iUdp.read((uint8_t*)&answerClass, sizeof(answerClass));
 
         // Ignore the Time-To-Live as we don't do any caching
-        for (int i =0; i < TTL_SIZE; i++)
-        {
-            iUdp.read(); // we don't care about the returned byte
-        }
+        iUdp.skip(TTL_SIZE);
 
         // And read out the length of this answer
         // Don't need header_flags anymore, so we can reuse it here
@@ -390,10 +376,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
         else
         {
             // This isn't an answer type we're after, move onto the next one
-            for (uint16_t i =0; i < htons(header_flags); i++)
-            {
-                iUdp.read(); // we don't care about the returned byte
-            }
+            iUdp.skip(htons(header_flags));
         }
     }
 
@@ -10,6 +10,10 @@
 class DNSClient
 {
 public:
+    DNSClient() { }
+    // Resolve through the interface eth instead of Ethernet
+    DNSClient(EthernetClass &eth) : iUdp(eth) { }
+
     // ctor
     void begin(const IPAddress& aDNSServer);
 
@@ -1,25 +1,55 @@
 #include "utility/w5100.h"
+#include "utility/socket.h"
+extern "C" {
+#include "string.h"
+}
+
 #include "Ethernet.h"
 #include "Dhcp.h"
 
-// XXX: don't make assumptions about the value of MAX_SOCK_NUM.
-uint8_t EthernetClass::_state[MAX_SOCK_NUM] = { 
-  0, 0, 0, 0 };
-uint16_t EthernetClass::_server_port[MAX_SOCK_NUM] = { 
-  0, 0, 0, 0 };
+EthernetClass::EthernetClass() :
+#if ETHERNET_MULTI_CHIP
+  _chip(&W5100),
+#endif
+  _dhcp(NULL)
+{
+  memset(_state, 0, sizeof(_state));
+  memset(_server_port, 0, sizeof(_server_port));
+  memset(&_poll, 0, sizeof(_poll));
+  _pollCount = 0;
+  _pollFresh = 0;
+  _srcport = 49152; //Use IANA recommended ephemeral port range 49152-65535
+}
 
-int EthernetClass::begin(uint8_t *mac_address, unsigned long timeout, unsigned long responseTimeout)
+#if ETHERNET_MULTI_CHIP
+EthernetClass::EthernetClass(W5100Class &chip) : _chip(&chip), _dhcp(NULL)
 {
-  static DhcpClass s_dhcp;
-  _dhcp = &s_dhcp;
+  memset(_state, 0, sizeof(_state));
+  memset(_server_port, 0, sizeof(_server_port));
+  memset(&_poll, 0, sizeof(_poll));
+  _pollCount = 0;
+  _pollFresh = 0;
+  _srcport = 49152; //Use IANA recommended ephemeral port range 49152-65535
+}
+#endif
+
+EthernetClass::~EthernetClass()
+{
+  delete _dhcp;
+}
 
+int EthernetClass::begin(uint8_t *mac_address, unsigned long timeout, unsigned long responseTimeout)
+{
+  // Only interfaces that use DHCP pay for its state
+  if (_dhcp == NULL)
+    _dhcp = new DhcpClass(*this);
 
   // Initialise the basic info
-  W5100.init();
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.setMACAddress(mac_address);
-  W5100.setIPAddress(IPAddress(0,0,0,0).raw_address());
-  SPI.endTransaction();
+  chip().init();
+  chip().beginTransaction();
+  chip().setMACAddress(mac_address);
+  chip().setIPAddress(IPAddress(0,0,0,0).raw_address());
+  chip().endTransaction();
 
   // Now try to get our config info from a DHCP server
   int ret = _dhcp->beginWithDHCP(mac_address, timeout, responseTimeout);
@@ -27,11 +57,11 @@ int EthernetClass::begin(uint8_t *mac_address, unsigned long timeout, unsigned l
   {
     // We've successfully found a DHCP server and got our configuration info, so set things
     // accordingly
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    W5100.setIPAddress(_dhcp->getLocalIp().raw_address());
-    W5100.setGatewayIp(_dhcp->getGatewayIp().raw_address());
-    W5100.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-    SPI.endTransaction();
+    chip().beginTransaction();
+    chip().setIPAddress(_dhcp->getLocalIp().raw_address());
+    chip().setGatewayIp(_dhcp->getGatewayIp().raw_address());
+    chip().setSubnetMask(_dhcp->getSubnetMask().raw_address());
+    chip().endTransaction();
     _dnsServerAddress = _dhcp->getDnsServerIp();
   }
 
@@ -64,18 +94,20 @@ void EthernetClass::begin(uint8_t *mac_address, IPAddress local_ip, IPAddress dn
 
 void EthernetClass::begin(uint8_t *mac, IPAddress local_ip, IPAddress dns_server, IPAddress gateway, IPAddress subnet)
 {
-  W5100.init();
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.setMACAddress(mac);
-  W5100.setIPAddress(local_ip.raw_address());
-  W5100.setGatewayIp(gateway.raw_address());
-  W5100.setSubnetMask(subnet.raw_address());
-  SPI.endTransaction();
+  chip().init();
+  chip().beginTransaction();
+  chip().setMACAddress(mac);
+  chip().setIPAddress(local_ip.raw_address());
+  chip().setGatewayIp(gateway.raw_address());
+  chip().setSubnetMask(subnet.raw_address());
+  chip().endTransaction();
   _dnsServerAddress = dns_server;
 }
 
 int EthernetClass::maintain(){
   int rc = DHCP_CHECK_NONE;
+  // Writes left queued behind a SEND go out here if nothing else sends them
+  sendPending(chip());
   if(_dhcp != NULL){
     //we have a pointer to dhcp, use it
     rc = _dhcp->checkLease();
@@ -86,11 +118,11 @@ int EthernetClass::maintain(){
       case DHCP_CHECK_RENEW_OK:
       case DHCP_CHECK_REBIND_OK:
         //we might have got a new IP.
-        SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-        W5100.setIPAddress(_dhcp->getLocalIp().raw_address());
-        W5100.setGatewayIp(_dhcp->getGatewayIp().raw_address());
-        W5100.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-        SPI.endTransaction();
+        chip().beginTransaction();
+        chip().setIPAddress(_dhcp->getLocalIp().raw_address());
+        chip().setGatewayIp(_dhcp->getGatewayIp().raw_address());
+        chip().setSubnetMask(_dhcp->getSubnetMask().raw_address());
+        chip().endTransaction();
         _dnsServerAddress = _dhcp->getDnsServerIp();
         break;
       default:
@@ -101,30 +133,70 @@ int EthernetClass::maintain(){
   return rc;
 }
 
+const EthernetPoll &EthernetClass::poll()
+{
+  EthernetSession session(chip());
+  uint8_t was[MAX_SOCK_NUM];
+  memcpy(was, _poll.status, sizeof(was));
+  socketPoll(chip(), 0xFF, _poll.status, _poll.available, _poll.availableForWrite);
+
+  _poll.readable = 0;
+  _poll.writable = 0;
+  _poll.connected = 0;
+  _poll.closed = 0;
+  for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+    uint8_t bit = 1 << s;
+    uint8_t now = _poll.status[s];
+    bool open = (now == SnSR::ESTABLISHED || now == SnSR::CLOSE_WAIT);
+    bool wasOpen = (was[s] == SnSR::ESTABLISHED || was[s] == SnSR::CLOSE_WAIT);
+    // Any TCP state but INIT: a listening socket found CLOSED connected
+    // and went between the two polls
+    bool wasTCP = !(was[s] == SnSR::CLOSED || was[s] == SnSR::INIT || was[s] == SnSR::UDP ||
+                    was[s] == SnSR::IPRAW || was[s] == SnSR::MACRAW);
+    if (_poll.available[s])
+      _poll.readable |= bit;
+    if (_poll.availableForWrite[s] && (open || now == SnSR::UDP || now == SnSR::IPRAW || now == SnSR::MACRAW))
+      _poll.writable |= bit;
+    if (open && !wasOpen)
+      _poll.connected |= bit;
+    if ((now == SnSR::CLOSE_WAIT && was[s] != SnSR::CLOSE_WAIT) || (now == SnSR::CLOSED && wasTCP))
+      _poll.closed |= bit;
+  }
+  _pollCount++;
+  _pollFresh = 0xFF;
+  return _poll;
+}
+
+void EthernetClass::pollChanged(uint8_t s)
+{
+  EthernetSession session(chip());
+  _pollFresh &= ~(1 << s);
+}
+
 IPAddress EthernetClass::localIP()
 {
   IPAddress ret;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.getIPAddress(ret.raw_address());
-  SPI.endTransaction();
+  chip().beginTransaction();
+  chip().getIPAddress(ret.raw_address());
+  chip().endTransaction();
   return ret;
 }
 
 IPAddress EthernetClass::subnetMask()
 {
   IPAddress ret;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.getSubnetMask(ret.raw_address());
-  SPI.endTransaction();
+  chip().beginTransaction();
+  chip().getSubnetMask(ret.raw_address());
+  chip().endTransaction();
   return ret;
 }
 
 IPAddress EthernetClass::gatewayIP()
 {
   IPAddress ret;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.getGatewayIp(ret.raw_address());
-  SPI.endTransaction();
+  chip().beginTransaction();
+  chip().getGatewayIp(ret.raw_address());
+  chip().endTransaction();
   return ret;
 }
 
@@ -2,21 +2,67 @@
 #define ethernet_h
 
 #include <inttypes.h>
-//#include "w5100.h"
+#include "utility/w5100.h"
 #include "IPAddress.h"
 #include "EthernetClient.h"
 #include "EthernetServer.h"
 #include "Dhcp.h"
 
-#define MAX_SOCK_NUM 4
+/**
+ * @brief	What EthernetClass::poll() found, socket n in bit n of each mask.
+ */
+struct EthernetPoll {
+  uint8_t readable;   // Data waiting to be read
+  uint8_t writable;   // Connected, or UDP, with room to write
+  uint8_t connected;  // Connection established since the last poll
+  uint8_t closed;     // Peer closed its side, or the connection ended, since
+                      // the last poll; also one that came and went between two
+  uint8_t status[MAX_SOCK_NUM];             // SnSR
+  uint16_t available[MAX_SOCK_NUM];         // Bytes a read could take
+  uint16_t availableForWrite[MAX_SOCK_NUM]; // Bytes a write could queue without waiting
+};
 
+/**
+ * @brief	One network interface on one controller.  Ethernet runs on the
+ *        default controller W5100; with ETHERNET_MULTI_CHIP, further
+ *        interfaces are built on their own W5100Class and passed to the
+ *        clients, servers and UDP sockets that use them.
+ *
+ * With ETHERNET_THREADS several tasks may use one interface: the tables
+ * below are only touched inside an EthernetSession on its controller.  A
+ * socket, i.e. the client or UDP object holding it, belongs to one task at
+ * a time.
+ */
 class EthernetClass {
 private:
+#if ETHERNET_MULTI_CHIP
+  W5100Class *_chip;
+#endif
   IPAddress _dnsServerAddress;
-  DhcpClass* _dhcp;
+  DhcpClass* _dhcp;     // Allocated by the first DHCP begin()
+  EthernetPoll _poll;
+  uint32_t _pollCount;  // poll() calls so far, for servers to tell a new sweep
+  uint8_t _pollFresh;   // Sockets whose status in _poll no client has used yet
+  // Drop the status the last poll() read for socket s, which is changing
+  void pollChanged(uint8_t s);
 public:
-  static uint8_t _state[MAX_SOCK_NUM];
-  static uint16_t _server_port[MAX_SOCK_NUM];
+  EthernetClass();
+#if ETHERNET_MULTI_CHIP
+  EthernetClass(W5100Class &chip);
+#endif
+  ~EthernetClass();
+
+  uint8_t _state[MAX_SOCK_NUM];
+  uint16_t _server_port[MAX_SOCK_NUM];
+  uint16_t _srcport; // last ephemeral port used by connect()
+
+  // The controller this interface runs on
+#if ETHERNET_MULTI_CHIP
+  inline W5100Class &chip() { return *_chip; }
+#else
+  inline W5100Class &chip() { return W5100; }
+#endif
+
   // Initialise the Ethernet shield to use the provided MAC address and gain the rest of the
   // configuration through DHCP.
   // Returns 0 if the DHCP configuration failed, and 1 if it succeeded
@@ -25,8 +71,19 @@ public:
   void begin(uint8_t *mac_address, IPAddress local_ip, IPAddress dns_server);
   void begin(uint8_t *mac_address, IPAddress local_ip, IPAddress dns_server, IPAddress gateway);
   void begin(uint8_t *mac_address, IPAddress local_ip, IPAddress dns_server, IPAddress gateway, IPAddress subnet);
+  // Renew the DHCP lease when due, and send data that client writes left
+  // queued; call it from loop().
   int maintain();
 
+  // Sweep every socket in one bus transaction, for a server loop to find
+  // its work without asking each in turn.  The sizes are those the
+  // clients' available() and availableForWrite() would return; they are
+  // left in the controller's local counts, so those calls then need no
+  // bus traffic.  The result stays valid until the next poll().  Servers
+  // take their next sweep from it, and each client its next status
+  // check, instead of asking the chip again.
+  const EthernetPoll &poll();
+
   IPAddress localIP();
   IPAddress subnetMask();
   IPAddress gatewayIP();
@@ -34,6 +91,7 @@ public:
 
   friend class EthernetClient;
   friend class EthernetServer;
+  friend class EthernetUDP;
 };
 
 extern EthernetClass Ethernet;
@@ -12,21 +12,31 @@ extern "C" {
 #include "EthernetServer.h"
 #include "Dns.h"
 
-uint16_t EthernetClient::_srcport = 49152;      //Use IANA recommended ephemeral port range 49152-65535
+#if ETHERNET_MULTI_CHIP
+W5100Class &EthernetClient::chip() {
+  return _eth->chip();
+}
+#endif
+
+EthernetClient::EthernetClient() : _eth(&Ethernet), _sock(MAX_SOCK_NUM) {
+}
 
-EthernetClient::EthernetClient() : _sock(MAX_SOCK_NUM) {
+EthernetClient::EthernetClient(uint8_t sock) : _eth(&Ethernet), _sock(sock) {
 }
 
-EthernetClient::EthernetClient(uint8_t sock) : _sock(sock) {
+EthernetClient::EthernetClient(EthernetClass &eth) : _eth(&eth), _sock(MAX_SOCK_NUM) {
+}
+
+EthernetClient::EthernetClient(EthernetClass &eth, uint8_t sock) : _eth(&eth), _sock(sock) {
 }
 
 int EthernetClient::connect(const char* host, uint16_t port) {
   // Look up the host first
   int ret = 0;
-  DNSClient dns;
+  DNSClient dns(*_eth);
   IPAddress remote_addr;
 
-  dns.begin(Ethernet.dnsServerIP());
+  dns.begin(_eth->dnsServerIP());
   ret = dns.getHostByName(host, remote_addr);
   if (ret == 1) {
     return connect(remote_addr, port);
@@ -39,29 +49,31 @@ int EthernetClient::connect(IPAddress ip, uint16_t port) {
   if (_sock != MAX_SOCK_NUM)
     return 0;
 
-  for (int i = 0; i < MAX_SOCK_NUM; i++) {
-    uint8_t s = socketStatus(i);
-    if (s == SnSR::CLOSED || s == SnSR::FIN_WAIT || s == SnSR::CLOSE_WAIT) {
-      _sock = i;
-      break;
-    }
-  }
-
-  if (_sock == MAX_SOCK_NUM)
-    return 0;
+  {
+    // Take a socket and start connecting under one bus transaction
+    EthernetSession session(chip());
+    _sock = socketAcquire(chip(), true);
+    if (_sock == MAX_SOCK_NUM)
+      return 0;
+    _eth->pollChanged(_sock);
 
-  _srcport++;
-  if (_srcport == 0) _srcport = 49152;          //Use IANA recommended ephemeral port range 49152-65535
-  socket(_sock, SnMR::TCP, _srcport, 0);
+    uint16_t &srcport = _eth->_srcport;
+    srcport++;
+    if (srcport == 0) srcport = 49152;          //Use IANA recommended ephemeral port range 49152-65535
+    socket(chip(), _sock, SnMR::TCP, srcport, 0);
 
-  if (!::connect(_sock, rawIPAddress(ip), port)) {
-    _sock = MAX_SOCK_NUM;
-    return 0;
+    if (!::connect(chip(), _sock, rawIPAddress(ip), port)) {
+      close(chip(), _sock);
+      _sock = MAX_SOCK_NUM;
+      return 0;
+    }
   }
 
+  // The status only moves on once the chip raises CON, DISCON or TIMEOUT
   while (status() != SnSR::ESTABLISHED) {
-    delay(1);
+    socketWait(chip(), _sock, SnIR::CON | SnIR::DISCON | SnIR::TIMEOUT, 1000);
     if (status() == SnSR::CLOSED) {
+      socketRelease(chip(), _sock);
       _sock = MAX_SOCK_NUM;
       return 0;
     }
@@ -79,22 +91,62 @@ size_t EthernetClient::write(const uint8_t *buf, size_t size) {
     setWriteError();
     return 0;
   }
-  if (!send(_sock, buf, size)) {
+  size_t n = 0;
+  while (n < size) {
+    // send() takes at most 64K at a time
+    uint16_t chunk = (size - n > 0xFFFF) ? 0xFFFF : size - n;
+    uint16_t sent = send(chip(), _sock, buf + n, chunk);
+    n += sent;
+    if (sent < chunk) {
+      setWriteError();
+      break;
+    }
+  }
+  return n;
+}
+
+size_t EthernetClient::write(const EthernetIovec *iov, uint8_t count) {
+  if (_sock == MAX_SOCK_NUM) {
+    setWriteError();
+    return 0;
+  }
+  uint32_t len = 0;
+  for (uint8_t i = 0; i < count; i++)
+    len += iov[i].len;
+  uint32_t sent = sendv(chip(), _sock, iov, count);
+  if (sent < len)
+    setWriteError();
+  return sent;
+}
+
+int EthernetClient::availableForWrite() {
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  return sendAvailable(chip(), _sock);
+}
+
+size_t EthernetClient::writeFrom(Stream &src, size_t len) {
+  if (_sock == MAX_SOCK_NUM) {
     setWriteError();
     return 0;
   }
-  return size;
+  uint32_t n = sendStream(chip(), _sock, src, len);
+  if (n < len && src.available())
+    setWriteError();
+  return n;
 }
 
 int EthernetClient::available() {
   if (_sock != MAX_SOCK_NUM)
-    return recvAvailable(_sock);
+    return recvAvailable(chip(), _sock);
   return 0;
 }
 
 int EthernetClient::read() {
   uint8_t b;
-  if ( recv(_sock, &b, 1) > 0 )
+  if (_sock == MAX_SOCK_NUM)
+    return -1;
+  if ( recv(chip(), _sock, &b, 1) > 0 )
   {
     // recv worked
     return b;
@@ -107,7 +159,138 @@ int EthernetClient::read() {
 }
 
 int EthernetClient::read(uint8_t *buf, size_t size) {
-  return recv(_sock, buf, size);
+  if (_sock == MAX_SOCK_NUM)
+    return -1;
+  return recv(chip(), _sock, buf, size);
+}
+
+int EthernetClient::readAsync(uint8_t *buf, size_t size) {
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  return recvAsync(chip(), _sock, buf, size > 0xFFFF ? 0xFFFF : size);
+}
+
+size_t EthernetClient::writeAsync(const uint8_t *buf, size_t size) {
+  if (_sock == MAX_SOCK_NUM) {
+    setWriteError();
+    return 0;
+  }
+  return sendAsync(chip(), _sock, buf, size > 0xFFFF ? 0xFFFF : size);
+}
+
+bool EthernetClient::asyncDone() {
+  return ::asyncDone(chip());
+}
+
+size_t EthernetClient::skip(size_t n) {
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  size_t skipped = 0;
+  while (skipped < n) {
+    size_t want = n - skipped;
+    uint16_t got = recvSkip(chip(), _sock, want > 0xFFFF ? 0xFFFF : want);
+    if (got == 0)
+      break;
+    skipped += got;
+  }
+  return skipped;
+}
+
+int EthernetClient::indexOf(const char *delim, size_t from) {
+  if (_sock == MAX_SOCK_NUM || from > 0xFFFF)
+    return -1;
+  size_t len = strlen(delim);
+  if (len > 0xFF)
+    return -1;
+  return recvFind(chip(), _sock, (const uint8_t *)delim, len, from);
+}
+
+size_t EthernetClient::readBytes(uint8_t *buffer, size_t length) {
+  size_t count = 0;
+  unsigned long start = millis();
+  while (count < length && _sock != MAX_SOCK_NUM) {
+    size_t want = length - count;
+    int got = recv(chip(), _sock, buffer + count, want > 0x7FFF ? 0x7FFF : want);
+    if (got > 0) {
+      count += got;
+      start = millis();
+    } else if (got == 0 || millis() - start >= _timeout) {
+      // Closed, or timed out
+      break;
+    } else {
+      yield();
+    }
+  }
+  return count;
+}
+
+size_t EthernetClient::readBytesUntil(char terminator, uint8_t *buffer, size_t length) {
+  size_t count = 0;
+  unsigned long start = millis();
+  while (count < length && _sock != MAX_SOCK_NUM) {
+    // Take everything up to the terminator, or all there is, in one read
+    int end = recvFind(chip(), _sock, (const uint8_t *)&terminator, 1);
+    size_t want = (end >= 0) ? end : available();
+    if (want > length - count)
+      want = length - count;
+    int got = (want > 0) ? recv(chip(), _sock, buffer + count, want) : 0;
+    if (got > 0) {
+      count += got;
+      start = millis();
+    }
+    if (end >= 0 && (size_t)end == want && got == (int)want) {
+      // The terminator is dropped, once everything before it has been
+      // taken; a read served from the read-ahead buffer may come up short
+      recvSkip(chip(), _sock, 1);
+      break;
+    }
+    if (end < 0 && want == 0) {
+      if (!connected() || millis() - start >= _timeout)
+        break;
+      yield();
+    }
+  }
+  return count;
+}
+
+bool EthernetClient::find(const uint8_t *target, size_t length) {
+  if (length == 0)
+    return true;
+  if (length > ETHERNET_SCAN_CHUNK)
+    return Stream::find((char *)target, length);
+  unsigned long start = millis();
+  while (_sock != MAX_SOCK_NUM) {
+    // Taken before the scan, so that data arriving with the close is
+    // still searched once more
+    bool open = connected();
+    int at = recvFind(chip(), _sock, target, length);
+    if (at >= 0) {
+      skip(at + length);
+      return true;
+    }
+    // Drop what was searched, but for a tail that may start the target
+    int avail = available();
+    if (avail >= (int)length) {
+      skip(avail - length + 1);
+      start = millis();
+    }
+    if (!open || millis() - start >= _timeout)
+      break;
+    yield();
+  }
+  // Like Stream::find(), everything read on the way is gone
+  skip(available());
+  return false;
+}
+
+String EthernetClient::readString() {
+  EthernetReadAhead ahead(chip(), _sock);
+  return Stream::readString();
+}
+
+String EthernetClient::readStringUntil(char terminator) {
+  EthernetReadAhead ahead(chip(), _sock);
+  return Stream::readStringUntil(terminator);
 }
 
 int EthernetClient::peek() {
@@ -115,12 +298,23 @@ int EthernetClient::peek() {
   // Unlike recv, peek doesn't check to see if there's any data available, so we must
   if (!available())
     return -1;
-  ::peek(_sock, &b);
+  ::peek(chip(), _sock, &b);
   return b;
 }
 
 void EthernetClient::flush() {
-  ::flush(_sock);
+  if (_sock != MAX_SOCK_NUM)
+    ::flush(chip(), _sock);
+}
+
+void EthernetClient::setWriteCoalescing(uint16_t threshold, uint16_t delay) {
+  if (_sock != MAX_SOCK_NUM)
+    sendCoalesce(chip(), _sock, threshold, delay);
+}
+
+void EthernetClient::setReadBuffer(uint8_t *buf, uint16_t size) {
+  if (_sock != MAX_SOCK_NUM)
+    recvReadAhead(chip(), _sock, buf, size);
 }
 
 void EthernetClient::stop() {
@@ -128,7 +322,8 @@ void EthernetClient::stop() {
     return;
 
   // attempt to close the connection gracefully (send a FIN to other side)
-  disconnect(_sock);
+  _eth->pollChanged(_sock);
+  disconnect(chip(), _sock);
   unsigned long start = millis();
 
   // wait up to a second for the connection to close
@@ -137,20 +332,26 @@ void EthernetClient::stop() {
     s = status();
     if (s == SnSR::CLOSED)
       break; // exit the loop
-    delay(1);
+    // DISCON may already have been raised when the peer closed first, so
+    // look at the status again every few ms even with interrupts
+    socketWait(chip(), _sock, SnIR::DISCON | SnIR::TIMEOUT, 10);
   } while (millis() - start < 1000);
 
   // if it hasn't closed, close it forcefully
+  EthernetSession session(chip());
   if (s != SnSR::CLOSED)
-    close(_sock);
+    close(chip(), _sock);
+  else
+    socketRelease(chip(), _sock);
 
-  EthernetClass::_server_port[_sock] = 0;
+  _eth->_server_port[_sock] = 0;
   _sock = MAX_SOCK_NUM;
 }
 
 uint8_t EthernetClient::connected() {
   if (_sock == MAX_SOCK_NUM) return 0;
 
+  EthernetSession session(chip());
   uint8_t s = status();
   return !(s == SnSR::LISTEN || s == SnSR::CLOSED || s == SnSR::FIN_WAIT ||
     (s == SnSR::CLOSE_WAIT && !available()));
@@ -158,7 +359,13 @@ uint8_t EthernetClient::connected() {
 
 uint8_t EthernetClient::status() {
   if (_sock == MAX_SOCK_NUM) return SnSR::CLOSED;
-  return socketStatus(_sock);
+  // The first look after Ethernet.poll() takes the status it read
+  EthernetSession session(chip());
+  if (_eth->_pollFresh & (1 << _sock)) {
+    _eth->_pollFresh &= ~(1 << _sock);
+    return _eth->_poll.status[_sock];
+  }
+  return socketStatus(chip(), _sock);
 }
 
 // the next function allows us to use the client returned by
@@ -169,7 +376,7 @@ EthernetClient::operator bool() {
 }
 
 bool EthernetClient::operator==(const EthernetClient& rhs) {
-  return _sock == rhs._sock && _sock != MAX_SOCK_NUM && rhs._sock != MAX_SOCK_NUM;
+  return _eth == rhs._eth && _sock == rhs._sock && _sock != MAX_SOCK_NUM && rhs._sock != MAX_SOCK_NUM;
 }
 
 uint8_t EthernetClient::getSocketNumber() {
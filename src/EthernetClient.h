@@ -4,23 +4,93 @@
 #include "Print.h"
 #include "Client.h"
 #include "IPAddress.h"
+#include "utility/w5100.h"
+
+class EthernetClass;
 
 class EthernetClient : public Client {
 
 public:
   EthernetClient();
   EthernetClient(uint8_t sock);
+  // The same on another interface than Ethernet
+  EthernetClient(EthernetClass &eth);
+  EthernetClient(EthernetClass &eth, uint8_t sock);
 
   uint8_t status();
   virtual int connect(IPAddress ip, uint16_t port);
   virtual int connect(const char *host, uint16_t port);
+  // Writes are queued in the chip and go out behind the segment in
+  // flight, once it is acknowledged.  The next write, available(),
+  // connected(), flush(), Ethernet.maintain() or Ethernet.poll() sends
+  // what is left, so a sketch that writes and then only waits should call
+  // one of them.  A short count means the connection is gone; the client
+  // keeps its socket until stop().
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
+  // Write the count pieces of iov as one, with one SEND per buffer's
+  // worth and no copy in RAM to join them
+  size_t write(const EthernetIovec *iov, uint8_t count);
+  virtual int availableForWrite();
+  // Send up to len bytes read from src, such as a File on the SD card,
+  // reading ahead while the chip transmits.  Stops early once src has
+  // nothing available.  Returns the bytes sent.
+  size_t writeFrom(Stream &src, size_t len = (size_t)-1);
   virtual int available();
   virtual int read();
   virtual int read(uint8_t *buf, size_t size);
   virtual int peek();
+  // Start a read or write that moves its data in the background, where
+  // the transport has DMA, and return the bytes it covers (0 if none).
+  // Poll asyncDone() until it returns true before the next call on this
+  // or any other client, or on another device sharing the SPI bus, and
+  // keep buf untouched until then.
+  int readAsync(uint8_t *buf, size_t size);
+  size_t writeAsync(const uint8_t *buf, size_t size);
+  bool asyncDone();
+  // Drop up to n received bytes without reading them over the bus.
+  // Doesn't wait for more; returns the bytes dropped.
+  size_t skip(size_t n);
+  // Offset of the first byte of delim in the data received so far,
+  // searching from offset from, or -1.  Nothing is consumed, so a whole
+  // line can then be taken with one read(buf, offset + strlen(delim)).
+  int indexOf(const char *delim, size_t from = 0);
+  // Stream's helpers, taking blocks from the socket instead of a byte at a
+  // time.  They keep to the Stream timeout, but give up at once when the
+  // connection has closed and the data has run out.
+  size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+  size_t readBytes(uint8_t *buffer, size_t length);
+  size_t readBytesUntil(char terminator, char *buffer, size_t length) { return readBytesUntil(terminator, (uint8_t *)buffer, length); }
+  size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length);
+  bool find(const char *target) { return find((const uint8_t *)target, strlen(target)); }
+  bool find(const uint8_t *target) { return find(target, strlen((const char *)target)); }
+  bool find(const char *target, size_t length) { return find((const uint8_t *)target, length); }
+  bool find(const uint8_t *target, size_t length);
+  bool find(char target) { return find((const uint8_t *)&target, 1); }
+  // The parsers still go a byte at a time, but from a read-ahead buffer
+  // lent to the socket while they run.  Their parameters differ between
+  // cores, hence the templates.
+  template <typename... T> long parseInt(T... args) { EthernetReadAhead ahead(chip(), _sock); return Stream::parseInt(args...); }
+  template <typename... T> float parseFloat(T... args) { EthernetReadAhead ahead(chip(), _sock); return Stream::parseFloat(args...); }
+  String readString();
+  String readStringUntil(char terminator);
+  // Send everything written so far and wait until the chip has sent it
   virtual void flush();
+  // Stage writes in the chip until threshold bytes are waiting (a full
+  // buffer if 0), delay ms have passed (no limit if 0), or flush() is
+  // called, so many small prints go out as few segments.  (0, 0) turns it
+  // off.  Applies to the current connection.
+  void setWriteCoalescing(uint16_t threshold, uint16_t delay = 0);
+  // Read ahead into buf, which must outlive the connection: small reads
+  // then take size bytes from the chip in one go and read(), peek() and
+  // available() are served from RAM.  NULL turns it off.  Applies to the
+  // current connection, which otherwise gets ETHERNET_READ_AHEAD bytes.
+  void setReadBuffer(uint8_t *buf, uint16_t size);
+  // Close the connection and give up the socket.  Dropping a client does
+  // not: copies of it, such as the ones server.available() returns, share
+  // the one connection, so the socket stays owned until one of them is
+  // stopped.  One never stopped is taken back by a later connect() once
+  // the chip has closed it.
   virtual void stop();
   virtual uint8_t connected();
   virtual operator bool();
@@ -35,7 +105,13 @@ public:
   using Print::write;
 
 private:
-  static uint16_t _srcport;
+#if ETHERNET_MULTI_CHIP
+  W5100Class &chip();
+#else
+  W5100Class &chip() { return W5100; }
+#endif
+
+  EthernetClass *_eth;
   uint8_t _sock;
 };
 
@@ -8,64 +8,186 @@ extern "C" {
 #include "EthernetClient.h"
 #include "EthernetServer.h"
 
+#if ETHERNET_MULTI_CHIP
+W5100Class &EthernetServer::chip() {
+  return _eth->chip();
+}
+#endif
+
 EthernetServer::EthernetServer(uint16_t port)
 {
+  _eth = &Ethernet;
   _port = port;
+  _backlog = ETHERNET_SERVER_BACKLOG;
+  _listening = 0;
+  _swept = 0;
+  _polled = 0;
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+EthernetServer::EthernetServer(uint16_t port, EthernetClass &eth)
+{
+  _eth = &eth;
+  _port = port;
+  _backlog = ETHERNET_SERVER_BACKLOG;
+  _listening = 0;
+  _swept = 0;
+  _polled = 0;
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+void EthernetServer::setBacklog(uint8_t backlog)
+{
+  if (backlog == 0)
+    backlog = 1;
+  _backlog = (backlog > MAX_SOCK_NUM) ? MAX_SOCK_NUM : backlog;
+}
+
+// A LISTEN not yet taken by the chip leaves the socket in INIT
+static bool isListening(uint8_t status)
+{
+  return status == SnSR::LISTEN || status == SnSR::INIT;
+}
+
+void EthernetServer::resetStats()
+{
+  memset(&_stats, 0, sizeof(_stats));
 }
 
 void EthernetServer::begin()
 {
-  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
-    if (client.status() == SnSR::CLOSED) {
-      socket(sock, SnMR::TCP, _port, 0);
-      listen(sock);
-      EthernetClass::_server_port[sock] = _port;
-      break;
-    }
-  }  
+  EthernetSession session(chip());
+  EthernetPoll poll;
+  uint8_t mine = 0;
+  for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+    if (_eth->_server_port[sock] == _port)
+      mine |= 1 << sock;
+  }
+  socketPoll(chip(), mine, poll.status, poll.available, NULL);
+  _polled = _eth->_pollCount;
+  uint8_t listening = 0;
+  for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+    if ((mine & (1 << sock)) && isListening(poll.status[sock]))
+      listening |= 1 << sock;
+  }
+  arm(listening);
+  _swept = millis();
 }
 
-void EthernetServer::accept()
+// Open sockets until the backlog is listening; listening has those that
+// already are
+void EthernetServer::arm(uint8_t listening)
 {
-  int listening = 0;
+  EthernetSession session(chip());
+  uint8_t backlog = _backlog;
+  if (backlog > chip().getSocketCount())
+    backlog = chip().getSocketCount();
+  uint8_t count = 0;
+  for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+    if (listening & (1 << sock))
+      count++;
+  }
+  while (count < backlog) {
+    SOCKET sock = socketAcquire(chip());
+    if (sock == MAX_SOCK_NUM)
+      break;
+    _eth->pollChanged(sock);
+    socket(chip(), sock, SnMR::TCP, _port, 0);
+    listen(chip(), sock);
+    _eth->_server_port[sock] = _port;
+    listening |= 1 << sock;
+    count++;
+  }
+  _listening = listening;
+}
 
-  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
+// Sweep this server's sockets into poll, close those the peer is done with
+// and keep the backlog listening
+void EthernetServer::accept(EthernetPoll &poll)
+{
+  uint8_t listening = 0;
+  uint8_t closing = 0;
 
-    if (EthernetClass::_server_port[sock] == _port) {
-      if (client.status() == SnSR::LISTEN) {
-        listening = 1;
+  {
+    // One bus transaction for the whole scan
+    EthernetSession session(chip());
+    uint8_t mine = 0;
+    for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+      if (_eth->_server_port[sock] == _port)
+        mine |= 1 << sock;
+    }
+    if (_eth->_pollCount != _polled) {
+      // Ethernet.poll() has swept every socket since this server last looked
+      poll = _eth->_poll;
+      _polled = _eth->_pollCount;
+    } else {
+      memset(&poll, 0, sizeof(poll));
+      socketPoll(chip(), mine, poll.status, poll.available, NULL);
+    }
+    unsigned long now = millis();
+    uint32_t since = now - _swept;
+    for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+      if (_eth->_server_port[sock] == _port) {
+        uint8_t s = poll.status[sock];
+        if (isListening(s)) {
+          listening |= 1 << sock;
+        } 
+        else if (s == SnSR::CLOSE_WAIT && !poll.available[sock]) {
+          closing |= 1 << sock;
+        }
+        else if (s == SnSR::CLOSED) {
+          // Reset or timed out: nothing left to stop
+          socketRelease(chip(), sock);
+          _eth->_server_port[sock] = 0;
+        }
+        // Listening at the last sweep and connected since: it connected
+        // at most since ms ago
+        if ((_listening & (1 << sock)) && !isListening(s) && s != SnSR::CLOSED) {
+          _stats.accepted++;
+          _stats.latencyTotal += since;
+          if (since > _stats.latencyMax)
+            _stats.latencyMax = since;
+        }
       } 
-      else if (client.status() == SnSR::CLOSE_WAIT && !client.available()) {
-        client.stop();
-      }
-    } 
+    }
+    if (_listening && !listening) {
+      _stats.drained++;
+      _stats.drainedTime += since;
+    }
+    _swept = now;
   }
 
-  if (!listening) {
-    begin();
+  // stop() waits for the peer, so it runs with the bus released
+  for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+    if (closing & (1 << sock)) {
+      EthernetClient client(*_eth, sock);
+      client.stop();
+    }
   }
+
+  arm(listening);
 }
 
 EthernetClient EthernetServer::available()
 {
-  accept();
+  // The sweep accept() makes still holds for the connected sockets: those
+  // it closes or opens have no data
+  EthernetPoll poll;
+  accept(poll);
 
-  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
-    if (EthernetClass::_server_port[sock] == _port) {
-      uint8_t s = client.status();
+  for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+    if (_eth->_server_port[sock] == _port) {
+      uint8_t s = poll.status[sock];
       if (s == SnSR::ESTABLISHED || s == SnSR::CLOSE_WAIT) {
-        if (client.available()) {
+        if (poll.available[sock]) {
           // XXX: don't always pick the lowest numbered socket.
-          return client;
+          return EthernetClient(*_eth, sock);
         }
       }
     }
   }
 
-  return EthernetClient(MAX_SOCK_NUM);
+  return EthernetClient(*_eth, MAX_SOCK_NUM);
 }
 
 size_t EthernetServer::write(uint8_t b) 
@@ -77,13 +199,14 @@ size_t EthernetServer::write(const uint8_t *buffer, size_t size)
 {
   size_t n = 0;
   
-  accept();
+  EthernetPoll poll;
+  accept(poll);
 
-  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
+  for (int sock = 0; sock < chip().getSocketCount(); sock++) {
+    EthernetClient client(*_eth, sock);
 
-    if (EthernetClass::_server_port[sock] == _port &&
-      client.status() == SnSR::ESTABLISHED) {
+    if (_eth->_server_port[sock] == _port &&
+      poll.status[sock] == SnSR::ESTABLISHED) {
       n += client.write(buffer, size);
     }
   }
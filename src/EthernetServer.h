@@ -2,18 +2,60 @@
 #define ethernetserver_h
 
 #include "Server.h"
+#include "utility/w5100.h"
 
+// Sockets a server keeps listening on its port unless setBacklog() says
+// otherwise
+#ifndef ETHERNET_SERVER_BACKLOG
+#define ETHERNET_SERVER_BACKLOG 1
+#endif
+
+class EthernetClass;
 class EthernetClient;
+struct EthernetPoll;
+
+/**
+ * @brief	How a server's backlog kept up, counted by available() and write().
+ *        The chip answers a SYN with a reset when no socket listens on the
+ *        port and says nothing about it, so refused SYNs are bounded by the
+ *        times the backlog was found drained.  Times are in ms.
+ */
+struct EthernetServerStats {
+  uint32_t accepted;     // Connections taken off the backlog
+  uint32_t latencyTotal; // Summed over them: the longest each could have waited to be seen
+  uint32_t latencyMax;
+  uint32_t drained;      // Sweeps that found no socket left listening: SYNs were refused
+  uint32_t drainedTime;  // Summed over them: the longest the port could have gone unheard
+};
 
 class EthernetServer : 
 public Server {
 private:
+  EthernetClass *_eth;
   uint16_t _port;
-  void accept();
+  uint8_t _backlog;
+  uint8_t _listening;     // Sockets seen listening by the last sweep
+  unsigned long _swept;   // millis() of the last sweep
+  uint32_t _polled;       // Ethernet.poll() count as of the last sweep
+  EthernetServerStats _stats;
+#if ETHERNET_MULTI_CHIP
+  W5100Class &chip();
+#else
+  W5100Class &chip() { return W5100; }
+#endif
+  void accept(EthernetPoll &poll);
+  void arm(uint8_t listening);
 public:
   EthernetServer(uint16_t);
+  EthernetServer(uint16_t, EthernetClass &eth);
   EthernetClient available();
   virtual void begin();
+  // Keep backlog sockets (at least 1, at most the chip's sockets)
+  // listening, so that connections arriving together are all taken.  Each
+  // is opened again as it connects.
+  void setBacklog(uint8_t backlog);
+  const EthernetServerStats &stats() const { return _stats; }
+  void resetStats();
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
   using Print::write;
@@ -32,28 +32,27 @@
 #include "Udp.h"
 #include "Dns.h"
 
+#if ETHERNET_MULTI_CHIP
+W5100Class &EthernetUDP::chip() { return _eth->chip(); }
+#endif
+
 /* Constructor */
-EthernetUDP::EthernetUDP() : _sock(MAX_SOCK_NUM) {}
+EthernetUDP::EthernetUDP() : _eth(&Ethernet), _offset(0), _sock(MAX_SOCK_NUM), _remaining(0) {}
+EthernetUDP::EthernetUDP(EthernetClass &eth) : _eth(&eth), _offset(0), _sock(MAX_SOCK_NUM), _remaining(0) {}
 
 /* Start EthernetUDP socket, listening at local port PORT */
 uint8_t EthernetUDP::begin(uint16_t port) {
   if (_sock != MAX_SOCK_NUM)
     return 0;
 
-  for (int i = 0; i < MAX_SOCK_NUM; i++) {
-    uint8_t s = socketStatus(i);
-    if (s == SnSR::CLOSED || s == SnSR::FIN_WAIT) {
-      _sock = i;
-      break;
-    }
-  }
-
+  EthernetSession session(chip());
+  _sock = socketAcquire(chip());
   if (_sock == MAX_SOCK_NUM)
     return 0;
 
   _port = port;
   _remaining = 0;
-  socket(_sock, SnMR::UDP, _port, 0);
+  socket(chip(), _sock, SnMR::UDP, _port, 0);
 
   return 1;
 }
@@ -70,9 +69,10 @@ void EthernetUDP::stop()
   if (_sock == MAX_SOCK_NUM)
     return;
 
-  close(_sock);
+  EthernetSession session(chip());
+  close(chip(), _sock);
 
-  EthernetClass::_server_port[_sock] = 0;
+  _eth->_server_port[_sock] = 0;
   _sock = MAX_SOCK_NUM;
 }
 
@@ -80,10 +80,10 @@ int EthernetUDP::beginPacket(const char *host, uint16_t port)
 {
   // Look up the host first
   int ret = 0;
-  DNSClient dns;
+  DNSClient dns(*_eth);
   IPAddress remote_addr;
 
-  dns.begin(Ethernet.dnsServerIP());
+  dns.begin(_eth->dnsServerIP());
   ret = dns.getHostByName(host, remote_addr);
   if (ret == 1) {
     return beginPacket(remote_addr, port);
@@ -94,13 +94,17 @@ int EthernetUDP::beginPacket(const char *host, uint16_t port)
 
 int EthernetUDP::beginPacket(IPAddress ip, uint16_t port)
 {
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
   _offset = 0;
-  return startUDP(_sock, rawIPAddress(ip), port);
+  return startUDP(chip(), _sock, rawIPAddress(ip), port);
 }
 
 int EthernetUDP::endPacket()
 {
-  return sendUDP(_sock);
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  return sendUDP(chip(), _sock);
 }
 
 size_t EthernetUDP::write(uint8_t byte)
@@ -110,28 +114,40 @@ size_t EthernetUDP::write(uint8_t byte)
 
 size_t EthernetUDP::write(const uint8_t *buffer, size_t size)
 {
-  uint16_t bytes_written = bufferData(_sock, _offset, buffer, size);
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  uint16_t bytes_written = bufferData(chip(), _sock, _offset, buffer, size);
+  _offset += bytes_written;
+  return bytes_written;
+}
+
+size_t EthernetUDP::write(const EthernetIovec *iov, uint8_t count)
+{
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  uint16_t bytes_written = bufferDatav(chip(), _sock, _offset, iov, count);
   _offset += bytes_written;
   return bytes_written;
 }
 
 int EthernetUDP::parsePacket()
 {
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
   // discard any remaining bytes in the last packet
-  while (_remaining) {
-    // could this fail (loop endlessly) if _remaining > 0 and recv in read fails?
-    // should only occur if recv fails after telling us the data is there, lets
-    // hope the w5100 always behaves :)
-    read();
+  if (_remaining) {
+    _remaining -= recvSkip(chip(), _sock, _remaining);
+    if (_remaining)
+      return 0;
   }
 
-  if (recvAvailable(_sock) > 0)
+  if (recvAvailable(chip(), _sock) > 0)
   {
     //HACK - hand-parse the UDP packet using TCP recv method
     uint8_t tmpBuf[8];
     int ret =0; 
     //read 8 header bytes and get IP and port from it
-    ret = recv(_sock,tmpBuf,8);
+    ret = recv(chip(), _sock,tmpBuf,8);
     if (ret > 0)
     {
       _remoteIP = tmpBuf;
@@ -153,7 +169,7 @@ int EthernetUDP::read()
 {
   uint8_t byte;
 
-  if ((_remaining > 0) && (recv(_sock, &byte, 1) > 0))
+  if ((_remaining > 0) && (recv(chip(), _sock, &byte, 1) > 0))
   {
     // We read things without any problems
     _remaining--;
@@ -175,13 +191,13 @@ int EthernetUDP::read(unsigned char* buffer, size_t len)
     if (_remaining <= len)
     {
       // data should fit in the buffer
-      got = recv(_sock, buffer, _remaining);
+      got = recv(chip(), _sock, buffer, _remaining);
     }
     else
     {
       // too much data for the buffer, 
       // grab as much as will fit
-      got = recv(_sock, buffer, len);
+      got = recv(chip(), _sock, buffer, len);
     }
 
     if (got > 0)
@@ -205,10 +221,78 @@ int EthernetUDP::peek()
   // may get the UDP header
   if (!_remaining)
     return -1;
-  ::peek(_sock, &b);
+  ::peek(chip(), _sock, &b);
   return b;
 }
 
+size_t EthernetUDP::skip(size_t n)
+{
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  if (n > _remaining)
+    n = _remaining;
+  uint16_t got = recvSkip(chip(), _sock, n);
+  _remaining -= got;
+  return got;
+}
+
+size_t EthernetUDP::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length)
+  {
+    size_t want = length - count;
+    int got = read(buffer + count, want > 0x7FFF ? 0x7FFF : want);
+    if (got <= 0)
+      break;
+    count += got;
+  }
+  return count;
+}
+
+size_t EthernetUDP::readBytesUntil(char terminator, uint8_t *buffer, size_t length)
+{
+  if (!_remaining)
+    return 0;
+  int end = recvFind(chip(), _sock, (const uint8_t *)&terminator, 1);
+  size_t want = (end >= 0 && end < _remaining) ? end : _remaining;
+  if (want > length)
+    want = length;
+  size_t count = readBytes(buffer, want);
+  if (count == want && end >= 0 && (size_t)end == want)
+  {
+    // The terminator is dropped
+    _remaining -= recvSkip(chip(), _sock, 1);
+  }
+  return count;
+}
+
+bool EthernetUDP::find(const uint8_t *target, size_t length)
+{
+  if (length == 0)
+    return true;
+  if (length > ETHERNET_SCAN_CHUNK)
+    return Stream::find((char *)target, length);
+  int at = _remaining ? recvFind(chip(), _sock, target, length) : -1;
+  bool found = (at >= 0 && at + length <= _remaining);
+  // Like Stream::find(), a miss uses up the packet
+  uint16_t len = found ? at + length : _remaining;
+  _remaining -= recvSkip(chip(), _sock, len);
+  return found;
+}
+
+String EthernetUDP::readString()
+{
+  EthernetReadAhead ahead(chip(), _sock);
+  return Stream::readString();
+}
+
+String EthernetUDP::readStringUntil(char terminator)
+{
+  EthernetReadAhead ahead(chip(), _sock);
+  return Stream::readStringUntil(terminator);
+}
+
 void EthernetUDP::flush()
 {
   // TODO: we should wait for TX buffer to be emptied
@@ -220,14 +304,8 @@ uint8_t EthernetUDP::beginMulticast(IPAddress ip, uint16_t port)
   if (_sock != MAX_SOCK_NUM)
     return 0;
 
-  for (int i = 0; i < MAX_SOCK_NUM; i++) {
-    uint8_t s = W5100.readSnSR(i);
-    if (s == SnSR::CLOSED || s == SnSR::FIN_WAIT) {
-      _sock = i;
-      break;
-    }
-  }
-
+  EthernetSession session(chip());
+  _sock = socketAcquire(chip());
   if (_sock == MAX_SOCK_NUM)
     return 0;
 
@@ -238,12 +316,12 @@ uint8_t EthernetUDP::beginMulticast(IPAddress ip, uint16_t port)
   mac[4] = ip[2];
   mac[5] = ip[3];
 
-  W5100.writeSnDIPR(_sock, rawIPAddress(ip));   //239.255.0.1
-  W5100.writeSnDPORT(_sock, port);
-  W5100.writeSnDHAR(_sock,mac);
+  chip().writeSnDIPR(_sock, rawIPAddress(ip));   //239.255.0.1
+  chip().writeSnDPORT(_sock, port);
+  chip().writeSnDHAR(_sock,mac);
 
   _remaining = 0;
-  socket(_sock, SnMR::UDP, port, SnMR::MULTI);
+  socket(chip(), _sock, SnMR::UDP, port, SnMR::MULTI);
   return 1;
 }
 
@@ -38,11 +38,21 @@
 #define ethernetudp_h
 
 #include <Udp.h>
+#include "utility/w5100.h"
 
 #define UDP_TX_PACKET_MAX_SIZE 24
 
+class EthernetClass;
+
 class EthernetUDP : public UDP {
 private:
+#if ETHERNET_MULTI_CHIP
+  W5100Class &chip();
+#else
+  W5100Class &chip() { return W5100; }
+#endif
+
+  EthernetClass *_eth; // interface the socket lives on
   uint16_t _port; // local port to listen on
   IPAddress _remoteIP; // remote IP address for the incoming packet whilst it's being processed
   uint16_t _remotePort; // remote port for the incoming packet whilst it's being processed
@@ -54,6 +64,7 @@ protected:
 
 public:
   EthernetUDP();  // Constructor
+  EthernetUDP(EthernetClass &eth);  // Constructor on another interface than Ethernet
   virtual uint8_t begin(uint16_t);	// initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
   virtual uint8_t beginMulticast(IPAddress, uint16_t);	// initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
   virtual void stop();  // Finish with the UDP socket
@@ -73,6 +84,8 @@ public:
   virtual size_t write(uint8_t);
   // Write size bytes from buffer into the packet
   virtual size_t write(const uint8_t *buffer, size_t size);
+  // Write the count pieces of iov into the packet in one go
+  size_t write(const EthernetIovec *iov, uint8_t count);
   
   using Print::write;
 
@@ -91,8 +104,30 @@ public:
   virtual int read(char* buffer, size_t len) { return read((unsigned char*)buffer, len); };
   // Return the next byte from the current packet without moving on to the next byte
   virtual int peek();
+  // Drop up to n bytes of the current packet without reading them over the
+  // bus.  Returns the bytes dropped.
+  size_t skip(size_t n);
   virtual void flush();	// Finish reading the current packet
 
+  // Stream's helpers, taking blocks from the current packet instead of a
+  // byte at a time.  The packet is all there, so they never wait.
+  size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+  size_t readBytes(uint8_t *buffer, size_t length);
+  size_t readBytesUntil(char terminator, char *buffer, size_t length) { return readBytesUntil(terminator, (uint8_t *)buffer, length); }
+  size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length);
+  bool find(const char *target) { return find((const uint8_t *)target, strlen(target)); }
+  bool find(const uint8_t *target) { return find(target, strlen((const char *)target)); }
+  bool find(const char *target, size_t length) { return find((const uint8_t *)target, length); }
+  bool find(const uint8_t *target, size_t length);
+  bool find(char target) { return find((const uint8_t *)&target, 1); }
+  // The parsers still go a byte at a time, but from a read-ahead buffer
+  // lent to the socket while they run.  Their parameters differ between
+  // cores, hence the templates.
+  template <typename... T> long parseInt(T... args) { EthernetReadAhead ahead(chip(), _sock); return Stream::parseInt(args...); }
+  template <typename... T> float parseFloat(T... args) { EthernetReadAhead ahead(chip(), _sock); return Stream::parseFloat(args...); }
+  String readString();
+  String readStringUntil(char terminator);
+
   // Return the IP address of the host who sent the current incoming packet
   virtual IPAddress remoteIP() { return _remoteIP; };
   // Return the port of the host who sent the current incoming packet
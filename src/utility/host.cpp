@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2010 by Arduino LLC. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#if !defined(ARDUINO)
+
+#include <chrono>
+#include <thread>
+
+#include "host.h"
+
+static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+unsigned long millis(void)
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+void yield(void)
+{
+  std::this_thread::yield();
+}
+
+#if !defined(ETHERNET_HOST_CORE)
+size_t Stream::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length) {
+    int c = read();
+    if (c < 0)
+      break;
+    buffer[count++] = (uint8_t)c;
+  }
+  return count;
+}
+#endif
+
+#endif
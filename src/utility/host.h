@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2010 by Arduino LLC. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef	HOST_H_INCLUDED
+#define	HOST_H_INCLUDED
+
+// The few Arduino core functions the driver needs, for builds on a host
+// against EthernetMockTransport.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+void delay(unsigned long ms);
+unsigned long millis(void);
+void yield(void);
+
+// sendStream() reads from an Arduino Stream.  Host builds that compile the
+// Ethernet classes too bring their own stand-in for the core, Stream.h
+// included, and define ETHERNET_HOST_CORE; the driver alone gets the part of
+// Stream it uses.
+#if defined(ETHERNET_HOST_CORE)
+#include <Stream.h>
+#else
+class Stream {
+public:
+  virtual ~Stream() { }
+  virtual int available() = 0;
+  virtual int read() = 0;
+  // Up to length bytes, stopping early once read() has nothing
+  size_t readBytes(uint8_t *buffer, size_t length);
+};
+#endif
+
+#endif
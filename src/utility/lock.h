@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2010 by Arduino LLC. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef	LOCK_H_INCLUDED
+#define	LOCK_H_INCLUDED
+
+// 1 where several tasks or cores may call into the driver at once.  Each
+// controller's bus is then guarded by a recursive lock, and the interrupt
+// handler leaves the chip to the next task that releases the bus.
+#ifndef ETHERNET_THREADS
+#if !defined(ARDUINO) || defined(ESP32) || (defined(ARDUINO_ARCH_RP2040) && !defined(ARDUINO_ARCH_MBED))
+#define ETHERNET_THREADS 1
+#else
+#define ETHERNET_THREADS 0
+#endif
+#endif
+
+#if ETHERNET_THREADS
+#if !defined(ARDUINO)
+#include <mutex>
+#elif defined(ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#elif defined(ARDUINO_ARCH_RP2040)
+#include <pico/mutex.h>
+#endif
+#endif
+
+/**
+ * @brief	Recursive lock held by the task that owns a controller's bus.
+ *        Compiles away when ETHERNET_THREADS is 0.
+ */
+class EthernetLock {
+public:
+#if !ETHERNET_THREADS
+  inline void lock()   { }
+  inline void unlock() { }
+#elif !defined(ARDUINO)
+  inline void lock()   { m.lock(); }
+  inline void unlock() { m.unlock(); }
+private:
+  std::recursive_mutex m;
+#elif defined(ESP32)
+  EthernetLock() { m = xSemaphoreCreateRecursiveMutexStatic(&buf); }
+  inline void lock()   { xSemaphoreTakeRecursive(m, portMAX_DELAY); }
+  inline void unlock() { xSemaphoreGiveRecursive(m); }
+private:
+  StaticSemaphore_t buf;
+  SemaphoreHandle_t m;
+#elif defined(ARDUINO_ARCH_RP2040)
+  EthernetLock() { recursive_mutex_init(&m); }
+  inline void lock()   { recursive_mutex_enter_blocking(&m); }
+  inline void unlock() { recursive_mutex_exit(&m); }
+private:
+  recursive_mutex_t m;
+#else
+#error "ETHERNET_THREADS needs a lock for this platform"
+#endif
+};
+
+#endif
@@ -1,29 +1,270 @@
+#if defined(ARDUINO)
+#include <Stream.h>
+#endif
+
 #include "w5100.h"
 #include "socket.h"
 
-static uint16_t local_port;
+// Each controller keeps a conservative local view of its sockets' buffers
+// in socketState.  The chip only ever adds received data and frees transmit
+// space behind our back, so counting down what the library consumes never
+// over-reports; the chip is asked again only once a count has run out.
+
+// Received size, re-read from the chip only when the local count is used up.
+// Call with the bus transaction held.
+static uint16_t receivedSize(W5100Class &chip, SOCKET s)
+{
+  if (chip.socketState[s].RX_RSR == 0)
+    chip.socketState[s].RX_RSR = chip.getRXReceivedSize(s);
+  return chip.socketState[s].RX_RSR;
+}
+
+// Free Tx space, re-read from the chip only when the local count is below len.
+// Writers pass what they want to queue; reports pass the buffer size, so that
+// space freed since is seen.  The chip does not count data queued since the
+// last SEND.  Call with the bus transaction held.
+static uint16_t freeSize(W5100Class &chip, SOCKET s, uint16_t len)
+{
+  W5100Class::SocketState &st = chip.socketState[s];
+  if (st.TX_FSR < len) {
+    uint16_t fsr = chip.getTXFreeSize(s);
+    st.TX_FSR = (fsr > st.TX_QUEUED) ? fsr - st.TX_QUEUED : 0;
+  }
+  return st.TX_FSR;
+}
+
+static void consumeRX(W5100Class &chip, SOCKET s, uint16_t len)
+{
+  chip.socketState[s].RX_RSR = (chip.socketState[s].RX_RSR > len) ? chip.socketState[s].RX_RSR - len : 0;
+}
+
+static void consumeTX(W5100Class &chip, SOCKET s, uint16_t len)
+{
+  chip.socketState[s].TX_FSR = (chip.socketState[s].TX_FSR > len) ? chip.socketState[s].TX_FSR - len : 0;
+}
+
+// The SnIR bits in mask raised on s, cleared as they are returned.  In
+// interrupt mode they come from the event queue without bus traffic,
+// otherwise from SnIR itself.  Call with the bus transaction held.
+static uint8_t takeIR(W5100Class &chip, SOCKET s, uint8_t mask)
+{
+  uint8_t ir;
+  if (chip.interruptMode()) {
+    chip.socketState[s].IR |= chip.takeEvents(s);
+    ir = chip.socketState[s].IR & mask;
+    chip.socketState[s].IR &= ~ir;
+  } else {
+    ir = chip.readSnIR(s) & mask;
+    if (ir)
+      chip.writeSnIR(s, ir);
+  }
+  return ir;
+}
+
+// Drop every event raised on s so far
+static void clearIR(W5100Class &chip, SOCKET s)
+{
+  if (chip.interruptMode())
+    chip.takeEvents(s);
+  chip.socketState[s].IR = 0;
+}
+
+// Wait for the SEND command just issued on s.  Returns SnIR::SEND_OK once
+// it is done, SnIR::TIMEOUT if the chip gave up, or 0 if the socket closed.
+// Call with the bus transaction held; it is released while waiting.
+static uint8_t waitSend(W5100Class &chip, SOCKET s)
+{
+  for (;;) {
+    uint8_t ir = takeIR(chip, s, SnIR::SEND_OK | SnIR::TIMEOUT);
+    if (ir & SnIR::SEND_OK)
+      return SnIR::SEND_OK;
+    if (ir)
+      return SnIR::TIMEOUT;
+    // With interrupts a socket only closes under us after raising DISCON
+    if (!chip.interruptMode() || (chip.socketState[s].IR & SnIR::DISCON)) {
+      if (chip.readSnSR(s) == SnSR::CLOSED)
+        return 0;
+    }
+    chip.endTransaction();
+    yield();
+    chip.beginTransaction();
+  }
+}
+
+// TCP data is written into the Tx ring at TX_QUEUED past TX_WR (which reads
+// back unchanged until the next SEND) while an earlier SEND is still in
+// flight.  Only one SEND is outstanding at a time; the next one goes out for
+// everything queued once it completes.  A coalescing socket also holds its
+// data back until TX_HOLD bytes are queued or TX_DELAY ms have passed.
+
+// True while coalescing keeps the data queued on s from being sent
+static bool holdSend(W5100Class &chip, SOCKET s)
+{
+  W5100Class::SocketState &st = chip.socketState[s];
+  if (!st.TX_HOLD || st.TX_QUEUED >= st.TX_HOLD)
+    return false;
+  return !st.TX_DELAY || (uint16_t)((uint16_t)millis() - st.TX_SINCE) < st.TX_DELAY;
+}
+
+// Retire the SEND in flight on s once it completes, waiting for it if block
+// is set, then issue one for everything queued unless coalescing holds it
+// back; block or force send it regardless.  Returns false if the chip gave
+// up or the socket closed.  Call with the bus transaction held.
+static bool pumpSend(W5100Class &chip, SOCKET s, bool block, bool force = false)
+{
+  W5100Class::SocketState &st = chip.socketState[s];
+  if (st.SENDING) {
+    uint8_t ir = block ? waitSend(chip, s) : takeIR(chip, s, SnIR::SEND_OK | SnIR::TIMEOUT);
+    if (ir & SnIR::SEND_OK) {
+      st.SENDING = false;
+    } else if (ir || block) {
+      st.SENDING = false;
+      st.TX_QUEUED = 0;
+      return false;
+    }
+  }
+  if (!st.SENDING && st.TX_QUEUED && (block || force || !holdSend(chip, s))) {
+    chip.issueCmdSn(s, Sock_SEND);
+    st.SENDING = true;
+    st.TX_QUEUED = 0;
+  }
+  return true;
+}
+
+// Queue len bytes at the Tx cursor; the caller has checked there is room.
+// Call with the bus transaction held.
+static void queueData(W5100Class &chip, SOCKET s, const uint8_t *buf, uint16_t len)
+{
+  if (chip.socketState[s].TX_QUEUED == 0)
+    chip.socketState[s].TX_SINCE = millis();
+  chip.send_data_processing_offset(s, chip.socketState[s].TX_QUEUED, buf, len);
+  consumeTX(chip, s, len);
+  chip.socketState[s].TX_QUEUED += len;
+}
+
+// Write len bytes of the segments, from off bytes into iov[*i] on, data_offset
+// bytes past TX_WR with a single pointer update.  *i and *off are left just
+// after them.  Call with the bus transaction held.
+static void writeSegments(W5100Class &chip, SOCKET s, uint16_t data_offset, const EthernetIovec *iov, uint8_t *i, uint16_t *off, uint16_t len)
+{
+  chip.waitCmdSn(s);
+  uint16_t ptr = chip.readSnTX_WR(s) + data_offset;
+  while (len) {
+    uint16_t n = iov[*i].len - *off;
+    if (n > len)
+      n = len;
+    if (n)
+      chip.write_data(s, ptr, iov[*i].data + *off, n);
+    ptr += n;
+    len -= n;
+    *off += n;
+    if (*off == iov[*i].len) {
+      (*i)++;
+      *off = 0;
+    }
+  }
+  chip.writeSnTX_WR(s, ptr);
+}
+
+// Send everything queued on s and wait until the chip has it all.  Returns
+// false if the socket failed.  Call with the bus transaction held.
+static bool drainSend(W5100Class &chip, SOCKET s)
+{
+  while (chip.socketState[s].SENDING || chip.socketState[s].TX_QUEUED) {
+    if (!pumpSend(chip, s, true))
+      return false;
+  }
+  return true;
+}
+
+// Move RX_RD past the bytes read since it last moved and issue RECV, so the
+// chip can reuse the space.  Call with the bus transaction held.
+static void commitRX(W5100Class &chip, SOCKET s)
+{
+  W5100Class::SocketState &st = chip.socketState[s];
+  if (st.RX_HEAD) {
+    chip.recv_data_skip(s, st.RX_HEAD);
+    chip.issueCmdSn(s, Sock_RECV);
+    consumeRX(chip, s, st.RX_HEAD);
+    st.RX_HEAD = 0;
+  }
+}
+
+// Count len more bytes as read.  Like a delayed TCP window update, they are
+// only given back to the chip once enough have been read, or all there is.
+// Call with the bus transaction held.
+static void takeRX(W5100Class &chip, SOCKET s, uint16_t len)
+{
+  W5100Class::SocketState &st = chip.socketState[s];
+  uint16_t threshold = st.RX_COMMIT ? st.RX_COMMIT : chip.RSIZE[s] / 2;
+  st.RX_HEAD += len;
+  if (st.RX_HEAD >= threshold || st.RX_HEAD >= st.RX_RSR)
+    commitRX(chip, s);
+}
+
+// Copy as much unread data as fits into the empty read-ahead buffer.  Call
+// with the bus transaction held.
+static uint16_t fillAhead(W5100Class &chip, SOCKET s)
+{
+  W5100Class::SocketState &st = chip.socketState[s];
+  st.RX_POS = 0;
+  st.RX_FILL = receivedSize(chip, s) - st.RX_HEAD;
+  if (st.RX_FILL > st.RX_BUFSIZE)
+    st.RX_FILL = st.RX_BUFSIZE;
+  if (st.RX_FILL)
+    chip.recv_data_processing_offset(s, st.RX_HEAD, st.RX_BUF, st.RX_FILL);
+  return st.RX_FILL;
+}
+
+// Forget the socket's local view of the chip
+static void resetState(W5100Class &chip, SOCKET s)
+{
+  chip.socketState[s].RX_RSR = 0;
+  chip.socketState[s].RX_HEAD = 0;
+  chip.socketState[s].RX_COMMIT = 0;
+  chip.socketState[s].RX_BUF = NULL;
+  chip.socketState[s].RX_POS = 0;
+  chip.socketState[s].RX_FILL = 0;
+  chip.socketState[s].TX_FSR = 0;
+  chip.socketState[s].TX_QUEUED = 0;
+  chip.socketState[s].TX_HOLD = 0;
+  chip.socketState[s].TX_DELAY = 0;
+  chip.socketState[s].SENDING = false;
+  clearIR(chip, s);
+}
 
 /**
  * @brief	This Socket function initialize the channel in perticular mode, and set the port and wait for W5100 done it.
  * @return 	1 for success else 0.
  */
-uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag)
+uint8_t socket(W5100Class &chip, SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
   if ((protocol == SnMR::TCP) || (protocol == SnMR::UDP) || (protocol == SnMR::IPRAW) || (protocol == SnMR::MACRAW) || (protocol == SnMR::PPPOE))
   {
-    close(s);
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    W5100.writeSnMR(s, protocol | flag);
+    close(chip, s);
+    chip.beginTransaction();
+    chip.writeSnMR(s, protocol | flag);
     if (port != 0) {
-      W5100.writeSnPORT(s, port);
+      chip.writeSnPORT(s, port);
     } 
     else {
-      local_port++; // if don't set the source port, set local_port number.
-      W5100.writeSnPORT(s, local_port);
+      chip.localPort++; // if don't set the source port, set local_port number.
+      chip.writeSnPORT(s, chip.localPort);
     }
 
-    W5100.execCmdSn(s, Sock_OPEN);
-    SPI.endTransaction();
+    chip.issueCmdSn(s, Sock_OPEN);
+    chip.socketsOwned |= 1 << s;
+    chip.endTransaction();
+    resetState(chip, s);
+#if ETHERNET_READ_AHEAD > 0
+    if (protocol == SnMR::TCP)
+    {
+      chip.socketState[s].RX_BUF = chip.socketState[s].RX_AHEAD;
+      chip.socketState[s].RX_BUFSIZE = ETHERNET_READ_AHEAD;
+    }
+#endif
     return 1;
   }
 
@@ -31,24 +272,124 @@ uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag)
 }
 
 
-uint8_t socketStatus(SOCKET s)
+uint8_t socketStatus(W5100Class &chip, SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  uint8_t status = W5100.readSnSR(s);
-  SPI.endTransaction();
+  if (s >= chip.getSocketCount())
+    return SnSR::CLOSED;
+  chip.beginTransaction();
+  chip.waitCmdSn(s);
+  // A status poll is also where data queued behind a SEND gets sent
+  if (chip.socketState[s].TX_QUEUED)
+    pumpSend(chip, s, false);
+  uint8_t status = chip.readSnSR(s);
+  chip.endTransaction();
   return status;
 }
 
 
+/**
+ * @brief	Sweep the sockets in the mask sockets in one bus transaction.  Sizes come from
+ *        the local counts, which are only read again once used up, and data queued behind
+ *        a SEND is sent.
+ */
+void socketPoll(W5100Class &chip, uint8_t sockets, uint8_t *status, uint16_t *rx, uint16_t *tx)
+{
+  chip.beginTransaction();
+  for (SOCKET s = 0; s < MAX_SOCK_NUM; s++) {
+    if (!(sockets & (1 << s)))
+      continue;
+    status[s] = SnSR::CLOSED;
+    rx[s] = 0;
+    if (tx)
+      tx[s] = 0;
+    if (s >= chip.getSocketCount())
+      continue;
+    if (chip.socketState[s].TX_QUEUED)
+      pumpSend(chip, s, false);
+    status[s] = chip.readSnSR(s);
+    if (status[s] == SnSR::ESTABLISHED || status[s] == SnSR::CLOSE_WAIT ||
+        status[s] == SnSR::UDP || status[s] == SnSR::IPRAW || status[s] == SnSR::MACRAW) {
+      rx[s] = receivedSize(chip, s) - chip.socketState[s].RX_HEAD;
+      if (tx)
+        tx[s] = freeSize(chip, s, chip.SSIZE[s]);
+    }
+  }
+  chip.endTransaction();
+}
+
+
 /**
  * @brief	This function close the socket and parameter is "s" which represent the socket number
  */
-void close(SOCKET s)
+void close(W5100Class &chip, SOCKET s)
+{
+  if (s >= chip.getSocketCount())
+    return;
+  chip.beginTransaction();
+  chip.issueCmdSn(s, Sock_CLOSE);
+  chip.writeSnIR(s, 0xFF);
+  chip.socketsOwned &= ~(1 << s);
+  chip.endTransaction();
+  resetState(chip, s);
+}
+
+
+SOCKET socketAcquire(W5100Class &chip, bool closeWait)
+{
+  SOCKET found = MAX_SOCK_NUM;
+  chip.beginTransaction();
+  // An unowned socket can still be in use by an old connection nobody holds
+  // any more, so it is only taken once the chip has closed it
+  for (SOCKET s = 0; s < chip.getSocketCount(); s++) {
+    if (!(chip.socketsOwned & (1 << s)) && chip.readSnSR(s) == SnSR::CLOSED) {
+      found = s;
+      break;
+    }
+  }
+  if (found == MAX_SOCK_NUM) {
+    for (SOCKET s = 0; s < chip.getSocketCount(); s++) {
+      uint8_t status = chip.readSnSR(s);
+      if (status == SnSR::CLOSED || status == SnSR::FIN_WAIT ||
+          (closeWait && status == SnSR::CLOSE_WAIT)) {
+        found = s;
+        break;
+      }
+    }
+  }
+  if (found != MAX_SOCK_NUM)
+    chip.socketsOwned |= 1 << found;
+  chip.endTransaction();
+  return found;
+}
+
+
+void socketRelease(W5100Class &chip, SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.execCmdSn(s, Sock_CLOSE);
-  W5100.writeSnIR(s, 0xFF);
-  SPI.endTransaction();
+  if (s >= chip.getSocketCount())
+    return;
+  chip.beginTransaction();
+  chip.socketsOwned &= ~(1 << s);
+  chip.endTransaction();
+}
+
+
+uint8_t socketWait(W5100Class &chip, SOCKET s, uint8_t events, unsigned long timeout)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  if (!chip.interruptMode()) {
+    delay(timeout ? 1 : 0);
+    return 0;
+  }
+  unsigned long start = millis();
+  for (;;) {
+    chip.beginTransaction();
+    uint8_t ir = takeIR(chip, s, events);
+    chip.endTransaction();
+    if (ir || millis() - start >= timeout)
+      return ir;
+    yield();
+  }
 }
 
 
@@ -56,15 +397,18 @@ void close(SOCKET s)
  * @brief	This function established  the connection for the channel in passive (server) mode. This function waits for the request from the peer.
  * @return	1 for success else 0.
  */
-uint8_t listen(SOCKET s)
+uint8_t listen(W5100Class &chip, SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  if (W5100.readSnSR(s) != SnSR::INIT) {
-    SPI.endTransaction();
+  if (s >= chip.getSocketCount())
+    return 0;
+  chip.beginTransaction();
+  chip.waitCmdSn(s);
+  if (chip.readSnSR(s) != SnSR::INIT) {
+    chip.endTransaction();
     return 0;
   }
-  W5100.execCmdSn(s, Sock_LISTEN);
-  SPI.endTransaction();
+  chip.issueCmdSn(s, Sock_LISTEN);
+  chip.endTransaction();
   return 1;
 }
 
@@ -75,8 +419,10 @@ uint8_t listen(SOCKET s)
  * 		
  * @return	1 for success else 0.
  */
-uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port)
+uint8_t connect(W5100Class &chip, SOCKET s, uint8_t * addr, uint16_t port)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
   if 
     (
   ((addr[0] == 0xFF) && (addr[1] == 0xFF) && (addr[2] == 0xFF) && (addr[3] == 0xFF)) ||
@@ -86,11 +432,11 @@ uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port)
     return 0;
 
   // set destination IP
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.writeSnDIPR(s, addr);
-  W5100.writeSnDPORT(s, port);
-  W5100.execCmdSn(s, Sock_CONNECT);
-  SPI.endTransaction();
+  chip.beginTransaction();
+  chip.writeSnDIPR(s, addr);
+  chip.writeSnDPORT(s, port);
+  chip.issueCmdSn(s, Sock_CONNECT);
+  chip.endTransaction();
 
   return 1;
 }
@@ -101,86 +447,231 @@ uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port)
  * @brief	This function used for disconnect the socket and parameter is "s" which represent the socket number
  * @return	1 for success else 0.
  */
-void disconnect(SOCKET s)
+void disconnect(W5100Class &chip, SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.execCmdSn(s, Sock_DISCON);
-  SPI.endTransaction();
+  if (s >= chip.getSocketCount())
+    return;
+  chip.beginTransaction();
+  // Data still queued would be lost behind the FIN
+  drainSend(chip, s);
+  chip.issueCmdSn(s, Sock_DISCON);
+  chip.endTransaction();
 }
 
 
 /**
- * @brief	This function used to send the data in TCP mode
- * @return	1 for success else 0.
+ * @brief	This function used to send the data in TCP mode.  The data is queued in the Tx
+ *        ring and sent behind any SEND still in flight; it waits only while the ring is
+ *        full.
+ * @return	Bytes queued: len, or fewer if the connection is gone.  If a SEND failed the
+ *        socket is also closed.
  */
-uint16_t send(SOCKET s, const uint8_t * buf, uint16_t len)
+uint16_t send(W5100Class &chip, SOCKET s, const uint8_t * buf, uint16_t len)
 {
-  uint8_t status=0;
-  uint16_t ret=0;
-  uint16_t freesize=0;
+  if (s >= chip.getSocketCount())
+    return 0;
+  EthernetIovec iov = { buf, len };
+  return sendv(chip, s, &iov, 1);
+}
 
-  if (len > W5100.SSIZE) 
-    ret = W5100.SSIZE; // check size not to exceed MAX size.
-  else 
-    ret = len;
 
-  // if freebuf is available, start.
-  do 
-  {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    freesize = W5100.getTXFreeSize(s);
-    status = W5100.readSnSR(s);
-    SPI.endTransaction();
-    if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT))
-    {
-      ret = 0; 
-      break;
-    }
-    yield();
-  } 
-  while (freesize < ret);
+/**
+ * @brief	Queue the count segments of iov on the TCP socket as one run of data: each
+ *        ring's worth goes in with one Tx pointer update and out with one SEND.
+ * @return	Bytes queued; short if the connection is gone.  If a SEND failed the socket is
+ *        also closed.
+ */
+uint32_t sendv(W5100Class &chip, SOCKET s, const EthernetIovec *iov, uint8_t count)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  W5100Class::SocketState &st = chip.socketState[s];
+  uint32_t len = 0;
+  uint32_t sent = 0;
+  uint8_t i = 0;
+  uint16_t off = 0;
+  bool ok = true;
+  bool open = true;
 
-  // copy data
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.send_data_processing(s, (uint8_t *)buf, ret);
-  W5100.execCmdSn(s, Sock_SEND);
+  for (uint8_t k = 0; k < count; k++)
+    len += iov[k].len;
 
-  /* +2008.01 bj */
-  while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
-  {
-    /* m2008.01 [bj] : reduce code */
-    if ( W5100.readSnSR(s) == SnSR::CLOSED )
-    {
-      SPI.endTransaction();
-      close(s);
-      return 0;
+  chip.beginTransaction();
+  while (ok && open && sent < len) {
+    uint16_t n = (len - sent > 0xFFFF) ? 0xFFFF : len - sent;
+    // The status is only read along with the free size, once the local
+    // count runs short; a close in between shows up as a failed SEND
+    if (st.TX_FSR < n) {
+      uint8_t status = chip.readSnSR(s);
+      open = (status == SnSR::ESTABLISHED) || (status == SnSR::CLOSE_WAIT);
+    }
+    if (open) {
+      uint16_t freesize = freeSize(chip, s, n);
+      if (n > freesize)
+        n = freesize;
+      if (n) {
+        if (st.TX_QUEUED == 0)
+          st.TX_SINCE = millis();
+        writeSegments(chip, s, st.TX_QUEUED, iov, &i, &off, n);
+        consumeTX(chip, s, n);
+        st.TX_QUEUED += n;
+        sent += n;
+      }
+      // A full ring goes out even when coalescing
+      ok = pumpSend(chip, s, false, sent < len);
+    }
+    if (ok && open && sent < len) {
+      // The ring is full: wait for the SEND in flight to drain it
+      chip.endTransaction();
+      yield();
+      chip.beginTransaction();
     }
-    SPI.endTransaction();
-    yield();
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
   }
-  /* +2008.01 bj */
-  W5100.writeSnIR(s, SnIR::SEND_OK);
-  SPI.endTransaction();
+  chip.endTransaction();
+
+  // A SEND the chip gave up on has lost the queued data and left the socket
+  // closed, so close() resets it here.  A socket found no longer connected is
+  // left as it is, for its owner to stop().
+  if (!ok)
+    close(chip, s);
+  return sent;
+}
+
+
+void sendCoalesce(W5100Class &chip, SOCKET s, uint16_t threshold, uint16_t delay)
+{
+  if (s >= chip.getSocketCount())
+    return;
+  W5100Class::SocketState &st = chip.socketState[s];
+  chip.beginTransaction();
+  if (threshold == 0 && delay == 0) {
+    st.TX_HOLD = 0;
+    // Nothing holds back what is already queued any more
+    pumpSend(chip, s, false);
+  } else {
+    st.TX_HOLD = (threshold == 0 || threshold > chip.SSIZE[s]) ? chip.SSIZE[s] : threshold;
+  }
+  st.TX_DELAY = delay;
+  chip.endTransaction();
+}
+
+
+uint16_t sendAvailable(W5100Class &chip, SOCKET s)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  chip.beginTransaction();
+  if (chip.socketState[s].SENDING || chip.socketState[s].TX_QUEUED)
+    pumpSend(chip, s, false);
+  uint16_t ret = freeSize(chip, s, chip.SSIZE[s]);
+  chip.endTransaction();
   return ret;
 }
 
 
+/**
+ * @brief	Send the data queued behind a SEND on every socket, as the per-socket calls do
+ *        for their own.  Reads nothing from the chip for sockets with nothing queued.
+ */
+void sendPending(W5100Class &chip)
+{
+  chip.beginTransaction();
+  for (SOCKET s = 0; s < chip.getSocketCount(); s++) {
+    if (chip.socketState[s].TX_QUEUED)
+      pumpSend(chip, s, false);
+  }
+  chip.endTransaction();
+}
+
+
+/**
+ * @brief	Copy up to len bytes from src to the TCP socket, keeping src and the chip busy
+ *        at the same time.  Each chunk is read with the bus released, so src may be
+ *        another device on the same SPI bus (an SD card), and is queued like send()
+ *        does.  Stops early once src has nothing available.
+ * @return	Bytes queued; short if src ran dry or the connection is gone.  If a SEND
+ *        failed the socket is also closed.
+ */
+uint32_t sendStream(W5100Class &chip, SOCKET s, Stream &src, uint32_t len)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  uint8_t buf[ETHERNET_STREAM_CHUNK];
+  uint32_t sent = 0;
+  bool ok = true;
+  bool open = true;
+
+  while (ok && open && sent < len) {
+    int avail = src.available();
+    uint16_t n = ETHERNET_STREAM_CHUNK;
+    if (len - sent < n)
+      n = len - sent;
+    if (avail < n)
+      n = avail > 0 ? avail : 0;
+    if (n)
+      n = src.readBytes(buf, n);
+    if (n == 0)
+      break;
+
+    chip.beginTransaction();
+    // Room frees up as the SEND in flight drains the ring
+    while (ok && open && freeSize(chip, s, n) < n) {
+      uint8_t status = chip.readSnSR(s);
+      open = (status == SnSR::ESTABLISHED) || (status == SnSR::CLOSE_WAIT);
+      if (open)
+        ok = pumpSend(chip, s, false, true);
+      chip.endTransaction();
+      yield();
+      chip.beginTransaction();
+    }
+    if (ok && open) {
+      queueData(chip, s, buf, n);
+      sent += n;
+      ok = pumpSend(chip, s, false);
+    }
+    chip.endTransaction();
+  }
+
+  if (!ok)
+    close(chip, s);
+  return sent;
+}
+
+
 /**
  * @brief	This function is an application I/F function which is used to receive the data in TCP mode.
  * 		It continues to wait for data as much as the application wants to receive.
  * 		
  * @return	received data size for success else -1.
  */
-int16_t recv(SOCKET s, uint8_t *buf, int16_t len)
+int16_t recv(W5100Class &chip, SOCKET s, uint8_t *buf, int16_t len)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
+  W5100Class::SocketState &st = chip.socketState[s];
+  if (len <= 0)
+    return 0;
   // Check how much data is available
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  int16_t ret = W5100.getRXReceivedSize(s);
+  chip.beginTransaction();
+  if (st.RX_POS < st.RX_FILL && len > 0)
+  {
+    // Served from RAM
+    int16_t ret = st.RX_FILL - st.RX_POS;
+    if (ret > len)
+      ret = len;
+    memcpy(buf, st.RX_BUF + st.RX_POS, ret);
+    st.RX_POS += ret;
+    takeRX(chip, s, ret);
+    chip.endTransaction();
+    return ret;
+  }
+  // Unread data starts RX_HEAD bytes past RX_RD
+  int16_t avail = receivedSize(chip, s) - st.RX_HEAD;
+  int16_t ret = avail;
   if ( ret == 0 )
   {
     // No data available.
-    uint8_t status = W5100.readSnSR(s);
+    uint8_t status = chip.readSnSR(s);
     if ( status == SnSR::LISTEN || status == SnSR::CLOSED || status == SnSR::CLOSE_WAIT )
     {
       // The remote end has closed its side of the connection, so this is the eof state
@@ -197,21 +688,288 @@ int16_t recv(SOCKET s, uint8_t *buf, int16_t len)
     ret = len;
   }
 
+  if ( ret > 0 && st.RX_BUF && len < st.RX_BUFSIZE && ret < avail )
+  {
+    // A short read with more waiting: take it through the read-ahead
+    // buffer, so the reads after it need no bus traffic
+    fillAhead(chip, s);
+    memcpy(buf, st.RX_BUF, ret);
+    st.RX_POS = ret;
+  }
+  else if ( ret > 0 )
+  {
+    chip.recv_data_processing_offset(s, st.RX_HEAD, buf, ret);
+  }
   if ( ret > 0 )
+    takeRX(chip, s, ret);
+  chip.endTransaction();
+  return ret;
+}
+
+
+/**
+ * @brief	Start copying up to len received bytes into buf in the background.  Data already
+ *        in the read-ahead buffer is copied at once.  The bus stays held until asyncDone()
+ *        returns true, which also counts the bytes as read.
+ * @return	Bytes being copied; 0 if none are waiting or a copy is already running.
+ */
+uint16_t recvAsync(W5100Class &chip, SOCKET s, uint8_t *buf, uint16_t len)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  W5100Class::SocketState &st = chip.socketState[s];
+  chip.beginTransaction();
+  if (chip.asyncCopy.len || len == 0) {
+    chip.endTransaction();
+    return 0;
+  }
+  if (st.RX_POS < st.RX_FILL) {
+    uint16_t ret = st.RX_FILL - st.RX_POS;
+    if (ret > len)
+      ret = len;
+    memcpy(buf, st.RX_BUF + st.RX_POS, ret);
+    st.RX_POS += ret;
+    takeRX(chip, s, ret);
+    chip.endTransaction();
+    return ret;
+  }
+  uint16_t ret = receivedSize(chip, s) - st.RX_HEAD;
+  if (ret > len)
+    ret = len;
+  if (ret == 0) {
+    chip.endTransaction();
+    return 0;
+  }
+  st.RX_POS = 0;
+  st.RX_FILL = 0;
+  chip.waitCmdSn(s);
+  chip.asyncCopy.s = s;
+  chip.asyncCopy.len = ret;
+  chip.asyncCopy.send = false;
+  chip.read_data_async(s, chip.readSnRX_RD(s) + st.RX_HEAD, buf, ret, NULL, NULL);
+  return ret;
+}
+
+
+/**
+ * @brief	Start queueing up to len bytes from buf on the TCP socket in the background.
+ *        Only what fits in the Tx ring is taken; it goes out with a SEND from asyncDone(),
+ *        like send() would.  The bus stays held until asyncDone() returns true.
+ * @return	Bytes being copied; 0 if the ring is full, the connection is gone or a copy is
+ *        already running.
+ */
+uint16_t sendAsync(W5100Class &chip, SOCKET s, const uint8_t *buf, uint16_t len)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  W5100Class::SocketState &st = chip.socketState[s];
+  chip.beginTransaction();
+  if (chip.asyncCopy.len || len == 0) {
+    chip.endTransaction();
+    return 0;
+  }
+  bool open = true;
+  if (st.TX_FSR < len) {
+    uint8_t status = chip.readSnSR(s);
+    open = (status == SnSR::ESTABLISHED) || (status == SnSR::CLOSE_WAIT);
+  }
+  uint16_t n = open ? freeSize(chip, s, len) : 0;
+  if (n > len)
+    n = len;
+  if (n == 0) {
+    chip.endTransaction();
+    return 0;
+  }
+  if (st.TX_QUEUED == 0)
+    st.TX_SINCE = millis();
+  chip.waitCmdSn(s);
+  uint16_t ptr = chip.readSnTX_WR(s) + st.TX_QUEUED;
+  chip.asyncCopy.s = s;
+  chip.asyncCopy.len = n;
+  chip.asyncCopy.ptr = ptr + n;
+  chip.asyncCopy.send = true;
+  chip.write_data_async(s, ptr, buf, n, NULL, NULL);
+  return n;
+}
+
+
+/**
+ * @brief	Finish the copy recvAsync() or sendAsync() started, once the transport has
+ *        completed it, and release the bus.  A send whose SEND failed closes the socket.
+ * @return	true once no copy is running
+ */
+bool asyncDone(W5100Class &chip)
+{
+  if (chip.asyncCopy.len == 0)
+    return true;
+  if (chip.asyncBusy())
+    return false;
+  SOCKET s = chip.asyncCopy.s;
+  uint16_t len = chip.asyncCopy.len;
+  bool ok = true;
+  if (chip.asyncCopy.send) {
+    chip.writeSnTX_WR(s, chip.asyncCopy.ptr);
+    consumeTX(chip, s, len);
+    chip.socketState[s].TX_QUEUED += len;
+    ok = pumpSend(chip, s, false);
+  } else {
+    takeRX(chip, s, len);
+  }
+  chip.asyncCopy.len = 0;
+  chip.endTransaction();
+  if (!ok)
+    close(chip, s);
+  return true;
+}
+
+
+/**
+ * @brief	Give received data back to the chip, moving RX_RD and issuing RECV, only once
+ *        threshold bytes have been read (half the Rx buffer if 0), or all that was known
+ *        to be waiting.  1 gives back every read at once.  Lasts until the socket is opened
+ *        again.
+ */
+void recvCoalesce(W5100Class &chip, SOCKET s, uint16_t threshold)
+{
+  if (s >= chip.getSocketCount())
+    return;
+  chip.beginTransaction();
+  chip.socketState[s].RX_COMMIT = threshold;
+  if (chip.socketState[s].RX_HEAD >= threshold)
+    commitRX(chip, s);
+  chip.endTransaction();
+}
+
+
+/**
+ * @brief	Give the socket a read-ahead buffer of size bytes, or none if buf is NULL.
+ *        Lasts until the socket is opened again or closed.
+ */
+void recvReadAhead(W5100Class &chip, SOCKET s, uint8_t *buf, uint16_t size)
+{
+  if (s >= chip.getSocketCount())
+    return;
+  chip.beginTransaction();
+  chip.socketState[s].RX_POS = 0;
+  chip.socketState[s].RX_FILL = 0;
+  chip.socketState[s].RX_BUF = size ? buf : NULL;
+  chip.socketState[s].RX_BUFSIZE = size;
+  chip.endTransaction();
+}
+
+
+EthernetReadAhead::EthernetReadAhead(W5100Class &chip, SOCKET s) : _chip(chip), _s(s), _lent(false)
+{
+  if (s >= chip.getSocketCount())
+    return;
+  chip.beginTransaction();
+  if (!chip.socketState[s].RX_BUF) {
+    recvReadAhead(chip, s, _buf, sizeof(_buf));
+    _lent = true;
+  }
+  chip.endTransaction();
+}
+
+EthernetReadAhead::~EthernetReadAhead()
+{
+  if (!_lent)
+    return;
+  _chip.beginTransaction();
+  // Unless the socket has been closed or given another buffer since
+  if (_chip.socketState[_s].RX_BUF == _buf)
+    recvReadAhead(_chip, _s, NULL, 0);
+  _chip.endTransaction();
+}
+
+
+/**
+ * @brief	Drop up to len received bytes without transferring them: one pointer update and
+ *        one RECV, whatever the length.
+ * @return	Bytes dropped, 0 if none were waiting.
+ */
+uint16_t recvSkip(W5100Class &chip, SOCKET s, uint16_t len)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  W5100Class::SocketState &st = chip.socketState[s];
+  chip.beginTransaction();
+  uint16_t ret = receivedSize(chip, s) - st.RX_HEAD;
+  if (ret > len)
+    ret = len;
+  st.RX_POS = 0;
+  st.RX_FILL = 0;
+  if (ret > 0)
+    takeRX(chip, s, ret);
+  chip.endTransaction();
+  return ret;
+}
+
+
+/**
+ * @brief	Look for delim in the received data, starting from byte from, without consuming
+ *        any of it.  The Rx ring is read ETHERNET_SCAN_CHUNK bytes per bus frame.
+ * @return	Offset of the first byte of delim from the current read position, or -1 if
+ *        it has not been received (yet).
+ */
+int16_t recvFind(W5100Class &chip, SOCKET s, const uint8_t *delim, uint8_t dlen, uint16_t from)
+{
+  if (s >= chip.getSocketCount())
+    return -1;
+  uint8_t buf[ETHERNET_SCAN_CHUNK];
+  int16_t ret = -1;
+
+  if (dlen == 0 || dlen > ETHERNET_SCAN_CHUNK)
+    return -1;
+
+  chip.beginTransaction();
+  // Count everything that has arrived, not just what the local count knows of
+  uint16_t size = chip.getRXReceivedSize(s);
+  chip.socketState[s].RX_RSR = size;
+  // RX_RD is still behind the bytes read since it last moved
+  uint16_t head = chip.socketState[s].RX_HEAD;
+  size -= head;
+  if (from < size && size - from >= dlen)
   {
-    W5100.recv_data_processing(s, buf, ret);
-    W5100.execCmdSn(s, Sock_RECV);
+    chip.waitCmdSn(s);
+    uint16_t ptr = chip.readSnRX_RD(s) + head;
+    uint16_t pos = from;
+    while (ret < 0 && size - pos >= dlen)
+    {
+      uint16_t n = size - pos;
+      if (n > ETHERNET_SCAN_CHUNK)
+        n = ETHERNET_SCAN_CHUNK;
+      chip.read_data(s, ptr + pos, buf, n);
+      for (uint16_t i = 0; i + dlen <= n; i++)
+      {
+        if (buf[i] == delim[0] && memcmp(buf + i, delim, dlen) == 0)
+        {
+          ret = pos + i;
+          break;
+        }
+      }
+      // Start the next chunk dlen - 1 bytes back, for a delimiter split across the two
+      pos += n - dlen + 1;
+    }
   }
-  SPI.endTransaction();
+  chip.endTransaction();
   return ret;
 }
 
 
-int16_t recvAvailable(SOCKET s)
+int16_t recvAvailable(W5100Class &chip, SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  int16_t ret = W5100.getRXReceivedSize(s);
-  SPI.endTransaction();
+  if (s >= chip.getSocketCount())
+    return 0;
+  // Under the bus lock even when served locally: a poll from another task
+  // moves these counts too
+  chip.beginTransaction();
+  // Send what is queued behind a SEND while the caller polls
+  if (chip.socketState[s].TX_QUEUED)
+    pumpSend(chip, s, false);
+  // Served from the local count while it lasts, less what has been read
+  // since RX_RD last moved
+  int16_t ret = receivedSize(chip, s) - chip.socketState[s].RX_HEAD;
+  chip.endTransaction();
   return ret;
 }
 
@@ -221,11 +979,19 @@ int16_t recvAvailable(SOCKET s)
  * 		
  * @return
  */
-uint16_t peek(SOCKET s, uint8_t *buf)
+uint16_t peek(W5100Class &chip, SOCKET s, uint8_t *buf)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.recv_data_processing(s, buf, 1, 1);
-  SPI.endTransaction();
+  if (s >= chip.getSocketCount())
+    return 0;
+  W5100Class::SocketState &st = chip.socketState[s];
+  chip.beginTransaction();
+  if (st.RX_POS < st.RX_FILL)
+    *buf = st.RX_BUF[st.RX_POS];
+  else if (st.RX_BUF && fillAhead(chip, s))
+    *buf = st.RX_BUF[0];
+  else
+    chip.recv_data_processing_offset(s, st.RX_HEAD, buf, 1);
+  chip.endTransaction();
   return 1;
 }
 
@@ -236,11 +1002,13 @@ uint16_t peek(SOCKET s, uint8_t *buf)
  * 		
  * @return	This function return send data size for success else -1.
  */
-uint16_t sendto(SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t port)
+uint16_t sendto(W5100Class &chip, SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t port)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
   uint16_t ret=0;
 
-  if (len > W5100.SSIZE) ret = W5100.SSIZE; // check size not to exceed MAX size.
+  if (len > chip.SSIZE[s]) ret = chip.SSIZE[s]; // check size not to exceed MAX size.
   else ret = len;
 
   if
@@ -254,32 +1022,21 @@ uint16_t sendto(SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint1
   }
   else
   {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    W5100.writeSnDIPR(s, addr);
-    W5100.writeSnDPORT(s, port);
+    chip.beginTransaction();
+    chip.writeSnDIPR(s, addr);
+    chip.writeSnDPORT(s, port);
 
     // copy data
-    W5100.send_data_processing(s, (uint8_t *)buf, ret);
-    W5100.execCmdSn(s, Sock_SEND);
+    chip.send_data_processing(s, (uint8_t *)buf, ret);
+    chip.issueCmdSn(s, Sock_SEND);
 
     /* +2008.01 bj */
-    while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
+    if (waitSend(chip, s) != SnIR::SEND_OK)
     {
-      if (W5100.readSnIR(s) & SnIR::TIMEOUT)
-      {
-        /* +2008.01 [bj]: clear interrupt */
-        W5100.writeSnIR(s, (SnIR::SEND_OK | SnIR::TIMEOUT)); /* clear SEND_OK & TIMEOUT */
-        SPI.endTransaction();
-        return 0;
-      }
-      SPI.endTransaction();
-      yield();
-      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      chip.endTransaction();
+      return 0;
     }
-
-    /* +2008.01 bj */
-    W5100.writeSnIR(s, SnIR::SEND_OK);
-    SPI.endTransaction();
+    chip.endTransaction();
   }
   return ret;
 }
@@ -291,20 +1048,27 @@ uint16_t sendto(SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint1
  * 	
  * @return	This function return received data size for success else -1.
  */
-uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t *port)
+uint16_t recvfrom(W5100Class &chip, SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t *port)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
   uint8_t head[8];
   uint16_t data_len=0;
   uint16_t ptr=0;
 
   if ( len > 0 )
   {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    ptr = W5100.readSnRX_RD(s);
-    switch (W5100.readSnMR(s) & 0x07)
+    chip.beginTransaction();
+    // Catch RX_RD up with anything read by recv()
+    commitRX(chip, s);
+    chip.socketState[s].RX_POS = 0;
+    chip.socketState[s].RX_FILL = 0;
+    chip.waitCmdSn(s);
+    ptr = chip.readSnRX_RD(s);
+    switch (chip.readSnMR(s) & 0x07)
     {
     case SnMR::UDP :
-      W5100.read_data(s, ptr, head, 0x08);
+      chip.read_data(s, ptr, head, 0x08);
       ptr += 8;
       // read peer's IP address, port number.
       addr[0] = head[0];
@@ -316,14 +1080,15 @@ uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t
       data_len = head[6];
       data_len = (data_len << 8) + head[7];
 
-      W5100.read_data(s, ptr, buf, data_len); // data copy.
+      chip.read_data(s, ptr, buf, data_len); // data copy.
       ptr += data_len;
 
-      W5100.writeSnRX_RD(s, ptr);
+      chip.writeSnRX_RD(s, ptr);
+      consumeRX(chip, s, 8 + data_len);
       break;
 
     case SnMR::IPRAW :
-      W5100.read_data(s, ptr, head, 0x06);
+      chip.read_data(s, ptr, head, 0x06);
       ptr += 6;
 
       addr[0] = head[0];
@@ -333,28 +1098,30 @@ uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t
       data_len = head[4];
       data_len = (data_len << 8) + head[5];
 
-      W5100.read_data(s, ptr, buf, data_len); // data copy.
+      chip.read_data(s, ptr, buf, data_len); // data copy.
       ptr += data_len;
 
-      W5100.writeSnRX_RD(s, ptr);
+      chip.writeSnRX_RD(s, ptr);
+      consumeRX(chip, s, 6 + data_len);
       break;
 
     case SnMR::MACRAW:
-      W5100.read_data(s, ptr, head, 2);
+      chip.read_data(s, ptr, head, 2);
       ptr+=2;
       data_len = head[0];
       data_len = (data_len<<8) + head[1] - 2;
 
-      W5100.read_data(s, ptr, buf, data_len);
+      chip.read_data(s, ptr, buf, data_len);
       ptr += data_len;
-      W5100.writeSnRX_RD(s, ptr);
+      chip.writeSnRX_RD(s, ptr);
+      consumeRX(chip, s, 2 + data_len);
       break;
 
     default :
       break;
     }
-    W5100.execCmdSn(s, Sock_RECV);
-    SPI.endTransaction();
+    chip.issueCmdSn(s, Sock_RECV);
+    chip.endTransaction();
   }
   return data_len;
 }
@@ -362,65 +1129,92 @@ uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t
 /**
  * @brief	Wait for buffered transmission to complete.
  */
-void flush(SOCKET s) {
-  // TODO
+void flush(W5100Class &chip, SOCKET s) {
+  if (s >= chip.getSocketCount())
+    return;
+  chip.beginTransaction();
+  bool ok = drainSend(chip, s);
+  chip.endTransaction();
+  if (!ok)
+    close(chip, s);
 }
 
-uint16_t igmpsend(SOCKET s, const uint8_t * buf, uint16_t len)
+uint16_t igmpsend(W5100Class &chip, SOCKET s, const uint8_t * buf, uint16_t len)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
   uint16_t ret=0;
 
-  if (len > W5100.SSIZE) 
-    ret = W5100.SSIZE; // check size not to exceed MAX size.
+  if (len > chip.SSIZE[s]) 
+    ret = chip.SSIZE[s]; // check size not to exceed MAX size.
   else 
     ret = len;
 
   if (ret == 0)
     return 0;
 
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.send_data_processing(s, (uint8_t *)buf, ret);
-  W5100.execCmdSn(s, Sock_SEND);
+  chip.beginTransaction();
+  chip.send_data_processing(s, (uint8_t *)buf, ret);
+  chip.issueCmdSn(s, Sock_SEND);
 
-  while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
+  if (waitSend(chip, s) != SnIR::SEND_OK)
   {
-    if (W5100.readSnIR(s) & SnIR::TIMEOUT)
-    {
-      /* in case of igmp, if send fails, then socket closed */
-      /* if you want change, remove this code. */
-      SPI.endTransaction();
-      close(s);
-      return 0;
-    }
-    SPI.endTransaction();
-    yield();
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    /* in case of igmp, if send fails, then socket closed */
+    /* if you want change, remove this code. */
+    chip.endTransaction();
+    close(chip, s);
+    return 0;
   }
-
-  W5100.writeSnIR(s, SnIR::SEND_OK);
-  SPI.endTransaction();
+  chip.endTransaction();
   return ret;
 }
 
-uint16_t bufferData(SOCKET s, uint16_t offset, const uint8_t* buf, uint16_t len)
+uint16_t bufferData(W5100Class &chip, SOCKET s, uint16_t offset, const uint8_t* buf, uint16_t len)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
   uint16_t ret =0;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  if (len > W5100.getTXFreeSize(s))
+  chip.beginTransaction();
+  uint16_t freesize = freeSize(chip, s, len);
+  if (len > freesize)
   {
-    ret = W5100.getTXFreeSize(s); // check size not to exceed MAX size.
+    ret = freesize; // check size not to exceed MAX size.
   }
   else
   {
     ret = len;
   }
-  W5100.send_data_processing_offset(s, offset, buf, ret);
-  SPI.endTransaction();
+  chip.send_data_processing_offset(s, offset, buf, ret);
+  consumeTX(chip, s, ret);
+  chip.endTransaction();
+  return ret;
+}
+
+uint16_t bufferDatav(W5100Class &chip, SOCKET s, uint16_t offset, const EthernetIovec *iov, uint8_t count)
+{
+  if (s >= chip.getSocketCount())
+    return 0;
+  uint32_t len = 0;
+  uint8_t i = 0;
+  uint16_t off = 0;
+
+  for (uint8_t k = 0; k < count; k++)
+    len += iov[k].len;
+  uint16_t ret = (len > 0xFFFF) ? 0xFFFF : len;
+  chip.beginTransaction();
+  uint16_t freesize = freeSize(chip, s, ret);
+  if (ret > freesize)
+    ret = freesize; // check size not to exceed MAX size.
+  writeSegments(chip, s, offset, iov, &i, &off, ret);
+  consumeTX(chip, s, ret);
+  chip.endTransaction();
   return ret;
 }
 
-int startUDP(SOCKET s, uint8_t* addr, uint16_t port)
+int startUDP(W5100Class &chip, SOCKET s, uint8_t* addr, uint16_t port)
 {
+  if (s >= chip.getSocketCount())
+    return 0;
   if
     (
      ((addr[0] == 0x00) && (addr[1] == 0x00) && (addr[2] == 0x00) && (addr[3] == 0x00)) ||
@@ -431,37 +1225,28 @@ int startUDP(SOCKET s, uint8_t* addr, uint16_t port)
   }
   else
   {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    W5100.writeSnDIPR(s, addr);
-    W5100.writeSnDPORT(s, port);
-    SPI.endTransaction();
+    chip.beginTransaction();
+    chip.writeSnDIPR(s, addr);
+    chip.writeSnDPORT(s, port);
+    chip.endTransaction();
     return 1;
   }
 }
 
-int sendUDP(SOCKET s)
+int sendUDP(W5100Class &chip, SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  W5100.execCmdSn(s, Sock_SEND);
+  if (s >= chip.getSocketCount())
+    return 0;
+  chip.beginTransaction();
+  chip.issueCmdSn(s, Sock_SEND);
 		
   /* +2008.01 bj */
-  while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
+  if (waitSend(chip, s) != SnIR::SEND_OK)
   {
-    if (W5100.readSnIR(s) & SnIR::TIMEOUT)
-    {
-      /* +2008.01 [bj]: clear interrupt */
-      W5100.writeSnIR(s, (SnIR::SEND_OK|SnIR::TIMEOUT));
-      SPI.endTransaction();
-      return 0;
-    }
-    SPI.endTransaction();
-    yield();
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    chip.endTransaction();
+    return 0;
   }
-
-  /* +2008.01 bj */	
-  W5100.writeSnIR(s, SnIR::SEND_OK);
-  SPI.endTransaction();
+  chip.endTransaction();
 
   /* Sent ok */
   return 1;
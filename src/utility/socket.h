@@ -3,21 +3,143 @@
 
 #include "utility/w5100.h"
 
-extern uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag); // Opens a socket(TCP or UDP or IP_RAW mode)
-extern uint8_t socketStatus(SOCKET s);
-extern void close(SOCKET s); // Close socket
-extern uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port); // Establish TCP connection (Active connection)
-extern void disconnect(SOCKET s); // disconnect the connection
-extern uint8_t listen(SOCKET s);	// Establish TCP connection (Passive connection)
-extern uint16_t send(SOCKET s, const uint8_t * buf, uint16_t len); // Send data (TCP)
-extern int16_t recv(SOCKET s, uint8_t * buf, int16_t len);	// Receive data (TCP)
-extern int16_t recvAvailable(SOCKET s);
-extern uint16_t peek(SOCKET s, uint8_t *buf);
-extern uint16_t sendto(SOCKET s, const uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t port); // Send data (UDP/IP RAW)
-extern uint16_t recvfrom(SOCKET s, uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t *port); // Receive data (UDP/IP RAW)
-extern void flush(SOCKET s); // Wait for transmission to complete
-
-extern uint16_t igmpsend(SOCKET s, const uint8_t * buf, uint16_t len);
+class Stream;
+
+// Bytes sendStream() moves from its source per bus transaction.  Costs as
+// much stack.
+#ifndef ETHERNET_STREAM_CHUNK
+#if defined(__AVR__)
+#define ETHERNET_STREAM_CHUNK 64
+#else
+#define ETHERNET_STREAM_CHUNK 512
+#endif
+#endif
+
+// Bytes recvFind() reads from the Rx ring per bus frame, and the longest
+// delimiter it looks for.  Costs as much stack.
+#ifndef ETHERNET_SCAN_CHUNK
+#if defined(__AVR__)
+#define ETHERNET_SCAN_CHUNK 32
+#else
+#define ETHERNET_SCAN_CHUNK 128
+#endif
+#endif
+
+// Every call takes the controller the socket belongs to.  Socket numbers are
+// per controller, 0 to chip.getSocketCount() - 1.  Any other socket number,
+// such as an unconnected client's MAX_SOCK_NUM or a fifth socket on a W5100,
+// is ignored: the call does nothing and returns 0 (CLOSED for socketStatus(),
+// -1 for recvFind()).
+
+extern uint8_t socket(W5100Class &chip, SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag); // Opens a socket(TCP or UDP or IP_RAW mode)
+/*
+  @brief Take a free socket for the caller to open: the first unowned one the chip has
+  CLOSED, at one status read per socket passed over.  Sockets stay owned from here, or from
+  socket(), until close() or socketRelease().  If there is none, any socket the chip has
+  closed (or left in FIN_WAIT, or in CLOSE_WAIT if closeWait) is taken back, owned or not,
+  since its owner never closed it.
+  @return The socket, or MAX_SOCK_NUM if none is free
+*/
+extern SOCKET socketAcquire(W5100Class &chip, bool closeWait = false);
+extern void socketRelease(W5100Class &chip, SOCKET s); // Give up a socket without closing it
+extern uint8_t socketStatus(W5100Class &chip, SOCKET s);
+/*
+  @brief Read the status of each socket in the bitmask sockets, with what recvAvailable() and
+  sendAvailable() would return, in one bus transaction.  Each array has MAX_SOCK_NUM
+  entries, of which only those in sockets are written; sockets the chip lacks read as
+  CLOSED.  tx may be NULL if the Tx sizes are not wanted.
+*/
+extern void socketPoll(W5100Class &chip, uint8_t sockets, uint8_t *status, uint16_t *rx, uint16_t *tx);
+extern void close(W5100Class &chip, SOCKET s); // Close socket
+/*
+  @brief Wait up to timeout ms for one of the SnIR events in events to be raised on s.
+  In interrupt mode this waits on the socket's event queue without bus traffic.  When
+  polling the events are not seen, so it returns after at most 1 ms and the caller
+  checks the socket status itself.
+  @return The events raised, which are cleared, or 0
+*/
+extern uint8_t socketWait(W5100Class &chip, SOCKET s, uint8_t events, unsigned long timeout);
+extern uint8_t connect(W5100Class &chip, SOCKET s, uint8_t * addr, uint16_t port); // Establish TCP connection (Active connection)
+extern void disconnect(W5100Class &chip, SOCKET s); // disconnect the connection
+extern uint8_t listen(W5100Class &chip, SOCKET s);	// Establish TCP connection (Passive connection)
+/*
+  @brief Queue len bytes on the TCP socket.  They are sent behind any SEND still in flight,
+  once it completes, so this only waits while the Tx ring is full.  Data left queued goes
+  out on the next send(), sendAvailable(), socketStatus() or recvAvailable() on s, or
+  socketPoll() or sendPending(), and flush() and disconnect() wait for all of it.
+  @return Bytes queued: len, or fewer if the connection is gone.  If a SEND failed, which
+  loses what was queued, the socket is also closed; otherwise it is left for its owner.
+*/
+extern uint16_t send(W5100Class &chip, SOCKET s, const uint8_t * buf, uint16_t len);
+/*
+  @brief send() for a payload in count pieces, such as a header, body and trailer, without
+  copying them together first.  They are laid into the Tx ring with one pointer update
+  and go out with one SEND, a ring's worth at a time.
+  @return Bytes queued: all of them, or fewer if the connection is gone, as for send()
+*/
+extern uint32_t sendv(W5100Class &chip, SOCKET s, const EthernetIovec *iov, uint8_t count);
+/*
+  @brief Coalesce the socket's sends: data from send() stays in the Tx ring until threshold
+  bytes are queued (the whole ring if 0), delay ms have passed since the first of them
+  (no limit if 0), the ring is full, or flush() is called.  Both 0 turns it off.  Lasts
+  until the socket is opened again.
+*/
+extern void sendCoalesce(W5100Class &chip, SOCKET s, uint16_t threshold, uint16_t delay);
+/*
+  @brief Free space in the Tx ring, from the local count while it lasts.  Never waits.
+*/
+extern uint16_t sendAvailable(W5100Class &chip, SOCKET s);
+// Send what is queued behind a SEND on every socket; no frames if nothing is queued
+extern void sendPending(W5100Class &chip);
+/*
+  @brief Copy up to len bytes from src to the TCP socket, reading the next chunk from src
+  while the chip transmits the last.  The bus is released around every read from src, so
+  it may be an SD card File on the same SPI bus.  Do not call inside an EthernetSession.
+  @return Bytes queued, which is short if src ran dry or the socket failed
+*/
+extern uint32_t sendStream(W5100Class &chip, SOCKET s, Stream &src, uint32_t len);
+extern int16_t recv(W5100Class &chip, SOCKET s, uint8_t * buf, int16_t len);	// Receive data (TCP)
+/*
+  @brief Give the socket a read-ahead buffer of size bytes, or take it away if buf is NULL.
+  A recv() shorter than the buffer then fills it with one bulk read, and the recv(),
+  peek() and recvAvailable() calls after it are served from RAM.  Lasts until the socket
+  is opened again or closed; a TCP socket starts with ETHERNET_READ_AHEAD bytes of its own.
+*/
+extern void recvReadAhead(W5100Class &chip, SOCKET s, uint8_t *buf, uint16_t size);
+/*
+  @brief Hold back RX_RD and the RECV that opens the receive window until threshold bytes
+  have been read (half the Rx buffer if 0), or everything known to be waiting, so small
+  reads neither cost a command each nor send the peer a stream of tiny window updates.
+  1 gives every read back at once.  Lasts until the socket is opened again.
+*/
+extern void recvCoalesce(W5100Class &chip, SOCKET s, uint16_t threshold);
+extern int16_t recvAvailable(W5100Class &chip, SOCKET s);
+extern uint16_t recvSkip(W5100Class &chip, SOCKET s, uint16_t len); // Drop received data without reading it
+/*
+  @brief Copy data between buf and the socket's buffer in the background, on transports
+  that move large frames with DMA (elsewhere the copy is done by the time these return).
+  recvAsync() takes up to len received bytes, sendAsync() queues up to len bytes on a TCP
+  socket as send() does.  Both return the bytes being copied, or 0 if none could be.  The
+  bus stays held, by the calling task, until asyncDone() returns true; call it from that
+  task, and leave buf, the controller and any other device on the same SPI bus alone
+  until then.  Only one copy runs per controller.
+*/
+extern uint16_t recvAsync(W5100Class &chip, SOCKET s, uint8_t *buf, uint16_t len);
+extern uint16_t sendAsync(W5100Class &chip, SOCKET s, const uint8_t *buf, uint16_t len);
+extern bool asyncDone(W5100Class &chip);
+/*
+  @brief Find the delimiter delim, dlen bytes long, in the data received on the TCP socket,
+  starting from offset from, without consuming anything.  A line or header block can then
+  be taken with a single recv() of the offset plus dlen bytes.
+  @return Offset of the delimiter from the next byte recv() returns, or -1 if not received
+*/
+extern int16_t recvFind(W5100Class &chip, SOCKET s, const uint8_t *delim, uint8_t dlen, uint16_t from = 0);
+extern uint16_t peek(W5100Class &chip, SOCKET s, uint8_t *buf);
+extern uint16_t sendto(W5100Class &chip, SOCKET s, const uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t port); // Send data (UDP/IP RAW)
+extern uint16_t recvfrom(W5100Class &chip, SOCKET s, uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t *port); // Receive data (UDP/IP RAW)
+extern void flush(W5100Class &chip, SOCKET s); // Wait for everything queued by send() to be sent
+
+extern uint16_t igmpsend(W5100Class &chip, SOCKET s, const uint8_t * buf, uint16_t len);
 
 // Functions to allow buffered UDP send (i.e. where the UDP datagram is built up over a
 // number of calls before being sent
@@ -26,19 +148,59 @@ extern uint16_t igmpsend(SOCKET s, const uint8_t * buf, uint16_t len);
   or more calls to bufferData and then finally sent with sendUDP.
   @return 1 if the datagram was successfully set up, or 0 if there was an error
 */
-extern int startUDP(SOCKET s, uint8_t* addr, uint16_t port);
+extern int startUDP(W5100Class &chip, SOCKET s, uint8_t* addr, uint16_t port);
 /*
   @brief This function copies up to len bytes of data from buf into a UDP datagram to be
   sent later by sendUDP.  Allows datagrams to be built up from a series of bufferData calls.
   @return Number of bytes successfully buffered
 */
-uint16_t bufferData(SOCKET s, uint16_t offset, const uint8_t* buf, uint16_t len);
+uint16_t bufferData(W5100Class &chip, SOCKET s, uint16_t offset, const uint8_t* buf, uint16_t len);
+/*
+  @brief bufferData() for data in count pieces, written with one pointer update.
+  @return Number of bytes successfully buffered
+*/
+uint16_t bufferDatav(W5100Class &chip, SOCKET s, uint16_t offset, const EthernetIovec *iov, uint8_t count);
 /*
   @brief Send a UDP datagram built up from a sequence of startUDP followed by one or more
   calls to bufferData.
   @return 1 if the datagram was successfully sent, or 0 if there was an error
 */
-int sendUDP(SOCKET s);
+int sendUDP(W5100Class &chip, SOCKET s);
+
+// The same calls on the default controller, W5100
+inline uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag) { return socket(W5100, s, protocol, port, flag); }
+inline uint8_t socketStatus(SOCKET s) { return socketStatus(W5100, s); }
+inline SOCKET socketAcquire(bool closeWait = false) { return socketAcquire(W5100, closeWait); }
+inline void socketRelease(SOCKET s) { socketRelease(W5100, s); }
+inline void socketPoll(uint8_t sockets, uint8_t *status, uint16_t *rx, uint16_t *tx) { socketPoll(W5100, sockets, status, rx, tx); }
+inline void close(SOCKET s) { close(W5100, s); }
+inline uint8_t socketWait(SOCKET s, uint8_t events, unsigned long timeout) { return socketWait(W5100, s, events, timeout); }
+inline uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port) { return connect(W5100, s, addr, port); }
+inline void disconnect(SOCKET s) { disconnect(W5100, s); }
+inline uint8_t listen(SOCKET s) { return listen(W5100, s); }
+inline uint16_t send(SOCKET s, const uint8_t * buf, uint16_t len) { return send(W5100, s, buf, len); }
+inline uint32_t sendv(SOCKET s, const EthernetIovec *iov, uint8_t count) { return sendv(W5100, s, iov, count); }
+inline void sendCoalesce(SOCKET s, uint16_t threshold, uint16_t delay) { sendCoalesce(W5100, s, threshold, delay); }
+inline uint16_t sendAvailable(SOCKET s) { return sendAvailable(W5100, s); }
+inline uint32_t sendStream(SOCKET s, Stream &src, uint32_t len) { return sendStream(W5100, s, src, len); }
+inline int16_t recv(SOCKET s, uint8_t * buf, int16_t len) { return recv(W5100, s, buf, len); }
+inline void recvReadAhead(SOCKET s, uint8_t *buf, uint16_t size) { recvReadAhead(W5100, s, buf, size); }
+inline void recvCoalesce(SOCKET s, uint16_t threshold) { recvCoalesce(W5100, s, threshold); }
+inline int16_t recvAvailable(SOCKET s) { return recvAvailable(W5100, s); }
+inline uint16_t recvSkip(SOCKET s, uint16_t len) { return recvSkip(W5100, s, len); }
+inline uint16_t recvAsync(SOCKET s, uint8_t *buf, uint16_t len) { return recvAsync(W5100, s, buf, len); }
+inline uint16_t sendAsync(SOCKET s, const uint8_t *buf, uint16_t len) { return sendAsync(W5100, s, buf, len); }
+inline bool asyncDone() { return asyncDone(W5100); }
+inline int16_t recvFind(SOCKET s, const uint8_t *delim, uint8_t dlen, uint16_t from = 0) { return recvFind(W5100, s, delim, dlen, from); }
+inline uint16_t peek(SOCKET s, uint8_t *buf) { return peek(W5100, s, buf); }
+inline uint16_t sendto(SOCKET s, const uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t port) { return sendto(W5100, s, buf, len, addr, port); }
+inline uint16_t recvfrom(SOCKET s, uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t *port) { return recvfrom(W5100, s, buf, len, addr, port); }
+inline void flush(SOCKET s) { flush(W5100, s); }
+inline uint16_t igmpsend(SOCKET s, const uint8_t * buf, uint16_t len) { return igmpsend(W5100, s, buf, len); }
+inline int startUDP(SOCKET s, uint8_t* addr, uint16_t port) { return startUDP(W5100, s, addr, port); }
+inline uint16_t bufferData(SOCKET s, uint16_t offset, const uint8_t* buf, uint16_t len) { return bufferData(W5100, s, offset, buf, len); }
+inline uint16_t bufferDatav(SOCKET s, uint16_t offset, const EthernetIovec *iov, uint8_t count) { return bufferDatav(W5100, s, offset, iov, count); }
+inline int sendUDP(SOCKET s) { return sendUDP(W5100, s); }
 
 #endif
 /* _SOCKET_H_ */
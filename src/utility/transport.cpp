@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2010 by Arduino LLC. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#include <string.h>
+
+#include "w5100.h"
+
+void EthernetTransport::writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  write(hdr, hdrlen, buf, len);
+  if (done)
+    done(arg);
+}
+
+void EthernetTransport::readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  read(hdr, hdrlen, buf, len);
+  if (done)
+    done(arg);
+}
+
+void EthernetTransport::attachInterrupt(uint8_t pin, void (*isr)(void))
+{
+#if defined(ARDUINO)
+  int irq = digitalPinToInterrupt(pin);
+#if defined(SPI_HAS_TRANSACTION)
+  SPI.usingInterrupt(irq);
+#endif
+  pinMode(pin, INPUT_PULLUP);
+  ::attachInterrupt(irq, isr, FALLING);
+#else
+  (void)pin;
+  (void)isr;
+#endif
+}
+
+// Offset of an indirect mode register from the bus base
+#define IDM_REG(r) ((r) - IDM_OR)
+
+EthernetIndirectTransport::EthernetIndirectTransport(volatile uint8_t *base)
+  : _base(base), _mr(0), _indirect(false), _arValid(false), _ar(0)
+{
+}
+
+void EthernetIndirectTransport::begin()
+{
+#if defined(XMCRA)
+  // External memory interface on
+  XMCRA |= _BV(SRE);
+#endif
+  _indirect = false;
+  _arValid = false;
+}
+
+void EthernetIndirectTransport::busWrite(uint8_t reg, const uint8_t *buf, uint16_t len)
+{
+  volatile uint8_t *port = _base + reg;
+  for (uint16_t i=0; i<len; i++)
+    *port = buf[i];
+}
+
+void EthernetIndirectTransport::busRead(uint8_t reg, uint8_t *buf, uint16_t len)
+{
+  volatile uint8_t *port = _base + reg;
+  for (uint16_t i=0; i<len; i++)
+    buf[i] = *port;
+}
+
+void EthernetIndirectTransport::setMode(uint8_t mr)
+{
+  if (mr & IDM_MR_RST) {
+    // The chip comes out of reset in direct mode
+    busWrite(IDM_REG(IDM_OR), &mr, 1);
+    _mr = 0;
+    _indirect = false;
+    _arValid = false;
+    return;
+  }
+  _mr = mr;
+  mr |= IDM_MR_IND | IDM_MR_AI;
+  busWrite(IDM_REG(IDM_OR), &mr, 1);
+  _indirect = true;
+}
+
+void EthernetIndirectTransport::select(uint16_t addr)
+{
+  if (!_indirect)
+    setMode(_mr);
+  // Auto-increment has left the address where the last block ended
+  if (_arValid && _ar == addr)
+    return;
+  uint8_t a = addr >> 8;
+  busWrite(IDM_REG(IDM_AR0), &a, 1);
+  a = addr & 0xFF;
+  busWrite(IDM_REG(IDM_AR1), &a, 1);
+  _ar = addr;
+  _arValid = true;
+}
+
+void EthernetIndirectTransport::write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len)
+{
+  // Only W5100 frames mean anything on this bus
+  if (hdrlen != 3 || hdr[0] != 0xF0 || len == 0)
+    return;
+  uint16_t addr = (hdr[1] << 8) | hdr[2];
+  if (addr == 0) {
+    // IDM_OR is MR itself
+    setMode(buf[0]);
+    addr++;
+    buf++;
+    if (--len == 0)
+      return;
+  }
+  select(addr);
+  busWrite(IDM_REG(IDM_DR), buf, len);
+  _ar = addr + len;
+}
+
+void EthernetIndirectTransport::read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+{
+  if (hdrlen != 3 || hdr[0] != 0x0F) {
+    memset(buf, 0, len);
+    return;
+  }
+  if (len == 0)
+    return;
+  uint16_t addr = (hdr[1] << 8) | hdr[2];
+  if (addr == 0) {
+    // The mode bits read back as the driver last wrote them
+    busRead(IDM_REG(IDM_OR), buf, 1);
+    buf[0] = (buf[0] & ~(IDM_MR_IND | IDM_MR_AI)) | (_mr & (IDM_MR_IND | IDM_MR_AI));
+    addr++;
+    buf++;
+    if (--len == 0)
+      return;
+  }
+  select(addr);
+  busRead(IDM_REG(IDM_DR), buf, len);
+  _ar = addr + len;
+}
+
+#if defined(ARDUINO)
+
+// Default transport used by W5100Class
+EthernetSPITransport EthernetSPI;
+
+// Shift one byte through the bus.  With EXTENDED_CS_PIN_HANDLING the chip
+// select stays asserted until a byte is sent with last set.
+static inline uint8_t xfer(uint8_t cs, uint8_t _data, bool last = false)
+{
+#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
+  (void)cs;
+  (void)last;
+  return SPI.transfer(_data);
+#else
+  return SPI.transfer(cs, _data, last ? SPI_LAST : SPI_CONTINUE);
+#endif
+}
+
+void EthernetSPITransport::begin()
+{
+#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
+  SPI.begin();
+  if (_cs == ETHERNET_SHIELD_SPI_CS) {
+    initSS();
+  } else {
+#if defined(ARDUINO_ARCH_AVR)
+    _csPort = portOutputRegister(digitalPinToPort(_cs));
+    _csMask = digitalPinToBitMask(_cs);
+#endif
+    pinMode(_cs, OUTPUT);
+    csWrite(HIGH);
+  }
+#else
+  SPI.begin(_cs);
+  // Set clock to 4Mhz (W5100 should support up to about 14Mhz)
+  SPI.setClockDivider(_cs, 21);
+  SPI.setDataMode(_cs, SPI_MODE0);
+#endif
+}
+
+void EthernetSPITransport::beginTransaction()
+{
+#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
+  SPI.beginTransaction(settings);
+#else
+  SPI.beginTransaction(_cs, settings);
+#endif
+}
+
+void EthernetSPITransport::endTransaction()
+{
+  SPI.endTransaction();
+}
+
+void EthernetSPITransport::setClock(uint32_t clock)
+{
+  settings = SPISettings(clock, MSBFIRST, SPI_MODE0);
+}
+
+void EthernetSPITransport::write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len)
+{
+  select();
+  for (uint8_t i=0; i<hdrlen; i++)
+    xfer(_cs, hdr[i], len == 0 && i == hdrlen - 1);
+  for (uint16_t i=0; i<len; i++)
+    xfer(_cs, buf[i], i == len - 1);
+  deselect();
+}
+
+void EthernetSPITransport::read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+{
+  select();
+  for (uint8_t i=0; i<hdrlen; i++)
+    xfer(_cs, hdr[i], len == 0 && i == hdrlen - 1);
+#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
+  // Clock the whole block in place, zeros out
+  memset(buf, 0, len);
+  SPI.transfer(buf, len);
+#else
+  for (uint16_t i=0; i<len; i++)
+    buf[i] = xfer(_cs, 0, i == len - 1);
+#endif
+  deselect();
+}
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2010 by Arduino LLC. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef	TRANSPORT_H_INCLUDED
+#define	TRANSPORT_H_INCLUDED
+
+#if defined(ARDUINO)
+#include <SPI.h>
+#else
+#include "host.h"
+#endif
+
+#define ETHERNET_SHIELD_SPI_CS 10
+
+// Conservative SPI clock used to detect the chip and whenever no other
+// rate has been set or calibrated.
+#ifndef ETHERNET_SPI_CLOCK
+#define ETHERNET_SPI_CLOCK 4000000
+#endif
+
+/**
+ * @brief	Moves frames between the MCU and the Ethernet controller.
+ *
+ * A frame is a short header followed by a block of data, all under one chip
+ * select.  W5100Class builds the headers for the detected chip; a transport
+ * only clocks the bytes.  W5100Class uses EthernetSPI unless another
+ * transport is passed to W5100.setTransport() before init().
+ */
+class EthernetTransport {
+public:
+  typedef void (*Callback)(void *arg);
+
+  // Set up the bus and the chip select
+  virtual void begin() = 0;
+  // Claim and release the bus around a group of frames
+  virtual void beginTransaction() { }
+  virtual void endTransaction() { }
+  // Clock rate for transactions started from now on
+  virtual void setClock(uint32_t clock) { (void)clock; }
+
+  // Send hdr and then len bytes from buf, returning once the frame is done.
+  // A background frame still running is finished first.
+  virtual void write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len) = 0;
+  // Send hdr and then clock len bytes into buf
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len) = 0;
+
+  /**
+   * @brief	Start a frame and return while its data moves in the background.
+   *
+   * done(arg), if not NULL, runs from poll() once the frame has completed
+   * and the chip select is released; it may start the next frame.  The
+   * header is copied, buf must stay valid until then.  Transports without
+   * background transfers run the frame at once and then call done, which
+   * is what these defaults do.
+   */
+  virtual void writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual void readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg);
+
+  /**
+   * @brief	Finish the background frame if it has completed, running its
+   *        callback.  true while it (or one its callback started) is still
+   *        running.
+   */
+  virtual bool poll() { return false; }
+
+  /**
+   * @brief	true if one W5100 header (op code and start address) may carry
+   *        a whole block, the chip stepping the address itself.  Over SPI
+   *        the W5100 needs a frame per byte.
+   */
+  virtual bool autoIncrement() { return false; }
+
+  /**
+   * @brief	Run isr on each falling edge of the chip's INT pin, wired to the
+   *        board pin pin.  The default attaches a pin change interrupt and
+   *        registers it with the SPI library, so that transactions of other
+   *        SPI devices hold it off.
+   */
+  virtual void attachInterrupt(uint8_t pin, void (*isr)(void));
+};
+
+#if defined(ARDUINO)
+/**
+ * @brief	Blocking transport on the SPI library.  cs is the chip select pin;
+ *        the shield's own pin is driven through fixed port bits, any other
+ *        through its port register (AVR) or digitalWrite().
+ */
+class EthernetSPITransport : public EthernetTransport {
+public:
+  EthernetSPITransport(uint8_t cs = ETHERNET_SHIELD_SPI_CS)
+    : settings(ETHERNET_SPI_CLOCK, MSBFIRST, SPI_MODE0), _cs(cs) { }
+
+  virtual void begin();
+  virtual void beginTransaction();
+  virtual void endTransaction();
+  virtual void setClock(uint32_t clock);
+  virtual void write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len);
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len);
+
+private:
+  SPISettings settings;
+  uint8_t _cs;
+#if defined(ARDUINO_ARCH_AVR)
+  volatile uint8_t *_csPort;
+  uint8_t _csMask;
+#endif
+
+  inline void select() {
+    if (_cs == ETHERNET_SHIELD_SPI_CS)
+      setSS();
+    else
+      csWrite(LOW);
+  }
+  inline void deselect() {
+    if (_cs == ETHERNET_SHIELD_SPI_CS)
+      resetSS();
+    else
+      csWrite(HIGH);
+  }
+  inline void csWrite(uint8_t level) {
+#if defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
+    (void)level;
+#elif defined(ARDUINO_ARCH_AVR)
+    if (level)
+      *_csPort |= _csMask;
+    else
+      *_csPort &= ~_csMask;
+#else
+    digitalWrite(_cs, level);
+#endif
+  }
+
+#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
+  #if defined(ARDUINO_ARCH_AVR)
+    #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+      inline static void initSS()    { DDRB  |=  _BV(4); };
+      inline static void setSS()     { PORTB &= ~_BV(4); };
+      inline static void resetSS()   { PORTB |=  _BV(4); };
+    #elif defined(__AVR_ATmega32U4__)
+      inline static void initSS()    { DDRB  |=  _BV(6); };
+      inline static void setSS()     { PORTB &= ~_BV(6); };
+      inline static void resetSS()   { PORTB |=  _BV(6); };
+    #elif defined(__AVR_AT90USB1286__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB162__)
+      inline static void initSS()    { DDRB  |=  _BV(0); };
+      inline static void setSS()     { PORTB &= ~_BV(0); };
+      inline static void resetSS()   { PORTB |=  _BV(0); };
+    #else
+      inline static void initSS()    { DDRB  |=  _BV(2); };
+      inline static void setSS()     { PORTB &= ~_BV(2); };
+      inline static void resetSS()   { PORTB |=  _BV(2); };
+    #endif
+  #elif defined(__ARDUINO_ARC__)
+	inline static void initSS() { pinMode(10, OUTPUT); };
+	inline static void setSS() { digitalWrite(10, LOW); };
+	inline static void resetSS() { digitalWrite(10, HIGH); };
+  #else
+    inline static void initSS() {
+      *portModeRegister(digitalPinToPort(ETHERNET_SHIELD_SPI_CS)) |= digitalPinToBitMask(ETHERNET_SHIELD_SPI_CS);
+    }
+    inline static void setSS()   {
+      *portOutputRegister(digitalPinToPort(ETHERNET_SHIELD_SPI_CS)) &= ~digitalPinToBitMask(ETHERNET_SHIELD_SPI_CS);
+    }
+    inline static void resetSS() {
+      *portOutputRegister(digitalPinToPort(ETHERNET_SHIELD_SPI_CS)) |= digitalPinToBitMask(ETHERNET_SHIELD_SPI_CS);
+    }
+  #endif
+#else
+  // The SPI library drives the chip select itself with EXTENDED_CS_PIN_HANDLING
+  inline static void initSS()  { };
+  inline static void setSS()   { };
+  inline static void resetSS() { };
+#endif
+};
+
+extern EthernetSPITransport EthernetSPI;
+#endif
+
+// Where the W5100's four indirect mode registers appear on a parallel
+// external memory bus (IDM_OR, IDM_AR0, IDM_AR1, IDM_DR in w5100.h)
+#ifndef ETHERNET_INDIRECT_BASE
+#define ETHERNET_INDIRECT_BASE 0x8000
+#endif
+
+/**
+ * @brief	W5100 on a parallel external memory bus, in indirect mode.
+ *
+ * Only address lines A1..A0 reach the chip: the mode register IDM_OR, the
+ * address registers IDM_AR0/IDM_AR1 and the data register IDM_DR.  With
+ * address auto-increment on, a block costs two address writes and then one
+ * bus cycle per byte, and the address write is skipped when a block starts
+ * where the last one ended.  The transport keeps MR.IND and MR.AI set
+ * across the driver's own MR writes and software resets.
+ *
+ * begin() turns on the external memory interface of AVRs that have one;
+ * wait states, if the bus needs them, are left to the sketch.  The W5200
+ * and W5500 probes in W5100Class::init() are ignored, only the W5100 is
+ * found.
+ */
+class EthernetIndirectTransport : public EthernetTransport {
+public:
+  EthernetIndirectTransport(volatile uint8_t *base = (volatile uint8_t *)ETHERNET_INDIRECT_BASE);
+
+  virtual void begin();
+  virtual void write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len);
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len);
+  virtual bool autoIncrement() { return true; }
+
+protected:
+  // Bus cycles on one indirect register (0 OR, 1 AR0, 2 AR1, 3 DR), all
+  // len bytes to the same register
+  virtual void busWrite(uint8_t reg, const uint8_t *buf, uint16_t len);
+  virtual void busRead(uint8_t reg, uint8_t *buf, uint16_t len);
+
+private:
+  void select(uint16_t addr);
+  void setMode(uint8_t mr);
+
+  volatile uint8_t *_base;
+  uint8_t _mr;      // MR as last written by the driver
+  bool _indirect;   // IND/AI known to be set since the last reset
+  bool _arValid;    // chip's address register known to hold _ar
+  uint16_t _ar;
+};
+
+#if defined(ARDUINO_ARCH_SAMD) && defined(DMAC_CHID_ID)
+/**
+ * @brief	SAMD21 transport that moves frame data with two DMAC channels.
+ *
+ * sercom is the SERCOM behind the SPI library (SERCOM4 on the Zero,
+ * SERCOM1 on the MKR boards), txTrigger/rxTrigger its DMAC trigger sources.
+ * If another library already owns the DMAC descriptor tables they are
+ * shared.  Completion is polled from poll().
+ */
+class EthernetSAMDTransport : public EthernetTransport {
+public:
+  EthernetSAMDTransport(Sercom *sercom = SERCOM4,
+                        uint8_t txTrigger = SERCOM4_DMAC_ID_TX, uint8_t rxTrigger = SERCOM4_DMAC_ID_RX,
+                        uint8_t txChannel = 10, uint8_t rxChannel = 11, uint8_t cs = ETHERNET_SHIELD_SPI_CS);
+
+  virtual void begin();
+  virtual void beginTransaction();
+  virtual void endTransaction();
+  virtual void setClock(uint32_t clock);
+  virtual void write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len);
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len);
+  virtual void writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual void readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual bool poll();
+
+private:
+  void start(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *tx, uint8_t *rx, uint16_t len);
+  bool complete();
+
+  SPISettings settings;
+  Sercom *_sercom;
+  uint8_t _txTrigger, _rxTrigger;
+  uint8_t _txChannel, _rxChannel;
+  uint8_t _cs;
+  volatile bool _active;
+  Callback _done;
+  void *_arg;
+};
+#endif
+
+#if defined(ARDUINO_ARCH_SAM)
+/**
+ * @brief	SAM3X (Due) transport that moves frame data with DMAC channels
+ *        0 and 1 on SPI0.  It drives cs as a plain output instead of the
+ *        SPI library's extended chip select handling.  Completion is
+ *        polled from poll().
+ */
+class EthernetSAMTransport : public EthernetTransport {
+public:
+  EthernetSAMTransport(uint8_t cs = ETHERNET_SHIELD_SPI_CS);
+
+  virtual void begin();
+  virtual void beginTransaction();
+  virtual void endTransaction();
+  virtual void setClock(uint32_t clock);
+  virtual void write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len);
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len);
+  virtual void writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual void readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual bool poll();
+
+private:
+  void start(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *tx, uint8_t *rx, uint16_t len);
+  bool complete();
+
+  SPISettings settings;
+  uint8_t _cs;
+  uint32_t _mr;
+  volatile bool _active;
+  Callback _done;
+  void *_arg;
+};
+#endif
+
+#if defined(ARDUINO_ARCH_STM32) && defined(HAL_SPI_MODULE_ENABLED) && defined(HAL_DMA_MODULE_ENABLED)
+/**
+ * @brief	STM32 transport on a HAL SPI handle.  The application sets up
+ *        hspi, including its clock and the linked Tx and Rx DMA streams;
+ *        this transport drives cs and moves frame data with
+ *        HAL_SPI_Transmit_DMA()/HAL_SPI_Receive_DMA().  Completion is
+ *        polled from poll().
+ */
+class EthernetSTM32Transport : public EthernetTransport {
+public:
+  EthernetSTM32Transport(SPI_HandleTypeDef *hspi, uint8_t cs = ETHERNET_SHIELD_SPI_CS);
+
+  virtual void begin();
+  virtual void write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len);
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len);
+  virtual void writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual void readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual bool poll();
+
+private:
+  SPI_HandleTypeDef *_hspi;
+  uint8_t _cs;
+  volatile bool _active;
+  Callback _done;
+  void *_arg;
+};
+#endif
+
+#if !defined(ARDUINO)
+/**
+ * @brief	Host-side transport that simulates a W5100, W5200 or W5500.
+ *
+ * Frames are decoded the way the selected chip would decode them, against
+ * a model of its registers and socket buffers.  Socket commands take
+ * effect at once (CONNECT establishes, SEND completes), and inject() places
+ * data in a socket's Rx buffer as if it had arrived from the network.
+ * Every frame is counted, so tests can check how the driver batches its
+ * bus traffic.  Background frames run on the next call to poll().
+ */
+class EthernetMockTransport : public EthernetTransport {
+public:
+  EthernetMockTransport(uint8_t chip = 55);
+
+  virtual void begin();
+  virtual void beginTransaction() { transactions++; }
+  virtual void write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len);
+  virtual void read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len);
+  virtual void writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual void readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg);
+  virtual bool poll();
+  virtual void attachInterrupt(uint8_t pin, void (*isr)(void));
+
+  // Place len bytes in socket s's Rx buffer, as if received; returns bytes stored
+  uint16_t inject(uint8_t s, const uint8_t *data, uint16_t len);
+  // Set a socket's status register, e.g. to simulate the peer closing
+  void setStatus(uint8_t s, uint8_t status);
+  // Access to the simulated register space (socket registers at the chip's
+  // own base: 0x0400 on the W5100, 0x4000 on the W5200, 0x1000 on the W5500)
+  uint8_t peek(uint16_t addr);
+  void poke(uint16_t addr, uint8_t data);
+  // Level of the INT pin: true (low) while an unmasked socket interrupt is
+  // pending.  The handler passed to attachInterrupt() runs when it asserts.
+  bool irq();
+
+  // One bus cycle on a flat W5100 style address, with the side effects of a
+  // real access (socket commands, MR.RST, computed sizes)
+  uint8_t busRead(uint16_t addr);
+  void busWrite(uint16_t addr, uint8_t data);
+
+  void resetStats();
+  uint32_t frames;       // Frames clocked, i.e. chip select assertions
+  uint32_t readFrames;   // ... of which read data from the chip
+  uint32_t busBytes;     // Bytes clocked, headers included
+  uint32_t dataBytes;    // Payload bytes, headers excluded
+  uint32_t transactions; // beginTransaction() calls
+  uint32_t commands;     // Socket commands issued through Sn_CR
+
+private:
+  void writeFrame(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len);
+  void readFrame(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len);
+  void frame(const uint8_t *mosi, uint8_t *miso, uint16_t n);
+  void decode(const uint8_t *mosi, uint8_t *miso, uint16_t n);
+  uint8_t *cell(uint8_t block, uint16_t addr);
+  uint8_t load(uint8_t block, uint16_t addr);
+  void store(uint8_t block, uint16_t addr, uint8_t data);
+  int sockReg(uint16_t off, uint8_t *reg);
+  void reset();
+  void command(uint8_t s, uint8_t cmd);
+  uint16_t sockBase(uint8_t s);
+  uint16_t bufBase(uint8_t s, uint8_t rx);
+  uint16_t bufSize(uint8_t s, uint8_t rx);
+  uint16_t reg16(uint8_t s, uint8_t reg);
+  void setReg16(uint8_t s, uint8_t reg, uint16_t val);
+  uint8_t socketIR();
+  void checkInterrupt();
+
+  uint8_t chip;
+  uint8_t regs[0x10000];     // Register space, and W5100/W5200 buffer memory
+  uint8_t txbuf[8][0x4000];  // W5500 socket buffers
+  uint8_t rxbuf[8][0x4000];
+  uint16_t txwr[8];          // Sn_TX_WR as written; reads see it after SEND
+  uint8_t mosi[0x8004], miso[0x8004];
+
+  struct {
+    uint8_t hdr[4];
+    uint8_t hdrlen;
+    const uint8_t *tx;
+    uint8_t *rx;
+    uint16_t len;
+    Callback done;
+    void *arg;
+  } pending;
+  bool active;
+
+  void (*isr)(void);
+  bool intLine;              // INT asserted as of the last check
+};
+
+/**
+ * @brief	Host-side EthernetIndirectTransport wired to a simulated W5100.
+ *        Bus cycles on the four indirect registers are decoded the way the
+ *        chip would in direct and indirect mode; chip gives access to the
+ *        model underneath (inject(), peek() and its counters).
+ */
+class EthernetIndirectMockTransport : public EthernetIndirectTransport {
+public:
+  EthernetIndirectMockTransport() : chip(51), cycles(0), ar(0) { }
+
+  virtual void attachInterrupt(uint8_t pin, void (*isr)(void)) { chip.attachInterrupt(pin, isr); }
+
+  EthernetMockTransport chip;
+  uint32_t cycles;   // Bus cycles, address writes included
+
+protected:
+  virtual void busWrite(uint8_t reg, const uint8_t *buf, uint16_t len);
+  virtual void busRead(uint8_t reg, uint8_t *buf, uint16_t len);
+
+private:
+  uint16_t ar;
+};
+#endif
+
+#endif
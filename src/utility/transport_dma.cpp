@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2010 by Arduino LLC. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+// DMA transports.  Each one clocks the frame header by hand, hands the data
+// block to the DMA controller and returns; poll() releases the chip select
+// and runs the frame's callback once the last byte has been received.
+// write() and read() are writeAsync() and readAsync() polled to the end, so
+// large blocking frames still go at the DMA controller's pace.
+
+#include "transport.h"
+
+// Frames shorter than this are cheaper to clock by hand than to set up
+#define DMA_MIN_LEN 16
+
+#if defined(ARDUINO_ARCH_SAMD) && defined(DMAC_CHID_ID)
+
+// Descriptor tables, used unless another library has already set up the DMAC
+static DmacDescriptor dmaDescriptors[DMAC_CH_NUM] __attribute__((aligned(16)));
+static DmacDescriptor dmaWriteback[DMAC_CH_NUM] __attribute__((aligned(16)));
+static uint8_t dmaZero = 0; // Tx source while reading
+static uint8_t dmaSink;     // Rx destination while writing
+
+static void setupChannel(uint8_t channel, uint8_t trigger)
+{
+  DMAC->CHID.reg = DMAC_CHID_ID(channel);
+  DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+  DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+  while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST)
+    ;
+  DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(trigger) | DMAC_CHCTRLB_TRIGACT_BEAT;
+}
+
+EthernetSAMDTransport::EthernetSAMDTransport(Sercom *sercom, uint8_t txTrigger, uint8_t rxTrigger,
+                                             uint8_t txChannel, uint8_t rxChannel, uint8_t cs)
+  : settings(ETHERNET_SPI_CLOCK, MSBFIRST, SPI_MODE0), _sercom(sercom),
+    _txTrigger(txTrigger), _rxTrigger(rxTrigger), _txChannel(txChannel), _rxChannel(rxChannel),
+    _cs(cs), _active(false), _done(NULL), _arg(NULL)
+{
+}
+
+void EthernetSAMDTransport::begin()
+{
+  SPI.begin();
+  pinMode(_cs, OUTPUT);
+  digitalWrite(_cs, HIGH);
+
+  PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+  PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+  if (!(DMAC->CTRL.reg & DMAC_CTRL_DMAENABLE)) {
+    DMAC->BASEADDR.reg = (uint32_t)dmaDescriptors;
+    DMAC->WRBADDR.reg = (uint32_t)dmaWriteback;
+    DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+  }
+  setupChannel(_txChannel, _txTrigger);
+  setupChannel(_rxChannel, _rxTrigger);
+}
+
+void EthernetSAMDTransport::beginTransaction()
+{
+  SPI.beginTransaction(settings);
+}
+
+void EthernetSAMDTransport::endTransaction()
+{
+  while (poll())
+    ;
+  SPI.endTransaction();
+}
+
+void EthernetSAMDTransport::setClock(uint32_t clock)
+{
+  settings = SPISettings(clock, MSBFIRST, SPI_MODE0);
+}
+
+void EthernetSAMDTransport::start(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+  DmacDescriptor *desc = (DmacDescriptor *)DMAC->BASEADDR.reg;
+  volatile void *data = &_sercom->SPI.DATA.reg;
+
+  digitalWrite(_cs, LOW);
+  for (uint8_t i=0; i<hdrlen; i++)
+    SPI.transfer(hdr[i]);
+
+  // The Rx channel always runs, so completion means the last byte is in.
+  // Incrementing addresses point one past the end of the block.
+  DmacDescriptor *d = &desc[_rxChannel];
+  d->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | (rx ? DMAC_BTCTRL_DSTINC : 0);
+  d->BTCNT.reg = len;
+  d->SRCADDR.reg = (uint32_t)data;
+  d->DSTADDR.reg = rx ? (uint32_t)(rx + len) : (uint32_t)&dmaSink;
+  d->DESCADDR.reg = 0;
+
+  d = &desc[_txChannel];
+  d->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | (tx ? DMAC_BTCTRL_SRCINC : 0);
+  d->BTCNT.reg = len;
+  d->SRCADDR.reg = tx ? (uint32_t)(tx + len) : (uint32_t)&dmaZero;
+  d->DSTADDR.reg = (uint32_t)data;
+  d->DESCADDR.reg = 0;
+
+  _active = true;
+  DMAC->CHID.reg = DMAC_CHID_ID(_rxChannel);
+  DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_MASK;
+  DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+  DMAC->CHID.reg = DMAC_CHID_ID(_txChannel);
+  DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_MASK;
+  DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+}
+
+bool EthernetSAMDTransport::complete()
+{
+  DMAC->CHID.reg = DMAC_CHID_ID(_rxChannel);
+  return DMAC->CHINTFLAG.reg & DMAC_CHINTFLAG_TCMPL;
+}
+
+bool EthernetSAMDTransport::poll()
+{
+  if (_active && complete()) {
+    digitalWrite(_cs, HIGH);
+    _active = false;
+    Callback done = _done;
+    _done = NULL;
+    if (done)
+      done(_arg);
+  }
+  return _active;
+}
+
+void EthernetSAMDTransport::writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  if (len < DMA_MIN_LEN) {
+    digitalWrite(_cs, LOW);
+    for (uint8_t i=0; i<hdrlen; i++)
+      SPI.transfer(hdr[i]);
+    for (uint16_t i=0; i<len; i++)
+      SPI.transfer(buf[i]);
+    digitalWrite(_cs, HIGH);
+    if (done)
+      done(arg);
+    return;
+  }
+  _done = done;
+  _arg = arg;
+  start(hdr, hdrlen, buf, NULL, len);
+}
+
+void EthernetSAMDTransport::readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  if (len < DMA_MIN_LEN) {
+    digitalWrite(_cs, LOW);
+    for (uint8_t i=0; i<hdrlen; i++)
+      SPI.transfer(hdr[i]);
+    for (uint16_t i=0; i<len; i++)
+      buf[i] = SPI.transfer(0);
+    digitalWrite(_cs, HIGH);
+    if (done)
+      done(arg);
+    return;
+  }
+  _done = done;
+  _arg = arg;
+  start(hdr, hdrlen, NULL, buf, len);
+}
+
+void EthernetSAMDTransport::write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len)
+{
+  writeAsync(hdr, hdrlen, buf, len, NULL, NULL);
+  while (poll())
+    ;
+}
+
+void EthernetSAMDTransport::read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+{
+  readAsync(hdr, hdrlen, buf, len, NULL, NULL);
+  while (poll())
+    ;
+}
+
+#endif
+
+#if defined(ARDUINO_ARCH_SAM)
+
+#define SAM_DMAC_TX_CH 0
+#define SAM_DMAC_RX_CH 1
+// DMAC hardware handshaking interfaces of SPI0
+#define SAM_SPI_TX_IDX 1
+#define SAM_SPI_RX_IDX 2
+
+static uint8_t dmaZero = 0; // Tx source while reading
+static uint8_t dmaSink;     // Rx destination while writing
+
+static inline uint8_t samTransfer(uint8_t data)
+{
+  while (!(SPI0->SPI_SR & SPI_SR_TDRE))
+    ;
+  SPI0->SPI_TDR = data;
+  while (!(SPI0->SPI_SR & SPI_SR_RDRF))
+    ;
+  return SPI0->SPI_RDR;
+}
+
+EthernetSAMTransport::EthernetSAMTransport(uint8_t cs)
+  : settings(ETHERNET_SPI_CLOCK, MSBFIRST, SPI_MODE0), _cs(cs), _mr(0),
+    _active(false), _done(NULL), _arg(NULL)
+{
+}
+
+void EthernetSAMTransport::begin()
+{
+  SPI.begin();
+  pinMode(_cs, OUTPUT);
+  digitalWrite(_cs, HIGH);
+
+  pmc_enable_periph_clk(ID_DMAC);
+  DMAC->DMAC_EN &= ~DMAC_EN_ENABLE;
+  DMAC->DMAC_GCFG = DMAC_GCFG_ARB_CFG_FIXED;
+  DMAC->DMAC_EN = DMAC_EN_ENABLE;
+}
+
+void EthernetSAMTransport::beginTransaction()
+{
+  SPI.beginTransaction(settings);
+  // Fixed peripheral select on the SPI library's default channel, so the
+  // byte-wide writes to TDR use the clock settings just applied to it
+  uint32_t ch = BOARD_PIN_TO_SPI_CHANNEL(BOARD_SPI_DEFAULT_SS);
+  _mr = SPI0->SPI_MR;
+  SPI0->SPI_MR = (_mr & ~(SPI_MR_PS | SPI_MR_PCS_Msk)) | SPI_MR_PCS(~(1u << ch) & ((2u << ch) - 1));
+}
+
+void EthernetSAMTransport::endTransaction()
+{
+  while (poll())
+    ;
+  SPI0->SPI_MR = _mr;
+  SPI.endTransaction();
+}
+
+void EthernetSAMTransport::setClock(uint32_t clock)
+{
+  settings = SPISettings(clock, MSBFIRST, SPI_MODE0);
+}
+
+void EthernetSAMTransport::start(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+  digitalWrite(_cs, LOW);
+  for (uint8_t i=0; i<hdrlen; i++)
+    samTransfer(hdr[i]);
+
+  DMAC->DMAC_CHDR = (DMAC_CHDR_DIS0 << SAM_DMAC_RX_CH) | (DMAC_CHDR_DIS0 << SAM_DMAC_TX_CH);
+
+  // The Rx channel always runs, so completion means the last byte is in
+  DMAC->DMAC_CH_NUM[SAM_DMAC_RX_CH].DMAC_SADDR = (uint32_t)&SPI0->SPI_RDR;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_RX_CH].DMAC_DADDR = rx ? (uint32_t)rx : (uint32_t)&dmaSink;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_RX_CH].DMAC_DSCR = 0;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_RX_CH].DMAC_CTRLA = len | DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_RX_CH].DMAC_CTRLB = DMAC_CTRLB_SRC_DSCR | DMAC_CTRLB_DST_DSCR |
+    DMAC_CTRLB_FC_PER2MEM_DMA_FC | DMAC_CTRLB_SRC_INCR_FIXED |
+    (rx ? DMAC_CTRLB_DST_INCR_INCREMENTING : DMAC_CTRLB_DST_INCR_FIXED);
+  DMAC->DMAC_CH_NUM[SAM_DMAC_RX_CH].DMAC_CFG = DMAC_CFG_SRC_PER(SAM_SPI_RX_IDX) |
+    DMAC_CFG_SRC_H2SEL | DMAC_CFG_SOD | DMAC_CFG_FIFOCFG_ASAP_CFG;
+
+  DMAC->DMAC_CH_NUM[SAM_DMAC_TX_CH].DMAC_SADDR = tx ? (uint32_t)tx : (uint32_t)&dmaZero;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_TX_CH].DMAC_DADDR = (uint32_t)&SPI0->SPI_TDR;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_TX_CH].DMAC_DSCR = 0;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_TX_CH].DMAC_CTRLA = len | DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
+  DMAC->DMAC_CH_NUM[SAM_DMAC_TX_CH].DMAC_CTRLB = DMAC_CTRLB_SRC_DSCR | DMAC_CTRLB_DST_DSCR |
+    DMAC_CTRLB_FC_MEM2PER_DMA_FC | DMAC_CTRLB_DST_INCR_FIXED |
+    (tx ? DMAC_CTRLB_SRC_INCR_INCREMENTING : DMAC_CTRLB_SRC_INCR_FIXED);
+  DMAC->DMAC_CH_NUM[SAM_DMAC_TX_CH].DMAC_CFG = DMAC_CFG_DST_PER(SAM_SPI_TX_IDX) |
+    DMAC_CFG_DST_H2SEL | DMAC_CFG_SOD | DMAC_CFG_FIFOCFG_ALAP_CFG;
+
+  _active = true;
+  DMAC->DMAC_CHER = (DMAC_CHER_ENA0 << SAM_DMAC_RX_CH) | (DMAC_CHER_ENA0 << SAM_DMAC_TX_CH);
+}
+
+bool EthernetSAMTransport::complete()
+{
+  // The channel disables itself at the end of the block (SOD)
+  return !(DMAC->DMAC_CHSR & (DMAC_CHSR_ENA0 << SAM_DMAC_RX_CH));
+}
+
+bool EthernetSAMTransport::poll()
+{
+  if (_active && complete()) {
+    digitalWrite(_cs, HIGH);
+    _active = false;
+    Callback done = _done;
+    _done = NULL;
+    if (done)
+      done(_arg);
+  }
+  return _active;
+}
+
+void EthernetSAMTransport::writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  if (len < DMA_MIN_LEN) {
+    digitalWrite(_cs, LOW);
+    for (uint8_t i=0; i<hdrlen; i++)
+      samTransfer(hdr[i]);
+    for (uint16_t i=0; i<len; i++)
+      samTransfer(buf[i]);
+    digitalWrite(_cs, HIGH);
+    if (done)
+      done(arg);
+    return;
+  }
+  _done = done;
+  _arg = arg;
+  start(hdr, hdrlen, buf, NULL, len);
+}
+
+void EthernetSAMTransport::readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  if (len < DMA_MIN_LEN) {
+    digitalWrite(_cs, LOW);
+    for (uint8_t i=0; i<hdrlen; i++)
+      samTransfer(hdr[i]);
+    for (uint16_t i=0; i<len; i++)
+      buf[i] = samTransfer(0);
+    digitalWrite(_cs, HIGH);
+    if (done)
+      done(arg);
+    return;
+  }
+  _done = done;
+  _arg = arg;
+  start(hdr, hdrlen, NULL, buf, len);
+}
+
+void EthernetSAMTransport::write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len)
+{
+  writeAsync(hdr, hdrlen, buf, len, NULL, NULL);
+  while (poll())
+    ;
+}
+
+void EthernetSAMTransport::read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+{
+  readAsync(hdr, hdrlen, buf, len, NULL, NULL);
+  while (poll())
+    ;
+}
+
+#endif
+
+#if defined(ARDUINO_ARCH_STM32) && defined(HAL_SPI_MODULE_ENABLED) && defined(HAL_DMA_MODULE_ENABLED)
+
+EthernetSTM32Transport::EthernetSTM32Transport(SPI_HandleTypeDef *hspi, uint8_t cs)
+  : _hspi(hspi), _cs(cs), _active(false), _done(NULL), _arg(NULL)
+{
+}
+
+void EthernetSTM32Transport::begin()
+{
+  pinMode(_cs, OUTPUT);
+  digitalWrite(_cs, HIGH);
+}
+
+bool EthernetSTM32Transport::poll()
+{
+  if (_active && HAL_SPI_GetState(_hspi) == HAL_SPI_STATE_READY) {
+    digitalWrite(_cs, HIGH);
+    _active = false;
+    Callback done = _done;
+    _done = NULL;
+    if (done)
+      done(_arg);
+  }
+  return _active;
+}
+
+void EthernetSTM32Transport::writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  digitalWrite(_cs, LOW);
+  HAL_SPI_Transmit(_hspi, (uint8_t *)hdr, hdrlen, HAL_MAX_DELAY);
+  if (len >= DMA_MIN_LEN && HAL_SPI_Transmit_DMA(_hspi, (uint8_t *)buf, len) == HAL_OK) {
+    // poll() releases the chip select once the stream is done
+    _done = done;
+    _arg = arg;
+    _active = true;
+    return;
+  }
+  if (len)
+    HAL_SPI_Transmit(_hspi, (uint8_t *)buf, len, HAL_MAX_DELAY);
+  digitalWrite(_cs, HIGH);
+  if (done)
+    done(arg);
+}
+
+void EthernetSTM32Transport::readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  digitalWrite(_cs, LOW);
+  HAL_SPI_Transmit(_hspi, (uint8_t *)hdr, hdrlen, HAL_MAX_DELAY);
+  if (len >= DMA_MIN_LEN && HAL_SPI_Receive_DMA(_hspi, buf, len) == HAL_OK) {
+    _done = done;
+    _arg = arg;
+    _active = true;
+    return;
+  }
+  if (len)
+    HAL_SPI_Receive(_hspi, buf, len, HAL_MAX_DELAY);
+  digitalWrite(_cs, HIGH);
+  if (done)
+    done(arg);
+}
+
+void EthernetSTM32Transport::write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len)
+{
+  writeAsync(hdr, hdrlen, buf, len, NULL, NULL);
+  while (poll())
+    ;
+}
+
+void EthernetSTM32Transport::read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+{
+  readAsync(hdr, hdrlen, buf, len, NULL, NULL);
+  while (poll())
+    ;
+}
+
+#endif
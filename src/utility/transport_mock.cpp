@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2010 by Arduino LLC. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#if !defined(ARDUINO)
+
+#include <string.h>
+
+#include "w5100.h"
+
+// Socket register offsets the model acts on
+#define SN_MR     0x00
+#define SN_CR     0x01
+#define SN_IR     0x02
+#define SN_SR     0x03
+#define SN_IMR    0x2C   // W5200/W5500 only
+#define SN_TX_FSR 0x20
+#define SN_TX_RD  0x22
+#define SN_TX_WR  0x24
+#define SN_RX_RSR 0x26
+#define SN_RX_RD  0x28
+#define SN_RX_WR  0x2A   // Internal on the W5100, where it is not visible
+#define SN_RX_SIZE 0x1E
+#define SN_TX_SIZE 0x1F
+
+EthernetMockTransport::EthernetMockTransport(uint8_t _chip)
+  : chip(_chip), active(false), isr(NULL), intLine(false)
+{
+  resetStats();
+  reset();
+}
+
+void EthernetMockTransport::begin()
+{
+}
+
+void EthernetMockTransport::resetStats()
+{
+  frames = 0;
+  readFrames = 0;
+  busBytes = 0;
+  dataBytes = 0;
+  transactions = 0;
+  commands = 0;
+}
+
+void EthernetMockTransport::reset()
+{
+  memset(regs, 0, sizeof(regs));
+  memset(txwr, 0, sizeof(txwr));
+  if (chip == 55) {
+    regs[0x19] = 0x07;   // RTR, 200ms
+    regs[0x1A] = 0xD0;
+    regs[0x1B] = 8;      // RCR
+    regs[0x39] = 4;      // VERSIONR
+  } else {
+    regs[0x17] = 0x07;
+    regs[0x18] = 0xD0;
+    regs[0x19] = 8;
+  }
+  if (chip == 52)
+    regs[0x1F] = 3;
+  if (chip == 51) {
+    regs[0x1A] = 0x55;   // RMSR/TMSR, 2K per socket
+    regs[0x1B] = 0x55;
+  } else {
+    for (uint8_t s=0; s<8; s++) {
+      regs[sockBase(s) + SN_RX_SIZE] = 2;
+      regs[sockBase(s) + SN_TX_SIZE] = 2;
+      regs[sockBase(s) + SN_IMR] = 0xFF;
+    }
+  }
+}
+
+uint16_t EthernetMockTransport::sockBase(uint8_t s)
+{
+  // W5500 socket register blocks are kept at a flat base like the others
+  uint16_t base = (chip == 51) ? 0x0400 : (chip == 52) ? 0x4000 : 0x1000;
+  return base + s * 0x0100;
+}
+
+uint16_t EthernetMockTransport::bufSize(uint8_t s, uint8_t rx)
+{
+  if (chip == 51)
+    return 1024 << ((regs[rx ? 0x1A : 0x1B] >> (2 * s)) & 0x03);
+  return regs[sockBase(s) + (rx ? SN_RX_SIZE : SN_TX_SIZE)] << 10;
+}
+
+uint16_t EthernetMockTransport::bufBase(uint8_t s, uint8_t rx)
+{
+  uint16_t base;
+  if (chip == 51)
+    base = rx ? 0x6000 : 0x4000;
+  else
+    base = rx ? 0xC000 : 0x8000;
+  for (uint8_t i=0; i<s; i++)
+    base += bufSize(i, rx);
+  return base;
+}
+
+uint16_t EthernetMockTransport::reg16(uint8_t s, uint8_t reg)
+{
+  uint16_t addr = sockBase(s) + reg;
+  return (regs[addr] << 8) | regs[addr + 1];
+}
+
+void EthernetMockTransport::setReg16(uint8_t s, uint8_t reg, uint16_t val)
+{
+  uint16_t addr = sockBase(s) + reg;
+  regs[addr] = val >> 8;
+  regs[addr + 1] = val & 0xFF;
+}
+
+int EthernetMockTransport::sockReg(uint16_t off, uint8_t *reg)
+{
+  uint16_t base = sockBase(0);
+  uint8_t n = (chip == 51) ? 4 : 8;
+  if (off < base || off >= base + n * 0x0100)
+    return -1;
+  *reg = off & 0xFF;
+  return (off - base) >> 8;
+}
+
+uint8_t *EthernetMockTransport::cell(uint8_t block, uint16_t addr)
+{
+  if (chip != 55)
+    return &regs[addr];
+
+  if (block == 0)
+    return &regs[addr & 0xFF];
+  uint8_t s = (block - 1) >> 2;
+  if (s >= 8)
+    return NULL;
+  switch ((block - 1) & 0x03) {
+  case 0:
+    return &regs[sockBase(s) + (addr & 0xFF)];
+  case 1:
+    return bufSize(s, 0) ? &txbuf[s][addr & (bufSize(s, 0) - 1)] : NULL;
+  case 2:
+    return bufSize(s, 1) ? &rxbuf[s][addr & (bufSize(s, 1) - 1)] : NULL;
+  }
+  return NULL;
+}
+
+uint8_t EthernetMockTransport::load(uint8_t block, uint16_t addr)
+{
+  uint8_t *p = cell(block, addr);
+  uint8_t reg;
+  int s;
+
+  if (p == NULL)
+    return 0;
+  // Socket interrupt summary: IR on the W5100, IR2 on the W5200, SIR on the W5500
+  if (p == &regs[0x15] && chip == 51)
+    return (regs[0x15] & 0xF0) | socketIR();
+  if ((p == &regs[0x34] && chip == 52) || (p == &regs[0x17] && chip == 55))
+    return socketIR();
+  if (p >= regs && p < regs + sizeof(regs) && (s = sockReg(p - regs, &reg)) >= 0) {
+    // Free space and received size follow the pointers
+    uint16_t val;
+    switch (reg & ~1) {
+    case SN_TX_FSR:
+      val = bufSize(s, 0) - (uint16_t)(reg16(s, SN_TX_WR) - reg16(s, SN_TX_RD));
+      return (reg & 1) ? (val & 0xFF) : (val >> 8);
+    case SN_RX_RSR:
+      val = reg16(s, SN_RX_WR) - reg16(s, SN_RX_RD);
+      return (reg & 1) ? (val & 0xFF) : (val >> 8);
+    }
+  }
+  return *p;
+}
+
+void EthernetMockTransport::store(uint8_t block, uint16_t addr, uint8_t data)
+{
+  uint8_t *p = cell(block, addr);
+  uint8_t reg;
+  int s;
+
+  if (p == NULL)
+    return;
+  if (p == regs && (data & 0x80)) {
+    // MR.RST; the bit reads back clear at once
+    reset();
+    return;
+  }
+  if (p >= regs && p < regs + sizeof(regs) && (s = sockReg(p - regs, &reg)) >= 0) {
+    switch (reg) {
+    case SN_CR:
+      command(s, data);
+      return;
+    case SN_IR:
+      *p &= ~data;
+      return;
+    case SN_TX_WR:
+      txwr[s] = (txwr[s] & 0x00FF) | (data << 8);
+      return;
+    case SN_TX_WR + 1:
+      txwr[s] = (txwr[s] & 0xFF00) | data;
+      return;
+    case SN_SR:
+    case SN_TX_FSR: case SN_TX_FSR + 1:
+    case SN_TX_RD: case SN_TX_RD + 1:
+    case SN_RX_RSR: case SN_RX_RSR + 1:
+      return;
+    }
+  }
+  *p = data;
+}
+
+void EthernetMockTransport::command(uint8_t s, uint8_t cmd)
+{
+  uint16_t base = sockBase(s);
+  uint8_t &sr = regs[base + SN_SR];
+  uint8_t &ir = regs[base + SN_IR];
+
+  commands++;
+  switch (cmd) {
+  case Sock_OPEN:
+    switch (regs[base + SN_MR] & 0x0F) {
+    case SnMR::TCP:    sr = SnSR::INIT; break;
+    case SnMR::UDP:    sr = SnSR::UDP; break;
+    case SnMR::IPRAW:  sr = SnSR::IPRAW; break;
+    case SnMR::MACRAW: sr = SnSR::MACRAW; break;
+    default:           sr = SnSR::CLOSED; break;
+    }
+    memset(&regs[base + SN_TX_RD], 0, SN_RX_WR + 2 - SN_TX_RD);
+    txwr[s] = 0;
+    break;
+  case Sock_LISTEN:
+    if (sr == SnSR::INIT)
+      sr = SnSR::LISTEN;
+    break;
+  case Sock_CONNECT:
+    if (sr == SnSR::INIT) {
+      sr = SnSR::ESTABLISHED;
+      ir |= SnIR::CON;
+    }
+    break;
+  case Sock_DISCON:
+    sr = SnSR::CLOSED;
+    ir |= SnIR::DISCON;
+    break;
+  case Sock_CLOSE:
+    sr = SnSR::CLOSED;
+    break;
+  case Sock_SEND:
+  case Sock_SEND_MAC:
+    // Everything written so far goes out at once
+    setReg16(s, SN_TX_WR, txwr[s]);
+    setReg16(s, SN_TX_RD, txwr[s]);
+    ir |= SnIR::SEND_OK;
+    break;
+  }
+  regs[base + SN_CR] = 0;
+}
+
+uint16_t EthernetMockTransport::inject(uint8_t s, const uint8_t *data, uint16_t len)
+{
+  uint16_t size = bufSize(s, 1);
+  if (size == 0)
+    return 0;
+  uint16_t wr = reg16(s, SN_RX_WR);
+  uint16_t space = size - (uint16_t)(wr - reg16(s, SN_RX_RD));
+  if (len > space)
+    len = space;
+  for (uint16_t i=0; i<len; i++) {
+    uint16_t offset = (wr + i) & (size - 1);
+    if (chip == 55)
+      rxbuf[s][offset] = data[i];
+    else
+      regs[bufBase(s, 1) + offset] = data[i];
+  }
+  setReg16(s, SN_RX_WR, wr + len);
+  if (len)
+    regs[sockBase(s) + SN_IR] |= SnIR::RECV;
+  checkInterrupt();
+  return len;
+}
+
+void EthernetMockTransport::setStatus(uint8_t s, uint8_t status)
+{
+  regs[sockBase(s) + SN_SR] = status;
+}
+
+uint8_t EthernetMockTransport::socketIR()
+{
+  uint8_t n = (chip == 51) ? 4 : 8;
+  uint8_t ir = 0;
+  for (uint8_t s=0; s<n; s++) {
+    uint8_t sn = regs[sockBase(s) + SN_IR];
+    if (chip != 51)
+      sn &= regs[sockBase(s) + SN_IMR];
+    if (sn)
+      ir |= 1 << s;
+  }
+  return ir;
+}
+
+bool EthernetMockTransport::irq()
+{
+  uint8_t mask = (chip == 51) ? regs[0x16] : (chip == 52) ? regs[0x36] : regs[0x18];
+  return (socketIR() & mask) != 0;
+}
+
+void EthernetMockTransport::attachInterrupt(uint8_t pin, void (*_isr)(void))
+{
+  (void)pin;
+  isr = _isr;
+  intLine = false;
+  checkInterrupt();
+}
+
+void EthernetMockTransport::checkInterrupt()
+{
+  // Falling edge on INT
+  bool level = irq();
+  bool edge = level && !intLine;
+  intLine = level;
+  if (edge && isr)
+    isr();
+}
+
+uint8_t EthernetMockTransport::peek(uint16_t addr)
+{
+  return regs[addr];
+}
+
+void EthernetMockTransport::poke(uint16_t addr, uint8_t data)
+{
+  regs[addr] = data;
+}
+
+uint8_t EthernetMockTransport::busRead(uint16_t addr)
+{
+  return load(0, addr);
+}
+
+void EthernetMockTransport::busWrite(uint16_t addr, uint8_t data)
+{
+  store(0, addr, data);
+  checkInterrupt();
+}
+
+void EthernetMockTransport::frame(const uint8_t *out, uint8_t *in, uint16_t n)
+{
+  memset(in, 0, n);
+  frames++;
+  busBytes += n;
+  decode(out, in, n);
+  checkInterrupt();
+}
+
+void EthernetMockTransport::decode(const uint8_t *out, uint8_t *in, uint16_t n)
+{
+
+  if (chip == 51) {
+    // One byte per frame: op, address, data
+    if (n < 4)
+      return;
+    uint16_t addr = (out[1] << 8) | out[2];
+    if (out[0] == 0xF0)
+      store(0, addr, out[3]);
+    else if (out[0] == 0x0F)
+      in[3] = load(0, addr);
+    return;
+  }
+
+  uint16_t addr = (out[0] << 8) | out[1];
+  if (chip == 52) {
+    // Address, then write flag and length
+    if (n < 4)
+      return;
+    uint8_t wr = out[2] & 0x80;
+    uint16_t len = ((out[2] & 0x7F) << 8) | out[3];
+    for (uint16_t i=4; i<n && i-4<len; i++, addr++) {
+      if (wr)
+        store(0, addr, out[i]);
+      else
+        in[i] = load(0, addr);
+    }
+    return;
+  }
+
+  // Address, then block select and write flag; the data runs to the end
+  if (n < 3)
+    return;
+  uint8_t block = out[2] >> 3;
+  uint8_t wr = out[2] & 0x04;
+  for (uint16_t i=3; i<n; i++, addr++) {
+    if (wr)
+      store(block, addr, out[i]);
+    else
+      in[i] = load(block, addr);
+  }
+}
+
+void EthernetMockTransport::writeFrame(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len)
+{
+  if (hdrlen + len > (int)sizeof(mosi))
+    len = sizeof(mosi) - hdrlen;
+  memcpy(mosi, hdr, hdrlen);
+  memcpy(mosi + hdrlen, buf, len);
+  frame(mosi, miso, hdrlen + len);
+  dataBytes += len;
+}
+
+void EthernetMockTransport::readFrame(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+{
+  if (hdrlen + len > (int)sizeof(mosi))
+    len = sizeof(mosi) - hdrlen;
+  memcpy(mosi, hdr, hdrlen);
+  memset(mosi + hdrlen, 0, len);
+  frame(mosi, miso, hdrlen + len);
+  memcpy(buf, miso + hdrlen, len);
+  readFrames++;
+  dataBytes += len;
+}
+
+void EthernetMockTransport::write(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len)
+{
+  while (poll())
+    ;
+  writeFrame(hdr, hdrlen, buf, len);
+}
+
+void EthernetMockTransport::read(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len)
+{
+  while (poll())
+    ;
+  readFrame(hdr, hdrlen, buf, len);
+}
+
+void EthernetMockTransport::writeAsync(const uint8_t *hdr, uint8_t hdrlen, const uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  memcpy(pending.hdr, hdr, hdrlen);
+  pending.hdrlen = hdrlen;
+  pending.tx = buf;
+  pending.rx = NULL;
+  pending.len = len;
+  pending.done = done;
+  pending.arg = arg;
+  active = true;
+}
+
+void EthernetMockTransport::readAsync(const uint8_t *hdr, uint8_t hdrlen, uint8_t *buf, uint16_t len, Callback done, void *arg)
+{
+  while (poll())
+    ;
+  memcpy(pending.hdr, hdr, hdrlen);
+  pending.hdrlen = hdrlen;
+  pending.tx = NULL;
+  pending.rx = buf;
+  pending.len = len;
+  pending.done = done;
+  pending.arg = arg;
+  active = true;
+}
+
+bool EthernetMockTransport::poll()
+{
+  if (active) {
+    // The frame completes in one go; its callback may queue the next
+    active = false;
+    if (pending.rx)
+      readFrame(pending.hdr, pending.hdrlen, pending.rx, pending.len);
+    else
+      writeFrame(pending.hdr, pending.hdrlen, pending.tx, pending.len);
+    if (pending.done)
+      pending.done(pending.arg);
+  }
+  return active;
+}
+
+void EthernetIndirectMockTransport::busWrite(uint8_t reg, const uint8_t *buf, uint16_t len)
+{
+  for (uint16_t i=0; i<len; i++) {
+    cycles++;
+    if (reg == 0 || !(chip.peek(0) & IDM_MR_IND)) {
+      // Direct mode: A1..A0 reach registers 0x0000..0x0003
+      if (reg == 0 && (buf[i] & IDM_MR_RST))
+        ar = 0;
+      chip.busWrite(reg, buf[i]);
+      continue;
+    }
+    switch (reg) {
+    case 1:
+      ar = (ar & 0x00FF) | (buf[i] << 8);
+      break;
+    case 2:
+      ar = (ar & 0xFF00) | buf[i];
+      break;
+    case 3:
+      chip.busWrite(ar, buf[i]);
+      if (chip.peek(0) & IDM_MR_AI)
+        ar++;
+      break;
+    }
+  }
+}
+
+void EthernetIndirectMockTransport::busRead(uint8_t reg, uint8_t *buf, uint16_t len)
+{
+  for (uint16_t i=0; i<len; i++) {
+    cycles++;
+    if (reg == 0 || !(chip.peek(0) & IDM_MR_IND)) {
+      buf[i] = chip.busRead(reg);
+      continue;
+    }
+    switch (reg) {
+    case 1:
+      buf[i] = ar >> 8;
+      break;
+    case 2:
+      buf[i] = ar & 0xFF;
+      break;
+    case 3:
+      buf[i] = chip.busRead(ar);
+      if (chip.peek(0) & IDM_MR_AI)
+        ar++;
+      break;
+    }
+  }
+}
+
+#endif
@@ -15,6 +15,52 @@
 // W5100 controller instance
 W5100Class W5100;
 
+W5100Class *W5100Class::irqChip[W5100Class::IRQ_SLOTS];
+
+W5100Class::W5100Class()
+{
+#if defined(ARDUINO)
+  setDefaults(&EthernetSPI);
+#else
+  setDefaults(NULL);
+#endif
+}
+
+W5100Class::W5100Class(EthernetTransport &t)
+{
+  setDefaults(&t);
+}
+
+void W5100Class::setDefaults(EthernetTransport *t)
+{
+  transport = t;
+  chip = 0;
+  sockets = 0;
+  CH_BASE = 0x0400;
+  spiClock = ETHERNET_SPI_CLOCK;
+  calibrationLimit = 0;
+  cmdPending = 0;
+  irqPin = -1;
+  irqEnabled = false;
+  busDepth = 0;
+  irqPending = 0;
+  memset((void *)events, 0, sizeof(events));
+  memset(socketState, 0, sizeof(socketState));
+  socketsOwned = 0;
+  asyncCopy.len = 0;
+  localPort = 0;
+  memset(txKB, 0, sizeof(txKB));
+  memset(rxKB, 0, sizeof(rxKB));
+  memset(SSIZE, 0, sizeof(SSIZE));
+  memset(RSIZE, 0, sizeof(RSIZE));
+  memset(SBASE, 0, sizeof(SBASE));
+  memset(RBASE, 0, sizeof(RBASE));
+#if defined(ETHERNET_VERIFY_SHADOW)
+  shadowErrors = 0;
+#endif
+  resetShadow();
+}
+
 #define TX_RX_MAX_BUF_SIZE 2048
 #define TX_BUF 0x1100
 #define RX_BUF (TX_BUF + TX_RX_MAX_BUF_SIZE)
@@ -22,34 +68,385 @@ W5100Class W5100;
 #define TXBUF_BASE 0x4000
 #define RXBUF_BASE 0x6000
 
-void W5100Class::init(void)
+#define TXBUF_BASE_W5200 0x8000
+#define RXBUF_BASE_W5200 0xC000
+
+// W5500 control byte: block select in bits 7..3, write flag in bit 2, and
+// variable length data mode.  Socket n owns blocks 4n+1 (registers), 4n+2
+// (Tx buffer) and 4n+3 (Rx buffer).
+#define W5500_WRITE     0x04
+#define W5500_COMMON    0x00
+#define W5500_SOCKET(s) (((s) << 5) | 0x08)
+#define W5500_TXBUF(s)  (((s) << 5) | 0x10)
+#define W5500_RXBUF(s)  (((s) << 5) | 0x18)
+
+// Clock rates tried by calibrateSPIClock(), slowest first.  The SPI library
+// rounds each one down to the nearest rate the board can generate.
+static const uint32_t spi_clocks[] = {
+  4000000, 8000000, 12000000, 14000000, 16000000, 20000000,
+  24000000, 28000000, 33000000, 42000000, 60000000, 80000000
+};
+#define SPI_CLOCK_STEPS (sizeof(spi_clocks) / sizeof(spi_clocks[0]))
+
+// Test block size and passes per clock rate during calibration
+#define SPI_TEST_SIZE   64
+#define SPI_TEST_PASSES 4
+
+uint8_t W5100Class::init(void)
 {
   delay(300);
 
-#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
-  SPI.begin();
-  initSS();
-#else
-  SPI.begin(ETHERNET_SHIELD_SPI_CS);
-  // Set clock to 4Mhz (W5100 should support up to about 14Mhz)
-  SPI.setClockDivider(ETHERNET_SHIELD_SPI_CS, 21);
-  SPI.setDataMode(ETHERNET_SHIELD_SPI_CS, SPI_MODE0);
-#endif
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  writeMR(1<<RST);
-  writeTMSR(0x55);
-  writeRMSR(0x55);
-  SPI.endTransaction();
+  // Nothing is serviced until the chip has been found and set up again
+  irqEnabled = false;
+  transport->begin();
+  // Always look for the chip at the conservative clock
+  uint32_t clock = spiClock;
+  setSPIClock(ETHERNET_SPI_CLOCK);
+
+  beginTransaction();
+  // The W5200 and W5500 are probed first: their frames are harmless to a
+  // W5100, while a W5100 frame can look like a valid W5500 write.
+  if (isW5200() || isW5500()) {
+    sockets = MAX_SOCK_NUM < 8 ? MAX_SOCK_NUM : 8;
+  } else if (isW5100()) {
+    sockets = MAX_SOCK_NUM < 4 ? MAX_SOCK_NUM : 4;
+  } else {
+    chip = 0;
+    sockets = 0;
+    endTransaction();
+    setSPIClock(clock);
+    return 0;
+  }
+  setupMemory();
+  if (irqPin >= 0)
+    enableInterrupts();
+  endTransaction();
+
+  if (irqPin >= 0) {
+    void (*handler)(void) = attachSlot();
+    if (handler) {
+      irqEnabled = true;
+      transport->attachInterrupt(irqPin, handler);
+      // Anything raised before the handler was attached left INT low
+      serviceInterrupt();
+    }
+  }
+
+  if (calibrationLimit)
+    calibrateSPIClock(calibrationLimit);
+  else
+    setSPIClock(clock);
+  return 1;
+}
 
+uint8_t W5100Class::setSocketMemory(const uint8_t *tx_kb, const uint8_t *rx_kb)
+{
   for (int i=0; i<MAX_SOCK_NUM; i++) {
-    SBASE[i] = TXBUF_BASE + SSIZE * i;
-    RBASE[i] = RXBUF_BASE + RSIZE * i;
+    if (!validBufferSize(tx_kb[i]) || !validBufferSize(rx_kb[i]))
+      return 0;
+  }
+  memcpy(txKB, tx_kb, MAX_SOCK_NUM);
+  memcpy(rxKB, rx_kb, MAX_SOCK_NUM);
+  return 1;
+}
+
+void W5100Class::setupMemory(void)
+{
+  // The W5100 shares 8K per direction between its sockets, the W5200 and
+  // W5500 16K.  A layout that does not fit falls back to 2K per socket.
+  uint8_t total = (chip == 51) ? 8 : 16;
+  uint8_t txsum = 0, rxsum = 0;
+  for (int i=0; i<sockets; i++) {
+    txsum += txKB[i] ? txKB[i] : 2;
+    rxsum += rxKB[i] ? rxKB[i] : 2;
+  }
+  uint8_t fits = (txsum <= total) && (rxsum <= total);
+
+  uint16_t txbase = (chip == 51) ? TXBUF_BASE : TXBUF_BASE_W5200;
+  uint16_t rxbase = (chip == 51) ? RXBUF_BASE : RXBUF_BASE_W5200;
+  uint8_t tmsr = 0, rmsr = 0;
+  for (int i=0; i<8; i++) {
+    uint8_t tx = 0, rx = 0;
+    if (i < sockets) {
+      tx = (fits && txKB[i]) ? txKB[i] : 2;
+      rx = (fits && rxKB[i]) ? rxKB[i] : 2;
+      SSIZE[i] = tx << 10;
+      RSIZE[i] = rx << 10;
+      // The W5500 addresses each socket buffer as its own block
+      SBASE[i] = (chip == 55) ? 0 : txbase;
+      RBASE[i] = (chip == 55) ? 0 : rxbase;
+      txbase += SSIZE[i];
+      rxbase += RSIZE[i];
+      // W5100 TMSR/RMSR: two bits per socket, 1K << n
+      tmsr |= sizeCode(tx) << (2 * i);
+      rmsr |= sizeCode(rx) << (2 * i);
+    } else if (i < MAX_SOCK_NUM) {
+      // Sockets the chip lacks have no buffers
+      SSIZE[i] = RSIZE[i] = 0;
+      SBASE[i] = RBASE[i] = 0;
+    }
+    if (chip != 51) {
+      // Unused sockets give up their memory
+      writeSnTX_SIZE(i, tx);
+      writeSnRX_SIZE(i, rx);
+    }
+  }
+  if (chip == 51) {
+    writeTMSR(tmsr);
+    writeRMSR(rmsr);
+  }
+}
+
+void W5100Class::setSPIClock(uint32_t clock)
+{
+  spiClock = clock;
+  transport->setClock(clock);
+}
+
+uint32_t W5100Class::calibrateSPIClock(uint32_t maxClock)
+{
+  uint8_t passed = 0;
+
+  if (chip == 0)
+    return spiClock;
+
+  // Stop at the first failure; faster rates are not going to do better
+  for (uint8_t i=0; i<SPI_CLOCK_STEPS && spi_clocks[i] <= maxClock; i++) {
+    if (!testSPIClock(spi_clocks[i]))
+      break;
+    passed = i + 1;
+  }
+
+  // Keep one step of margin below the fastest rate that passed
+  if (passed > 1)
+    setSPIClock(spi_clocks[passed - 2]);
+  else
+    setSPIClock(ETHERNET_SPI_CLOCK);
+  return spiClock;
+}
+
+uint8_t W5100Class::testSPIClock(uint32_t clock)
+{
+  uint8_t out[SPI_TEST_SIZE];
+  uint8_t in[SPI_TEST_SIZE];
+  SOCKET s = sockets - 1;
+  uint8_t ok = 1;
+
+  setSPIClock(clock);
+  beginTransaction();
+  for (uint8_t pass=0; pass<SPI_TEST_PASSES && ok; pass++) {
+    // Solid, alternating and address dependent patterns
+    for (uint8_t i=0; i<SPI_TEST_SIZE; i++) {
+      switch (pass) {
+      case 0:  out[i] = (i & 1) ? 0xFF : 0x00; break;
+      case 1:  out[i] = (i & 1) ? 0xAA : 0x55; break;
+      case 2:  out[i] = 1 << (i & 7); break;
+      default: out[i] = i * 37 + 11; break;
+      }
+    }
+    if (chip == 55) {
+      writeW5500(W5500_TXBUF(s) | W5500_WRITE, 0, out, SPI_TEST_SIZE);
+      readW5500(W5500_TXBUF(s), 0, in, SPI_TEST_SIZE);
+    } else {
+      write(SBASE[s], out, SPI_TEST_SIZE);
+      read(SBASE[s], in, SPI_TEST_SIZE);
+    }
+    ok = memcmp(out, in, SPI_TEST_SIZE) == 0;
+  }
+  endTransaction();
+  return ok;
+}
+
+uint8_t W5100Class::softReset(void)
+{
+  writeMR(1<<RST);
+  // The reset bit clears itself once the chip is ready
+  for (uint8_t count=0; count<20; count++) {
+    if (readMR() == 0) {
+      resetShadow();
+      cmdPending = 0;
+      return 1;
+    }
+    delay(1);
+  }
+  return 0;
+}
+
+void W5100Class::resetShadow(void)
+{
+  // Nothing is trusted until the library writes it again
+  shadowValidGAR = 0;
+  shadowValidSUBR = 0;
+  shadowValidSHAR = 0;
+  shadowValidSIPR = 0;
+  shadowValidSnMR = 0;
+  shadowValidSnPORT = 0;
+  shadowValidSnDIPR = 0;
+  shadowValidSnDPORT = 0;
+}
+
+#if defined(ETHERNET_VERIFY_SHADOW)
+void W5100Class::verifyShadow(uint16_t _addr, uint8_t *_buf, uint16_t _len)
+{
+  uint8_t chipbuf[6];
+  read(_addr, chipbuf, _len);
+  if (memcmp(chipbuf, _buf, _len) != 0) {
+    shadowErrors++;
+    memcpy(_buf, chipbuf, _len);
+  }
+}
+#endif
+
+uint8_t W5100Class::isW5100(void)
+{
+  chip = 51;
+  CH_BASE = 0x0400;
+  if (!softReset()) return 0;
+  writeMR(0x10);
+  if (readMR() != 0x10) return 0;
+  writeMR(0x12);
+  if (readMR() != 0x12) return 0;
+  writeMR(0x00);
+  if (readMR() != 0x00) return 0;
+  return 1;
+}
+
+uint8_t W5100Class::isW5200(void)
+{
+  chip = 52;
+  CH_BASE = 0x4000;
+  if (!softReset()) return 0;
+  if (readVERSIONR_W5200() != 3) return 0;
+  return 1;
+}
+
+uint8_t W5100Class::isW5500(void)
+{
+  chip = 55;
+  CH_BASE = 0x1000;
+  if (!softReset()) return 0;
+  writeMR(0x08);
+  if (readMR() != 0x08) return 0;
+  writeMR(0x10);
+  if (readMR() != 0x10) return 0;
+  writeMR(0x00);
+  if (readMR() != 0x00) return 0;
+  if (readVERSIONR_W5500() != 4) return 0;
+  return 1;
+}
+
+void W5100Class::enableInterrupts(void)
+{
+  // Only the socket interrupts; SnIR events are what the socket layer waits on
+  uint8_t mask = (1 << sockets) - 1;
+  if (chip == 51)
+    writeIMR(mask);
+  else if (chip == 52)
+    writeIMR_W5200(mask);
+  else
+    writeSIMR_W5500(mask);
+  for (SOCKET s=0; s<MAX_SOCK_NUM; s++)
+    events[s].tail = events[s].head;
+}
+
+uint8_t W5100Class::readSocketIR(void)
+{
+  if (chip == 51)
+    return readIR() & 0x0F;
+  if (chip == 52)
+    return readIR2_W5200();
+  return readSIR_W5500();
+}
+
+void (*W5100Class::attachSlot(void))(void)
+{
+  uint8_t slot = IRQ_SLOTS;
+  for (uint8_t i=0; i<IRQ_SLOTS; i++) {
+    if (irqChip[i] == this) {
+      slot = i;
+      break;
+    }
+    if (irqChip[i] == NULL && slot == IRQ_SLOTS)
+      slot = i;
+  }
+  if (slot == IRQ_SLOTS)
+    return NULL;
+  irqChip[slot] = this;
+  switch (slot) {
+  case 0:  return irqSlot<0>;
+  case 1:  return irqSlot<1>;
+  case 2:  return irqSlot<2>;
+  default: return irqSlot<3>;
+  }
+}
+
+void W5100Class::isr(void)
+{
+  // The main code holds the bus: endTransaction() services the interrupt.
+  // With threads the handler cannot take the lock, so it always defers.
+  if (ETHERNET_THREADS || busDepth) {
+    irqPending = 1;
+    return;
+  }
+  serviceInterrupt();
+}
+
+void W5100Class::serviceInterrupt(void)
+{
+  if (!irqEnabled) {
+    irqPending = 0;
+    return;
+  }
+  beginTransaction();
+  // Cleared with the bus held; an interrupt after this is still in SnIR
+  irqPending = 0;
+  // INT is only released, and can fall again, once every SnIR is clear
+  uint8_t sir;
+  while ((sir = readSocketIR()) != 0) {
+    for (SOCKET s=0; s<sockets; s++) {
+      if (sir & (1 << s)) {
+        uint8_t ir = readSnIR(s);
+        writeSnIR(s, ir);
+        pushEvent(s, ir);
+      }
+    }
+  }
+  endTransaction();
+}
+
+void W5100Class::pushEvent(SOCKET s, uint8_t ir)
+{
+  EventQueue &q = events[s];
+  uint8_t head = q.head;
+  if ((uint8_t)(head - q.tail) < ETHERNET_EVENT_QUEUE) {
+    q.ir[head & (ETHERNET_EVENT_QUEUE - 1)] = ir;
+    q.head = head + 1;
+  } else {
+    // Full: the reader cannot be at the newest entry, and events are flags,
+    // so merge them into it
+    q.ir[(head - 1) & (ETHERNET_EVENT_QUEUE - 1)] |= ir;
   }
 }
 
+uint8_t W5100Class::takeEvents(SOCKET s)
+{
+  // Deferred by a session that is still open
+  if (irqPending)
+    serviceInterrupt();
+  EventQueue &q = events[s];
+  uint8_t ir = 0;
+  uint8_t tail = q.tail;
+  while (tail != q.head) {
+    ir |= q.ir[tail & (ETHERNET_EVENT_QUEUE - 1)];
+    q.tail = ++tail;
+  }
+  return ir;
+}
+
 uint16_t W5100Class::getTXFreeSize(SOCKET s)
 {
   uint16_t val=0, val1=0;
+  waitCmdSn(s);
   do {
     val1 = readSnTX_FSR(s);
     if (val1 != 0)
@@ -62,6 +459,7 @@ uint16_t W5100Class::getTXFreeSize(SOCKET s)
 uint16_t W5100Class::getRXReceivedSize(SOCKET s)
 {
   uint16_t val=0,val1=0;
+  waitCmdSn(s);
   do {
     val1 = readSnRX_RSR(s);
     if (val1 != 0)
@@ -80,30 +478,43 @@ void W5100Class::send_data_processing(SOCKET s, const uint8_t *data, uint16_t le
 
 void W5100Class::send_data_processing_offset(SOCKET s, uint16_t data_offset, const uint8_t *data, uint16_t len)
 {
+  waitCmdSn(s);
   uint16_t ptr = readSnTX_WR(s);
   ptr += data_offset;
-  uint16_t offset = ptr & SMASK;
+  write_data(s, ptr, data, len);
+  ptr += len;
+  writeSnTX_WR(s, ptr);
+}
+
+void W5100Class::write_data(SOCKET s, uint16_t dst, const uint8_t *src, uint16_t len)
+{
+  if (chip == 55)
+  {
+    // The W5500 wraps the pointer within the socket's buffer itself
+    writeW5500(W5500_TXBUF(s) | W5500_WRITE, dst, src, len);
+    return;
+  }
+
+  uint16_t offset = dst & (SSIZE[s] - 1);
   uint16_t dstAddr = offset + SBASE[s];
 
-  if (offset + len > SSIZE) 
+  if (offset + len > SSIZE[s]) 
   {
     // Wrap around circular buffer
-    uint16_t size = SSIZE - offset;
-    write(dstAddr, data, size);
-    write(SBASE[s], data + size, len - size);
+    uint16_t size = SSIZE[s] - offset;
+    write(dstAddr, src, size);
+    write(SBASE[s], src + size, len - size);
   } 
   else {
-    write(dstAddr, data, len);
+    write(dstAddr, src, len);
   }
-
-  ptr += len;
-  writeSnTX_WR(s, ptr);
 }
 
 
 void W5100Class::recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uint8_t peek)
 {
   uint16_t ptr;
+  waitCmdSn(s);
   ptr = readSnRX_RD(s);
   read_data(s, ptr, data, len);
   if (!peek)
@@ -113,18 +524,36 @@ void W5100Class::recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uin
   }
 }
 
+void W5100Class::recv_data_skip(SOCKET s, uint16_t len)
+{
+  waitCmdSn(s);
+  writeSnRX_RD(s, readSnRX_RD(s) + len);
+}
+
+void W5100Class::recv_data_processing_offset(SOCKET s, uint16_t data_offset, uint8_t *data, uint16_t len)
+{
+  waitCmdSn(s);
+  read_data(s, readSnRX_RD(s) + data_offset, data, len);
+}
+
 void W5100Class::read_data(SOCKET s, volatile uint16_t src, volatile uint8_t *dst, uint16_t len)
 {
   uint16_t size;
   uint16_t src_mask;
   uint16_t src_ptr;
 
-  src_mask = src & RMASK;
+  if (chip == 55)
+  {
+    readW5500(W5500_RXBUF(s), src, (uint8_t *)dst, len);
+    return;
+  }
+
+  src_mask = src & (RSIZE[s] - 1);
   src_ptr = RBASE[s] + src_mask;
 
-  if( (src_mask + len) > RSIZE ) 
+  if( (src_mask + len) > RSIZE[s] ) 
   {
-    size = RSIZE - src_mask;
+    size = RSIZE[s] - src_mask;
     read(src_ptr, (uint8_t *)dst, size);
     dst += size;
     read(RBASE[s], (uint8_t *) dst, len - size);
@@ -133,93 +562,248 @@ void W5100Class::read_data(SOCKET s, volatile uint16_t src, volatile uint8_t *ds
     read(src_ptr, (uint8_t *) dst, len);
 }
 
+void W5100Class::asyncChain(void *arg)
+{
+  W5100Class *w = (W5100Class *)arg;
+  AsyncSegment &next = w->next;
+  // Called with the bus still held, so the second frame can start at once
+  if (next.rx)
+    w->transport->readAsync(next.hdr, next.hdrlen, next.rx, next.len, next.done, next.arg);
+  else
+    w->transport->writeAsync(next.hdr, next.hdrlen, next.tx, next.len, next.done, next.arg);
+}
+
+void W5100Class::read_data_async(SOCKET s, uint16_t src, uint8_t *dst, uint16_t len, EthernetTransport::Callback done, void *arg)
+{
+  uint8_t hdr[4];
+
+  if (chip == 55)
+  {
+    hdr[0] = src >> 8;
+    hdr[1] = src & 0xFF;
+    hdr[2] = W5500_RXBUF(s);
+    transport->readAsync(hdr, 3, dst, len, done, arg);
+    return;
+  }
+  if ((chip == 51 && !transport->autoIncrement()) || len == 0)
+  {
+    // One frame per byte leaves nothing to hand to a DMA controller
+    read_data(s, src, dst, len);
+    if (done)
+      done(arg);
+    return;
+  }
+
+  uint16_t offset = src & (RSIZE[s] - 1);
+  uint16_t size = len;
+  next.len = 0;
+  if (offset + len > RSIZE[s])
+  {
+    size = RSIZE[s] - offset;
+    next.hdrlen = header(next.hdr, RBASE[s], len - size, 0);
+    next.rx = dst + size;
+    next.tx = NULL;
+    next.len = len - size;
+    next.done = done;
+    next.arg = arg;
+  }
+  uint8_t hdrlen = header(hdr, RBASE[s] + offset, size, 0);
+  if (next.len)
+    transport->readAsync(hdr, hdrlen, dst, size, asyncChain, this);
+  else
+    transport->readAsync(hdr, hdrlen, dst, size, done, arg);
+}
+
+void W5100Class::write_data_async(SOCKET s, uint16_t dst, const uint8_t *src, uint16_t len, EthernetTransport::Callback done, void *arg)
+{
+  uint8_t hdr[4];
+
+  if (chip == 55)
+  {
+    hdr[0] = dst >> 8;
+    hdr[1] = dst & 0xFF;
+    hdr[2] = W5500_TXBUF(s) | W5500_WRITE;
+    transport->writeAsync(hdr, 3, src, len, done, arg);
+    return;
+  }
+  if ((chip == 51 && !transport->autoIncrement()) || len == 0)
+  {
+    write_data(s, dst, src, len);
+    if (done)
+      done(arg);
+    return;
+  }
+
+  uint16_t offset = dst & (SSIZE[s] - 1);
+  uint16_t size = len;
+  next.len = 0;
+  if (offset + len > SSIZE[s])
+  {
+    size = SSIZE[s] - offset;
+    next.hdrlen = header(next.hdr, SBASE[s], len - size, 1);
+    next.rx = NULL;
+    next.tx = src + size;
+    next.len = len - size;
+    next.done = done;
+    next.arg = arg;
+  }
+  uint8_t hdrlen = header(hdr, SBASE[s] + offset, size, 1);
+  if (next.len)
+    transport->writeAsync(hdr, hdrlen, src, size, asyncChain, this);
+  else
+    transport->writeAsync(hdr, hdrlen, src, size, done, arg);
+}
+
 
 uint8_t W5100Class::write(uint16_t _addr, uint8_t _data)
 {
-#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
-  setSS();  
-  SPI.transfer(0xF0);
-  SPI.transfer(_addr >> 8);
-  SPI.transfer(_addr & 0xFF);
-  SPI.transfer(_data);
-  resetSS();
-#else
-  SPI.transfer(ETHERNET_SHIELD_SPI_CS, 0xF0, SPI_CONTINUE);
-  SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr >> 8, SPI_CONTINUE);
-  SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr & 0xFF, SPI_CONTINUE);
-  SPI.transfer(ETHERNET_SHIELD_SPI_CS, _data);
-#endif
-  return 1;
+  return write(_addr, &_data, 1);
 }
 
 uint16_t W5100Class::write(uint16_t _addr, const uint8_t *_buf, uint16_t _len)
 {
+  uint8_t hdr[4];
+
+  if (_len == 0)
+    return 0;
+
+  if (chip == 55)
+  {
+    // Common registers live in block 0, socket registers are mapped from
+    // CH_BASE + s * CH_SIZE onto the socket's register block
+    uint8_t ctrl = (_addr < CH_BASE) ? W5500_COMMON : W5500_SOCKET((_addr - CH_BASE) >> 8);
+    return writeW5500(ctrl | W5500_WRITE, _addr & 0xFF, _buf, _len);
+  }
+
+  if (chip == 52 || transport->autoIncrement())
+  {
+    // One header covers the whole burst: address, write flag and length
+    transport->write(hdr, header(hdr, _addr, _len, 1), _buf, _len);
+    return _len;
+  }
+
+  // The W5100 needs a complete frame for every byte over SPI
+  hdr[0] = 0xF0;
   for (uint16_t i=0; i<_len; i++)
   {
-#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
-    setSS();    
-    SPI.transfer(0xF0);
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    _addr++;
-    SPI.transfer(_buf[i]);
-    resetSS();
-#else
-    SPI.transfer(ETHERNET_SHIELD_SPI_CS, 0xF0, SPI_CONTINUE);
-    SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr >> 8, SPI_CONTINUE);
-    SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr & 0xFF, SPI_CONTINUE);
-    SPI.transfer(ETHERNET_SHIELD_SPI_CS, _buf[i]);
+    hdr[1] = _addr >> 8;
+    hdr[2] = _addr & 0xFF;
+    transport->write(hdr, 3, &_buf[i], 1);
     _addr++;
-#endif
   }
   return _len;
 }
 
 uint8_t W5100Class::read(uint16_t _addr)
 {
-#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
-  setSS();  
-  SPI.transfer(0x0F);
-  SPI.transfer(_addr >> 8);
-  SPI.transfer(_addr & 0xFF);
-  uint8_t _data = SPI.transfer(0);
-  resetSS();
-#else
-  SPI.transfer(ETHERNET_SHIELD_SPI_CS, 0x0F, SPI_CONTINUE);
-  SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr >> 8, SPI_CONTINUE);
-  SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr & 0xFF, SPI_CONTINUE);
-  uint8_t _data = SPI.transfer(ETHERNET_SHIELD_SPI_CS, 0);
-#endif
+  uint8_t _data = 0;
+  read(_addr, &_data, 1);
   return _data;
 }
 
 uint16_t W5100Class::read(uint16_t _addr, uint8_t *_buf, uint16_t _len)
 {
+  uint8_t hdr[4];
+
+  if (_len == 0)
+    return 0;
+
+  if (chip == 55)
+  {
+    uint8_t ctrl = (_addr < CH_BASE) ? W5500_COMMON : W5500_SOCKET((_addr - CH_BASE) >> 8);
+    return readW5500(ctrl, _addr & 0xFF, _buf, _len);
+  }
+
+  if (chip == 52 || transport->autoIncrement())
+  {
+    transport->read(hdr, header(hdr, _addr, _len, 0), _buf, _len);
+    return _len;
+  }
+
+  hdr[0] = 0x0F;
   for (uint16_t i=0; i<_len; i++)
   {
-#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
-    setSS();
-    SPI.transfer(0x0F);
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
+    hdr[1] = _addr >> 8;
+    hdr[2] = _addr & 0xFF;
+    transport->read(hdr, 3, &_buf[i], 1);
     _addr++;
-    _buf[i] = SPI.transfer(0);
-    resetSS();
-#else
-    SPI.transfer(ETHERNET_SHIELD_SPI_CS, 0x0F, SPI_CONTINUE);
-    SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr >> 8, SPI_CONTINUE);
-    SPI.transfer(ETHERNET_SHIELD_SPI_CS, _addr & 0xFF, SPI_CONTINUE);
-    _buf[i] = SPI.transfer(ETHERNET_SHIELD_SPI_CS, 0);
-    _addr++;
-#endif
   }
   return _len;
 }
 
-void W5100Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+uint8_t W5100Class::header(uint8_t *_hdr, uint16_t _addr, uint16_t _len, uint8_t _write)
+{
+  if (chip == 51)
+  {
+    // Op code and start address; only auto-incrementing transports take
+    // more than one data byte after it
+    _hdr[0] = _write ? 0xF0 : 0x0F;
+    _hdr[1] = _addr >> 8;
+    _hdr[2] = _addr & 0xFF;
+    return 3;
+  }
+  _hdr[0] = _addr >> 8;
+  _hdr[1] = _addr & 0xFF;
+  _hdr[2] = (_write ? 0x80 : 0) | ((_len >> 8) & 0x7F);
+  _hdr[3] = _len & 0xFF;
+  return 4;
+}
+
+uint16_t W5100Class::writeW5500(uint8_t _ctrl, uint16_t _addr, const uint8_t *_buf, uint16_t _len)
+{
+  uint8_t hdr[3] = { (uint8_t)(_addr >> 8), (uint8_t)(_addr & 0xFF), _ctrl };
+  transport->write(hdr, 3, _buf, _len);
+  return _len;
+}
+
+uint16_t W5100Class::readW5500(uint8_t _ctrl, uint16_t _addr, uint8_t *_buf, uint16_t _len)
+{
+  uint8_t hdr[3] = { (uint8_t)(_addr >> 8), (uint8_t)(_addr & 0xFF), _ctrl };
+  transport->read(hdr, 3, _buf, _len);
+  return _len;
+}
+
+void W5100Class::issueCmdSn(SOCKET s, SockCMD _cmd) {
+  // The chip takes one command at a time per socket
+  waitCmdSn(s);
+  // A listening socket gets its destination from whoever connects
+  if (_cmd == Sock_LISTEN) {
+    shadowValidSnDIPR &= ~(1 << s);
+    shadowValidSnDPORT &= ~(1 << s);
+  }
   // Send command to socket
   writeSnCR(s, _cmd);
-  // Wait for command to complete
-  while (readSnCR(s))
-    ;
+  cmdPending |= 1 << s;
+}
+
+uint8_t W5100Class::cmdDoneSn(SOCKET s) {
+  if (!(cmdPending & (1 << s)))
+    return 1;
+  if (readSnCR(s))
+    return 0;
+  cmdPending &= ~(1 << s);
+  return 1;
+}
+
+uint8_t W5100Class::waitCmdSn(SOCKET s, unsigned long timeout) {
+  if (cmdDoneSn(s))
+    return 1;
+  // Commands are normally taken within a few bus cycles; only yield once
+  // one has taken longer than a millisecond
+  unsigned long start = millis();
+  while (!cmdDoneSn(s)) {
+    unsigned long elapsed = millis() - start;
+    if (elapsed >= timeout) {
+      cmdPending &= ~(1 << s);
+      return 0;
+    }
+    if (elapsed)
+      yield();
+  }
+  return 1;
+}
+
+uint8_t W5100Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+  issueCmdSn(s, _cmd);
+  return waitCmdSn(s);
 }
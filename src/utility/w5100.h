@@ -10,18 +10,93 @@
 #ifndef	W5100_H_INCLUDED
 #define	W5100_H_INCLUDED
 
-#include <SPI.h>
+#include <string.h>
 
-#define ETHERNET_SHIELD_SPI_CS 10
+#include "transport.h"
+#include "lock.h"
 
+// The W5100 has 4 hardware sockets, the W5200 and W5500 have 8.  Boards
+// with 2K of RAM or less keep to 4 to save the per-socket bookkeeping.
+// Every per-socket table is sized from this one count; lower it to use
+// fewer sockets than the chip has and save their RAM.
+#ifndef MAX_SOCK_NUM
+#if defined(RAMEND) && defined(RAMSTART) && ((RAMEND - RAMSTART) <= 2048)
 #define MAX_SOCK_NUM 4
+#else
+#define MAX_SOCK_NUM 8
+#endif
+#endif
+
+#if MAX_SOCK_NUM > 8
+#error "MAX_SOCK_NUM can be at most 8"
+#endif
+
+// 1 to run interfaces on more than one controller, each EthernetClass on
+// its own W5100Class.  With 0, on boards by default, Ethernet and every
+// client, server and UDP socket are bound to W5100 at compile time and
+// reach it without going through a pointer.
+#ifndef ETHERNET_MULTI_CHIP
+#if defined(ARDUINO)
+#define ETHERNET_MULTI_CHIP 0
+#else
+#define ETHERNET_MULTI_CHIP 1
+#endif
+#endif
+
+// Socket events queued per socket between the interrupt handler and the
+// socket layer; a power of two
+#ifndef ETHERNET_EVENT_QUEUE
+#define ETHERNET_EVENT_QUEUE 4
+#endif
+
+#if ETHERNET_EVENT_QUEUE < 2 || (ETHERNET_EVENT_QUEUE & (ETHERNET_EVENT_QUEUE - 1))
+#error "ETHERNET_EVENT_QUEUE must be a power of two, at least 2"
+#endif
+
+// Bytes of RAM read-ahead every TCP socket starts with, 0 for none.  Costs
+// MAX_SOCK_NUM times as much RAM per controller.  A client can also be given
+// a buffer of its own with EthernetClient::setReadBuffer().
+#ifndef ETHERNET_READ_AHEAD
+#define ETHERNET_READ_AHEAD 0
+#endif
+
+// Bytes of stack read-ahead lent to a socket without one while Stream's
+// parsers, such as parseInt(), read from it a byte at a time
+#ifndef ETHERNET_PARSE_AHEAD
+#if defined(__AVR__)
+#define ETHERNET_PARSE_AHEAD 32
+#else
+#define ETHERNET_PARSE_AHEAD 128
+#endif
+#endif
+
+// Longest wait, in ms, for the chip to take a socket command
+#ifndef ETHERNET_CMD_TIMEOUT
+#define ETHERNET_CMD_TIMEOUT 100
+#endif
+
+// Uncomment to check every read served from the register shadow against the
+// chip.  Mismatches are counted in W5100Class::shadowErrors and the chip's
+// value is returned.
+//#define ETHERNET_VERIFY_SHADOW
 
 typedef uint8_t SOCKET;
 
+// One piece of a payload gathered from several buffers by the
+// scatter-gather writes
+struct EthernetIovec {
+  const uint8_t *data;
+  uint16_t len;
+};
+
 #define IDM_OR  0x8000
 #define IDM_AR0 0x8001
 #define IDM_AR1 0x8002
 #define IDM_DR  0x8003
+// MR bits behind indirect mode: reset, address auto-increment, indirect bus
+#define IDM_MR_RST 0x80
+#define IDM_MR_AI  0x02
+#define IDM_MR_IND 0x01
 /*
 class MR {
 public:
@@ -127,10 +202,124 @@ public:
   static const uint8_t RAW  = 255;
 };
 
+/**
+ * @brief	One Ethernet controller.  W5100 drives the one behind EthernetSPI;
+ *        further controllers are further instances, each given its own
+ *        transport (e.g. an EthernetSPITransport on another chip select).
+ */
 class W5100Class {
 
 public:
-  void init();
+  W5100Class();
+  W5100Class(EthernetTransport &t);
+
+  /**
+   * @brief	Reset the controller, detect whether it is a W5100, W5200 or W5500
+   *        and set up the socket buffer memory.
+   * @return	1 if a supported chip was found, else 0.
+   */
+  uint8_t init();
+
+  /**
+   * @brief	The detected controller: 51, 52 or 55 (W5100, W5200, W5500), or 0
+   *        if init() has not found a chip.
+   */
+  inline uint8_t getChip() { return chip; }
+
+  /**
+   * @brief	Number of sockets usable on the detected chip, at most MAX_SOCK_NUM.
+   */
+  inline uint8_t getSocketCount() { return sockets; }
+
+  /**
+   * @brief	Set the SPI clock used for all following chip accesses.  Use this
+   *        to restore a rate saved from an earlier calibrateSPIClock().
+   *        init() detects the chip at ETHERNET_SPI_CLOCK, then switches here.
+   */
+  void setSPIClock(uint32_t clock);
+  inline uint32_t getSPIClock() { return spiClock; }
+
+  /**
+   * @brief	Make init() run calibrateSPIClock(maxClock) after it has reset the
+   *        chip.  0, the default, turns calibration off.
+   */
+  inline void setSPICalibration(uint32_t maxClock) { calibrationLimit = maxClock; }
+
+  /**
+   * @brief	Find the fastest SPI clock, up to maxClock, at which test patterns
+   *        written to socket buffer memory read back intact, and use the rate
+   *        one step below it.  Overwrites the Tx buffer of the last socket, so
+   *        only call this while that socket is closed.
+   * @return	The SPI clock now in use.
+   */
+  uint32_t calibrateSPIClock(uint32_t maxClock);
+
+  /**
+   * @brief	Choose the Tx and Rx buffer size of every socket, in K.  tx_kb and
+   *        rx_kb hold MAX_SOCK_NUM entries of 1, 2, 4 or 8.  Each direction
+   *        has 8K in total on the W5100 and 16K on the W5200/W5500; a layout
+   *        that does not fit the detected chip falls back to 2K per socket.
+   *        The layout is applied by the next init(), so call this before
+   *        Ethernet.begin().
+   * @return	1 if every size is valid, else 0 and the layout is unchanged.
+   */
+  uint8_t setSocketMemory(const uint8_t *tx_kb, const uint8_t *rx_kb);
+
+  /**
+   * @brief	Use t for all chip accesses instead of EthernetSPI.  Call this
+   *        before init(); the transport's begin() is called from there.
+   */
+  inline void setTransport(EthernetTransport &t) { transport = &t; }
+  inline EthernetTransport *getTransport() { return transport; }
+
+  /**
+   * @brief	Take socket events from the chip's INT pin, wired to the board pin
+   *        pin, instead of polling the socket interrupt registers.  init()
+   *        unmasks the socket interrupts and attaches the handler, so call
+   *        this before Ethernet.begin().  -1, the default, polls.
+   */
+  inline void setInterruptPin(int8_t pin) { irqPin = pin; }
+  // Controllers that can be in interrupt mode at the same time
+  static const uint8_t IRQ_SLOTS = 4;
+  // true once init() has set up interrupt mode
+  inline bool interruptMode() { return irqEnabled; }
+
+  /**
+   * @brief	Move the SnIR bits of every socket with a pending interrupt into
+   *        its event queue, clearing them on the chip so INT is released.
+   *        Runs from the INT handler, or from endTransaction() when the
+   *        interrupt came while the bus was held.
+   */
+  void serviceInterrupt();
+
+  /**
+   * @brief	The SnIR bits queued for socket s since the last call, ORed
+   *        together.  Lock-free against the interrupt handler, which is the
+   *        only writer of the queue.
+   */
+  uint8_t takeEvents(SOCKET s);
+
+  // Claim and release the bus around a group of chip accesses.  Calls nest:
+  // only the outermost pair reaches the transport.  An interrupt that
+  // arrives in between is serviced once the bus is released.  With
+  // ETHERNET_THREADS other tasks wait here until the outermost pair ends.
+  inline void beginTransaction() {
+    busLock.lock();
+    if (busDepth++ == 0)
+      transport->beginTransaction();
+  }
+  inline void endTransaction() {
+    if (busDepth != 1) {
+      busDepth--;
+      busLock.unlock();
+      return;
+    }
+    transport->endTransaction();
+    busDepth = 0;
+    if (irqPending)
+      serviceInterrupt();
+    busLock.unlock();
+  }
 
   /**
    * @brief	This function is being used for copy the data form Receive buffer of the chip to application buffer.
@@ -170,6 +359,40 @@ public:
    */
   void recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uint8_t peek = 0);
 
+  /**
+   * @brief	Drop len received bytes by moving the Rx read pointer past them,
+   *        without reading the data.  The caller issues Sock_RECV.
+   */
+  void recv_data_skip(SOCKET s, uint16_t len);
+
+  /**
+   * @brief	Copy len bytes, starting data_offset bytes past the Rx read pointer, from the
+   *        Receive buffer.  The Rx read pointer is not updated.
+   */
+  void recv_data_processing_offset(SOCKET s, uint16_t data_offset, uint8_t *data, uint16_t len);
+
+  /**
+   * @brief	Copy len bytes into the Transmit buffer of socket s, starting at
+   *        the buffer pointer dst (a TX_WR style value).  Wrap-around at the
+   *        end of the socket's buffer is handled here.  TX_WR is not updated.
+   */
+  void write_data(SOCKET s, uint16_t dst, const uint8_t *src, uint16_t len);
+
+  /**
+   * @brief	Background versions of read_data() and write_data(), for
+   *        transports that can move data with DMA.  They return once the
+   *        first frame is started; done(arg) runs when the last one is
+   *        complete, and the caller updates RX_RD/TX_WR from there.  dst and
+   *        src must stay valid until then, and the bus transaction must stay
+   *        open: finish with asyncWait() before endTransaction().  Only one
+   *        background copy can run at a time.
+   */
+  void read_data_async(SOCKET s, uint16_t src, uint8_t *dst, uint16_t len, EthernetTransport::Callback done, void *arg);
+  void write_data_async(SOCKET s, uint16_t dst, const uint8_t *src, uint16_t len, EthernetTransport::Callback done, void *arg);
+  // true while a background copy is running; completes it when polled
+  inline bool asyncBusy() { return transport->poll(); }
+  inline void asyncWait() { while (asyncBusy()) ; }
+
   inline void setGatewayIp(uint8_t *_addr);
   inline void getGatewayIp(uint8_t *_addr);
 
@@ -185,7 +408,29 @@ public:
   inline void setRetransmissionTime(uint16_t timeout);
   inline void setRetransmissionCount(uint8_t _retry);
 
-  void execCmdSn(SOCKET s, SockCMD _cmd);
+  /**
+   * @brief	Write _cmd to Sn_CR and return without waiting for the chip to take
+   *        it, so that other sockets can be served meanwhile.  A command still
+   *        pending on s is waited for first.
+   */
+  void issueCmdSn(SOCKET s, SockCMD _cmd);
+
+  /**
+   * @brief	1 once the last command issued on s has been taken, i.e. Sn_CR
+   *        reads 0.  Costs no bus traffic when nothing is pending.
+   */
+  uint8_t cmdDoneSn(SOCKET s);
+
+  /**
+   * @brief	Wait up to timeout ms for the last command issued on s.  The
+   *        socket's buffer pointers and sizes are only valid again after it.
+   * @return	1 once it is done, 0 if the chip did not take it in time; the
+   *        command is then no longer waited for.
+   */
+  uint8_t waitCmdSn(SOCKET s, unsigned long timeout = ETHERNET_CMD_TIMEOUT);
+
+  // issueCmdSn() followed by waitCmdSn()
+  uint8_t execCmdSn(SOCKET s, SockCMD _cmd);
   
   uint16_t getTXFreeSize(SOCKET s);
   uint16_t getRXReceivedSize(SOCKET s);
@@ -194,106 +439,185 @@ public:
   // W5100 Registers
   // ---------------
 private:
-  static uint8_t write(uint16_t _addr, uint8_t _data);
-  static uint16_t write(uint16_t addr, const uint8_t *buf, uint16_t len);
-  static uint8_t read(uint16_t addr);
-  static uint16_t read(uint16_t addr, uint8_t *buf, uint16_t len);
+  uint8_t write(uint16_t _addr, uint8_t _data);
+  uint16_t write(uint16_t addr, const uint8_t *buf, uint16_t len);
+  uint8_t read(uint16_t addr);
+  uint16_t read(uint16_t addr, uint8_t *buf, uint16_t len);
+
+  // 16-bit registers, high byte first, as one burst
+  inline uint16_t read16(uint16_t _addr) {
+    uint8_t buf[2];
+    read(_addr, buf, 2);
+    return (buf[0] << 8) | buf[1];
+  }
+  inline void write16(uint16_t _addr, uint16_t _data) {
+    uint8_t buf[2] = { (uint8_t)(_data >> 8), (uint8_t)(_data & 0xFF) };
+    write(_addr, buf, 2);
+  }
   
 #define __GP_REGISTER8(name, address)             \
-  static inline void write##name(uint8_t _data) { \
+  inline void write##name(uint8_t _data) {        \
     write(address, _data);                        \
   }                                               \
-  static inline uint8_t read##name() {            \
+  inline uint8_t read##name() {                   \
     return read(address);                         \
   }
 #define __GP_REGISTER16(name, address)            \
-  static void write##name(uint16_t _data) {       \
-    write(address,   _data >> 8);                 \
-    write(address+1, _data & 0xFF);               \
+  inline void write##name(uint16_t _data) {       \
+    write16(address, _data);                      \
   }                                               \
-  static uint16_t read##name() {                  \
-    uint16_t res = read(address);                 \
-    res = (res << 8) + read(address + 1);         \
-    return res;                                   \
+  inline uint16_t read##name() {                  \
+    return read16(address);                       \
   }
 #define __GP_REGISTER_N(name, address, size)      \
-  static uint16_t write##name(uint8_t *_buff) {   \
+  uint16_t write##name(uint8_t *_buff) {          \
     return write(address, _buff, size);           \
   }                                               \
-  static uint16_t read##name(uint8_t *_buff) {    \
+  uint16_t read##name(uint8_t *_buff) {           \
     return read(address, _buff, size);            \
   }
+// Registers that only the library writes are mirrored in RAM, so reading
+// them back costs no bus traffic once they have been set.
+#define __GP_REGISTER_N_SHADOW(name, address, size) \
+  uint16_t write##name(uint8_t *_buff) {          \
+    memcpy(shadow##name, _buff, size);            \
+    shadowValid##name = 1;                        \
+    return write(address, _buff, size);           \
+  }                                               \
+  uint16_t read##name(uint8_t *_buff) {           \
+    if (!shadowValid##name)                       \
+      return read(address, _buff, size);          \
+    memcpy(_buff, shadow##name, size);            \
+    verifyShadow(address, _buff, size);           \
+    return size;                                  \
+  }
 
 public:
   __GP_REGISTER8 (MR,     0x0000);    // Mode
-  __GP_REGISTER_N(GAR,    0x0001, 4); // Gateway IP address
-  __GP_REGISTER_N(SUBR,   0x0005, 4); // Subnet mask address
-  __GP_REGISTER_N(SHAR,   0x0009, 6); // Source MAC address
-  __GP_REGISTER_N(SIPR,   0x000F, 4); // Source IP address
+  __GP_REGISTER_N_SHADOW(GAR,  0x0001, 4); // Gateway IP address
+  __GP_REGISTER_N_SHADOW(SUBR, 0x0005, 4); // Subnet mask address
+  __GP_REGISTER_N_SHADOW(SHAR, 0x0009, 6); // Source MAC address
+  __GP_REGISTER_N_SHADOW(SIPR, 0x000F, 4); // Source IP address
   __GP_REGISTER8 (IR,     0x0015);    // Interrupt
   __GP_REGISTER8 (IMR,    0x0016);    // Interrupt Mask
   __GP_REGISTER16(RTR,    0x0017);    // Timeout address
   __GP_REGISTER8 (RCR,    0x0019);    // Retry count
-  __GP_REGISTER8 (RMSR,   0x001A);    // Receive memory size
-  __GP_REGISTER8 (TMSR,   0x001B);    // Transmit memory size
+  __GP_REGISTER8 (RMSR,   0x001A);    // Receive memory size (W5100 only)
+  __GP_REGISTER8 (TMSR,   0x001B);    // Transmit memory size (W5100 only)
   __GP_REGISTER8 (PATR,   0x001C);    // Authentication type address in PPPoE mode
   __GP_REGISTER8 (PTIMER, 0x0028);    // PPP LCP Request Timer
   __GP_REGISTER8 (PMAGIC, 0x0029);    // PPP LCP Magic Number
   __GP_REGISTER_N(UIPR,   0x002A, 4); // Unreachable IP address in UDP mode
   __GP_REGISTER16(UPORT,  0x002E);    // Unreachable Port address in UDP mode
+  __GP_REGISTER8 (VERSIONR_W5200, 0x001F); // Chip Version (W5200 only)
+  __GP_REGISTER8 (IR2_W5200,      0x0034); // Socket Interrupt (W5200 only)
+  __GP_REGISTER8 (IMR_W5200,      0x0036); // Socket Interrupt Mask (W5200 only)
+  __GP_REGISTER8 (SIR_W5500,      0x0017); // Socket Interrupt (W5500 only)
+  __GP_REGISTER8 (SIMR_W5500,     0x0018); // Socket Interrupt Mask (W5500 only)
+  __GP_REGISTER16(RTR_W5500,      0x0019); // Timeout address (W5500 only)
+  __GP_REGISTER8 (RCR_W5500,      0x001B); // Retry count (W5500 only)
+  __GP_REGISTER8 (PHYCFGR_W5500,  0x002E); // PHY Configuration (W5500 only)
+  __GP_REGISTER8 (VERSIONR_W5500, 0x0039); // Chip Version (W5500 only)
   
 #undef __GP_REGISTER8
 #undef __GP_REGISTER16
 #undef __GP_REGISTER_N
+#undef __GP_REGISTER_N_SHADOW
 
   // W5100 Socket registers
   // ----------------------
 private:
-  static inline uint8_t readSn(SOCKET _s, uint16_t _addr);
-  static inline uint8_t writeSn(SOCKET _s, uint16_t _addr, uint8_t _data);
-  static inline uint16_t readSn(SOCKET _s, uint16_t _addr, uint8_t *_buf, uint16_t len);
-  static inline uint16_t writeSn(SOCKET _s, uint16_t _addr, uint8_t *_buf, uint16_t len);
-
-  static const uint16_t CH_BASE = 0x0400;
+  // Socket registers start at 0x0400 on the W5100 and 0x4000 on the W5200.
+  // The W5500 has no flat address map; 0x1000 + s * CH_SIZE is translated
+  // into the socket's register block by read() and write().
+  uint16_t CH_BASE;
   static const uint16_t CH_SIZE = 0x0100;
 
+public:
+  // Offset of a socket register from CH_BASE: a constant expression when
+  // _s is, so a fixed socket's registers cost one addition of CH_BASE,
+  // which differs between chips and is only known once one is found.
+  static constexpr uint16_t snOffset(SOCKET _s, uint16_t _addr) {
+    return _s * CH_SIZE + _addr;
+  }
+
+private:
+  // Flat address of a socket register
+  inline uint16_t snAddr(SOCKET _s, uint16_t _addr) {
+    return CH_BASE + snOffset(_s, _addr);
+  }
+
 #define __SOCKET_REGISTER8(name, address)                    \
-  static inline void write##name(SOCKET _s, uint8_t _data) { \
-    writeSn(_s, address, _data);                             \
+  inline void write##name(SOCKET _s, uint8_t _data) {        \
+    write(snAddr(_s, address), _data);                       \
   }                                                          \
-  static inline uint8_t read##name(SOCKET _s) {              \
-    return readSn(_s, address);                              \
+  inline uint8_t read##name(SOCKET _s) {                     \
+    return read(snAddr(_s, address));                        \
   }
 #define __SOCKET_REGISTER16(name, address)                   \
-  static void write##name(SOCKET _s, uint16_t _data) {       \
-    writeSn(_s, address,   _data >> 8);                      \
-    writeSn(_s, address+1, _data & 0xFF);                    \
+  inline void write##name(SOCKET _s, uint16_t _data) {       \
+    write16(snAddr(_s, address), _data);                     \
   }                                                          \
-  static uint16_t read##name(SOCKET _s) {                    \
-    uint16_t res = readSn(_s, address);                      \
-    uint16_t res2 = readSn(_s,address + 1);                  \
-    res = res << 8;                                          \
-    res2 = res2 & 0xFF;                                      \
-    res = res | res2;                                        \
-    return res;                                              \
+  inline uint16_t read##name(SOCKET _s) {                    \
+    return read16(snAddr(_s, address));                      \
   }
 #define __SOCKET_REGISTER_N(name, address, size)             \
-  static uint16_t write##name(SOCKET _s, uint8_t *_buff) {   \
-    return writeSn(_s, address, _buff, size);                \
+  uint16_t write##name(SOCKET _s, uint8_t *_buff) {          \
+    return write(snAddr(_s, address), _buff, size);          \
+  }                                                          \
+  uint16_t read##name(SOCKET _s, uint8_t *_buff) {           \
+    return read(snAddr(_s, address), _buff, size);           \
+  }
+// Mirrored socket registers, one valid bit per socket
+#define __SOCKET_REGISTER8_SHADOW(name, address)             \
+  inline void write##name(SOCKET _s, uint8_t _data) {        \
+    shadow##name[_s] = _data;                                \
+    shadowValid##name |= 1 << _s;                            \
+    write(snAddr(_s, address), _data);                       \
+  }                                                          \
+  inline uint8_t read##name(SOCKET _s) {                     \
+    if (!(shadowValid##name & (1 << _s)))                    \
+      return read(snAddr(_s, address));                      \
+    uint8_t _data = shadow##name[_s];                        \
+    verifyShadow(snAddr(_s, address), &_data, 1);            \
+    return _data;                                            \
+  }
+#define __SOCKET_REGISTER16_SHADOW(name, address)            \
+  inline void write##name(SOCKET _s, uint16_t _data) {       \
+    shadow##name[_s] = _data;                                \
+    shadowValid##name |= 1 << _s;                            \
+    write16(snAddr(_s, address), _data);                     \
   }                                                          \
-  static uint16_t read##name(SOCKET _s, uint8_t *_buff) {    \
-    return readSn(_s, address, _buff, size);                 \
+  inline uint16_t read##name(SOCKET _s) {                    \
+    if (!(shadowValid##name & (1 << _s)))                    \
+      return read16(snAddr(_s, address));                    \
+    uint16_t _data = shadow##name[_s];                       \
+    verifyShadow(snAddr(_s, address), _data);                \
+    return _data;                                            \
+  }
+#define __SOCKET_REGISTER_N_SHADOW(name, address, size)      \
+  uint16_t write##name(SOCKET _s, uint8_t *_buff) {          \
+    memcpy(shadow##name[_s], _buff, size);                   \
+    shadowValid##name |= 1 << _s;                            \
+    return write(snAddr(_s, address), _buff, size);          \
+  }                                                          \
+  uint16_t read##name(SOCKET _s, uint8_t *_buff) {           \
+    if (!(shadowValid##name & (1 << _s)))                    \
+      return read(snAddr(_s, address), _buff, size);         \
+    memcpy(_buff, shadow##name[_s], size);                   \
+    verifyShadow(snAddr(_s, address), _buff, size);          \
+    return size;                                             \
   }
   
 public:
-  __SOCKET_REGISTER8(SnMR,        0x0000)        // Mode
+  __SOCKET_REGISTER8_SHADOW(SnMR,  0x0000)        // Mode
   __SOCKET_REGISTER8(SnCR,        0x0001)        // Command
   __SOCKET_REGISTER8(SnIR,        0x0002)        // Interrupt
   __SOCKET_REGISTER8(SnSR,        0x0003)        // Status
-  __SOCKET_REGISTER16(SnPORT,     0x0004)        // Source Port
+  __SOCKET_REGISTER16_SHADOW(SnPORT, 0x0004)      // Source Port
   __SOCKET_REGISTER_N(SnDHAR,     0x0006, 6)     // Destination Hardw Addr
-  __SOCKET_REGISTER_N(SnDIPR,     0x000C, 4)     // Destination IP Addr
-  __SOCKET_REGISTER16(SnDPORT,    0x0010)        // Destination Port
+  __SOCKET_REGISTER_N_SHADOW(SnDIPR, 0x000C, 4)  // Destination IP Addr
+  __SOCKET_REGISTER16_SHADOW(SnDPORT, 0x0010)    // Destination Port
   __SOCKET_REGISTER16(SnMSSR,     0x0012)        // Max Segment Size
   __SOCKET_REGISTER8(SnPROTO,     0x0014)        // Protocol in IP RAW Mode
   __SOCKET_REGISTER8(SnTOS,       0x0015)        // IP TOS
@@ -304,84 +628,198 @@ public:
   __SOCKET_REGISTER16(SnRX_RSR,   0x0026)        // RX Free Size
   __SOCKET_REGISTER16(SnRX_RD,    0x0028)        // RX Read Pointer
   __SOCKET_REGISTER16(SnRX_WR,    0x002A)        // RX Write Pointer (supported?)
+  __SOCKET_REGISTER8(SnRX_SIZE,   0x001E)        // RX Memory Size (W5200/W5500 only)
+  __SOCKET_REGISTER8(SnTX_SIZE,   0x001F)        // TX Memory Size (W5200/W5500 only)
   
 #undef __SOCKET_REGISTER8
 #undef __SOCKET_REGISTER16
 #undef __SOCKET_REGISTER_N
+#undef __SOCKET_REGISTER8_SHADOW
+#undef __SOCKET_REGISTER16_SHADOW
+#undef __SOCKET_REGISTER_N_SHADOW
+
+  // Register shadow
+  // ---------------
+#if defined(ETHERNET_VERIFY_SHADOW)
+public:
+  uint16_t shadowErrors; // Shadow reads that did not match the chip
+private:
+  void verifyShadow(uint16_t _addr, uint8_t *_buf, uint16_t _len);
+  inline void verifyShadow(uint16_t _addr, uint16_t &_data) {
+    uint8_t buf[2] = { (uint8_t)(_data >> 8), (uint8_t)(_data & 0xFF) };
+    verifyShadow(_addr, buf, 2);
+    _data = (buf[0] << 8) | buf[1];
+  }
+#else
+private:
+  inline void verifyShadow(uint16_t, uint8_t *, uint16_t) { }
+  inline void verifyShadow(uint16_t, uint16_t &) { }
+#endif
+  void resetShadow();
+
+  uint8_t shadowGAR[4];
+  uint8_t shadowSUBR[4];
+  uint8_t shadowSHAR[6];
+  uint8_t shadowSIPR[4];
+  uint8_t shadowValidGAR;
+  uint8_t shadowValidSUBR;
+  uint8_t shadowValidSHAR;
+  uint8_t shadowValidSIPR;
+
+  uint8_t shadowSnMR[MAX_SOCK_NUM];
+  uint16_t shadowSnPORT[MAX_SOCK_NUM];
+  uint8_t shadowSnDIPR[MAX_SOCK_NUM][4];
+  uint16_t shadowSnDPORT[MAX_SOCK_NUM];
+  uint8_t shadowValidSnMR;
+  uint8_t shadowValidSnPORT;
+  uint8_t shadowValidSnDIPR;
+  uint8_t shadowValidSnDPORT;
 
 
 private:
   static const uint8_t  RST = 7; // Reset BIT
 
-  static const int SOCKETS = 4;
-  static const uint16_t SMASK = 0x07FF; // Tx buffer MASK
-  static const uint16_t RMASK = 0x07FF; // Rx buffer MASK
-public:
-  static const uint16_t SSIZE = 2048; // Max Tx buffer size
-private:
-  static const uint16_t RSIZE = 2048; // Max Rx buffer size
-  uint16_t SBASE[SOCKETS]; // Tx buffer base address
-  uint16_t RBASE[SOCKETS]; // Rx buffer base address
+  uint8_t cmdPending; // sockets with a command not yet seen taken
+  uint8_t chip;    // 51, 52 or 55 once init() has detected the chip
+  uint8_t sockets; // hardware sockets in use, at most MAX_SOCK_NUM
+
+  uint32_t spiClock;
+  uint32_t calibrationLimit;
+  EthernetTransport *transport;
+
+  uint8_t testSPIClock(uint32_t clock);
+  void setDefaults(EthernetTransport *t);
+
+  // Interrupt mode
+  int8_t irqPin;
+  bool irqEnabled;
+  EthernetLock busLock;         // held from the outermost beginTransaction()
+  volatile uint8_t busDepth;    // nesting of beginTransaction()
+  volatile uint8_t irqPending;  // INT fired while the bus was held
+  void isr();
+  void enableInterrupts();
+  // attachInterrupt() takes plain functions, so each slot has a trampoline
+  static W5100Class *irqChip[IRQ_SLOTS];
+  template <uint8_t N> static void irqSlot() { irqChip[N]->isr(); }
+  // Claim a slot for this controller; NULL when all are taken
+  void (*attachSlot())(void);
+  uint8_t readSocketIR();
+
+  // Single producer (the interrupt handler), single consumer (the socket
+  // layer): only the producer moves head, only the consumer moves tail
+  struct EventQueue {
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    volatile uint8_t ir[ETHERNET_EVENT_QUEUE];
+  } events[MAX_SOCK_NUM];
+  void pushEvent(SOCKET s, uint8_t ir);
+
+  uint8_t softReset();
+  uint8_t isW5100();
+  uint8_t isW5200();
+  uint8_t isW5500();
+
+  // The W5500 frames carry a block select byte instead of a flat address
+  uint16_t writeW5500(uint8_t _ctrl, uint16_t _addr, const uint8_t *_buf, uint16_t _len);
+  uint16_t readW5500(uint8_t _ctrl, uint16_t _addr, uint8_t *_buf, uint16_t _len);
+  // Build the W5100/W5200 frame header for a block at _addr, returns its length
+  uint8_t header(uint8_t *_hdr, uint16_t _addr, uint16_t _len, uint8_t _write);
+
+  // Second half of a background copy that wraps around the buffer end
+  struct AsyncSegment {
+    uint8_t hdr[4];
+    uint8_t hdrlen;
+    uint8_t *rx;
+    const uint8_t *tx;
+    uint16_t len;
+    EthernetTransport::Callback done;
+    void *arg;
+  } next;
+  static void asyncChain(void *arg);
 
-private:
-#if !defined(SPI_HAS_EXTENDED_CS_PIN_HANDLING)
-  #define SPI_ETHERNET_SETTINGS SPISettings(4000000, MSBFIRST, SPI_MODE0)
-  #if defined(ARDUINO_ARCH_AVR)
-    #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
-      inline static void initSS()    { DDRB  |=  _BV(4); };
-      inline static void setSS()     { PORTB &= ~_BV(4); };
-      inline static void resetSS()   { PORTB |=  _BV(4); };
-    #elif defined(__AVR_ATmega32U4__)
-      inline static void initSS()    { DDRB  |=  _BV(6); };
-      inline static void setSS()     { PORTB &= ~_BV(6); };
-      inline static void resetSS()   { PORTB |=  _BV(6); };
-    #elif defined(__AVR_AT90USB1286__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB162__)
-      inline static void initSS()    { DDRB  |=  _BV(0); };
-      inline static void setSS()     { PORTB &= ~_BV(0); };
-      inline static void resetSS()   { PORTB |=  _BV(0); };
-    #else
-      inline static void initSS()    { DDRB  |=  _BV(2); };
-      inline static void setSS()     { PORTB &= ~_BV(2); };
-      inline static void resetSS()   { PORTB |=  _BV(2); };
-    #endif
-  #elif defined(__ARDUINO_ARC__)
-	inline static void initSS() { pinMode(10, OUTPUT); };
-	inline static void setSS() { digitalWrite(10, LOW); };
-	inline static void resetSS() { digitalWrite(10, HIGH); };
-  #else
-    inline static void initSS() {
-      *portModeRegister(digitalPinToPort(ETHERNET_SHIELD_SPI_CS)) |= digitalPinToBitMask(ETHERNET_SHIELD_SPI_CS);
-    }
-    inline static void setSS()   {
-      *portOutputRegister(digitalPinToPort(ETHERNET_SHIELD_SPI_CS)) &= ~digitalPinToBitMask(ETHERNET_SHIELD_SPI_CS);
-    }
-    inline static void resetSS() {
-      *portOutputRegister(digitalPinToPort(ETHERNET_SHIELD_SPI_CS)) |= digitalPinToBitMask(ETHERNET_SHIELD_SPI_CS);
-    }
-  #endif
-#else
-  #define SPI_ETHERNET_SETTINGS ETHERNET_SHIELD_SPI_CS,SPISettings(4000000, MSBFIRST, SPI_MODE0)
-  // initSS(), setSS(), resetSS() not needed with EXTENDED_CS_PIN_HANDLING
+public:
+  // Socket layer bookkeeping (socket.cpp), kept per controller
+  struct SocketState {
+    uint16_t RX_RSR; // Bytes known to be waiting in the Rx buffer
+    uint16_t TX_FSR; // Bytes known to be free in the Tx buffer
+    uint16_t TX_QUEUED; // Bytes written past TX_WR, not yet covered by a SEND
+    uint16_t TX_HOLD;   // Coalescing: hold SEND until this much is queued, 0 = off
+    uint16_t TX_DELAY;  // ... or until the oldest queued byte is this many ms old
+    uint16_t TX_SINCE;  // millis() when the queue last became non-empty
+    uint8_t IR;      // SnIR events taken from the interrupt queue, not yet waited on
+    bool SENDING;    // A SEND is waiting for SEND_OK
+    uint16_t RX_HEAD;   // Bytes read past RX_RD, not yet given back with RECV
+    uint16_t RX_COMMIT; // Give them back once this many are read, 0 = half the buffer
+    uint8_t *RX_BUF;    // Read-ahead: copy of the Rx data from RX_RD + RX_HEAD on, or NULL
+    uint16_t RX_BUFSIZE;
+    uint16_t RX_POS;    // Bytes of RX_BUF already read
+    uint16_t RX_FILL;   // Bytes copied into RX_BUF
+#if ETHERNET_READ_AHEAD > 0
+    uint8_t RX_AHEAD[ETHERNET_READ_AHEAD];
 #endif
+  } socketState[MAX_SOCK_NUM];
+  uint8_t socketsOwned; // One bit per socket held by socketAcquire() or socket(), until close()
+  uint16_t localPort;
+  struct {
+    SOCKET s;
+    uint16_t len;  // Bytes being copied, 0 when no copy is running
+    uint16_t ptr;  // TX_WR after a send copy
+    bool send;
+  } asyncCopy;     // The recvAsync()/sendAsync() copy in flight
+
+  uint16_t SSIZE[MAX_SOCK_NUM]; // Tx buffer size, a power of two
+  uint16_t RSIZE[MAX_SOCK_NUM]; // Rx buffer size, a power of two
+private:
+  uint16_t SBASE[MAX_SOCK_NUM]; // Tx buffer base address
+  uint16_t RBASE[MAX_SOCK_NUM]; // Rx buffer base address
+  uint8_t txKB[MAX_SOCK_NUM];   // Requested Tx buffer size in K, 0 for 2K
+  uint8_t rxKB[MAX_SOCK_NUM];   // Requested Rx buffer size in K, 0 for 2K
+
+  void setupMemory();
+  static inline uint8_t validBufferSize(uint8_t kb) { return kb == 1 || kb == 2 || kb == 4 || kb == 8; }
+  static inline uint8_t sizeCode(uint8_t kb) { return (kb >> 1) - (kb >> 3); } // 1,2,4,8 -> 0,1,2,3
 };
 
 extern W5100Class W5100;
 
-uint8_t W5100Class::readSn(SOCKET _s, uint16_t _addr) {
-  return read(CH_BASE + _s * CH_SIZE + _addr);
-}
+/**
+ * @brief	Holds the bus for as long as it is in scope.  Sessions nest, so a
+ *        caller can open one around several socket calls, each of which
+ *        opens its own, and pay for a single bus transaction.  Blocking
+ *        waits inside a session keep the bus.
+ */
+class EthernetSession {
+public:
+  EthernetSession(W5100Class &chip = W5100) : _chip(chip) { _chip.beginTransaction(); }
+  ~EthernetSession() { _chip.endTransaction(); }
 
-uint8_t W5100Class::writeSn(SOCKET _s, uint16_t _addr, uint8_t _data) {
-  return write(CH_BASE + _s * CH_SIZE + _addr, _data);
-}
+private:
+  W5100Class &_chip;
 
-uint16_t W5100Class::readSn(SOCKET _s, uint16_t _addr, uint8_t *_buf, uint16_t _len) {
-  return read(CH_BASE + _s * CH_SIZE + _addr, _buf, _len);
-}
+  EthernetSession(const EthernetSession &);
+  EthernetSession &operator=(const EthernetSession &);
+};
 
-uint16_t W5100Class::writeSn(SOCKET _s, uint16_t _addr, uint8_t *_buf, uint16_t _len) {
-  return write(CH_BASE + _s * CH_SIZE + _addr, _buf, _len);
-}
+/**
+ * @brief	Lends socket s a read-ahead buffer for as long as it is in scope,
+ *        unless it has one already, so code reading it a byte at a time is
+ *        served from RAM.  Nothing is lost when it goes: bytes that were not
+ *        read are still in the chip.
+ */
+class EthernetReadAhead {
+public:
+  EthernetReadAhead(W5100Class &chip, SOCKET s);
+  ~EthernetReadAhead();
+
+private:
+  W5100Class &_chip;
+  SOCKET _s;
+  bool _lent;
+  uint8_t _buf[ETHERNET_PARSE_AHEAD];
+
+  EthernetReadAhead(const EthernetReadAhead &);
+  EthernetReadAhead &operator=(const EthernetReadAhead &);
+};
 
 void W5100Class::getGatewayIp(uint8_t *_addr) {
   readGAR(_addr);
@@ -416,11 +854,17 @@ void W5100Class::setIPAddress(uint8_t *_addr) {
 }
 
 void W5100Class::setRetransmissionTime(uint16_t _timeout) {
-  writeRTR(_timeout);
+  if (chip == 55)
+    writeRTR_W5500(_timeout);
+  else
+    writeRTR(_timeout);
 }
 
 void W5100Class::setRetransmissionCount(uint8_t _retry) {
-  writeRCR(_retry);
+  if (chip == 55)
+    writeRCR_W5500(_retry);
+  else
+    writeRCR(_retry);
 }
 
 #endif